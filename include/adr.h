@@ -0,0 +1,26 @@
+
+#ifndef __ADR_H__
+#define __ADR_H__
+
+#include "lora.h"
+
+/*
+ * Adaptive data rate: link quality history of each peer and selection of
+ * the fastest configuration that keeps the target delivery probability.
+ */
+#define ADR_MAX_PEERS            32
+#define ADR_HISTORY              20       // packets remembered per peer
+#define ADR_MIN_SAMPLES          4        // before any recommendation
+#define ADR_PAYLOAD              32       // payload size used to compare time on air
+
+typedef struct adr adr_t;
+
+adr_t *adr_create(void);
+void adr_destroy(adr_t *adr);
+void adr_set_target(adr_t *adr, float delivery, float margin);
+void adr_set_range(adr_t *adr, int min_sf, int max_sf, long min_bw, long max_bw, int min_power, int max_power);
+void adr_report(adr_t *adr, int peer, lora_config_t *cfg, float snr, int delivered);
+void adr_forget(adr_t *adr, int peer);
+int adr_recommend(adr_t *adr, int peer, lora_config_t *cfg);
+
+#endif
@@ -0,0 +1,23 @@
+
+#ifndef __DUTYCYCLE_H__
+#define __DUTYCYCLE_H__
+
+#include <stdint.h>
+
+/*
+ * Duty cycle budget of the regulatory sub-bands, over a sliding window.
+ */
+#define DC_WINDOW_US             3600000000ULL     // one hour
+#define DC_NEVER                 UINT64_MAX        // frame longer than the budget
+
+typedef struct dc dc_t;
+
+dc_t *dc_create(void);
+void dc_destroy(dc_t *dc);
+void dc_clear(dc_t *dc);
+int dc_add_band(dc_t *dc, long low, long high, float duty);
+int dc_load_region(dc_t *dc, char *region);
+uint64_t dc_delay(dc_t *dc, long frequency, uint64_t now, uint64_t airtime);
+void dc_record(dc_t *dc, long frequency, uint64_t start, uint64_t airtime);
+
+#endif
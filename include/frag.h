@@ -0,0 +1,47 @@
+
+#ifndef __FRAG_H__
+#define __FRAG_H__
+
+#include "lora.h"
+#include <stdint.h>
+
+/*
+ * Transport of messages larger than one packet: each packet carries a
+ * fragment with a compact header (see frag.c).
+ */
+#define FRAG_HEADER              6
+#define FRAG_PAYLOAD             (255 - FRAG_HEADER)
+#define FRAG_MAX_COUNT           4096              // fragments per message
+#define FRAG_MAX_MESSAGES        8                 // messages reassembled at once
+#define FRAG_MAX_WINDOW          64                // fragments in flight (reliable transfers)
+
+/*
+ * First byte of every packet of the transport. Once a transport is created
+ * on a radio, other packets starting with one of these bytes must be sent
+ * escaped with frag_escape(), or they are taken as transport packets.
+ */
+#define FRAG_TYPE_DATA           0xe0
+#define FRAG_FLAG_RELIABLE       0x01              // receiver acknowledges on request
+#define FRAG_FLAG_POLL           0x02              // request for an acknowledgement
+#define FRAG_TYPE_ACK            0xe8
+#define FRAG_TYPE_BATCH          0xf0              // several small messages
+#define FRAG_BATCH_MAX           253               // largest message aggregated
+#define FRAG_TYPE_ESCAPED        0xf8              // other packet starting with one of the types
+
+typedef struct frag frag_t;
+
+frag_t *frag_create(lora_dev_t *dev);
+void frag_destroy(frag_t *f);
+void frag_set_limits(frag_t *f, long max_size, int timeout);
+void frag_set_window(frag_t *f, int window, int retries);
+int frag_send(frag_t *f, uint8_t *buf, long size);
+int frag_send_reliable(frag_t *f, uint8_t *buf, long size);
+long frag_receive(frag_t *f, uint8_t **buf, int timeout);
+void frag_set_batching(frag_t *f, int frame_size, int latency);
+int frag_post(frag_t *f, uint8_t *buf, int size);
+int frag_flush(frag_t *f);
+void frag_batch_info(frag_t *f, unsigned long *sent, unsigned long *rejected);
+void frag_arq_info(frag_t *f, long *rtt, long *rto, unsigned long *retransmissions);
+int frag_escape(uint8_t *in, int size, uint8_t *out);
+
+#endif
@@ -2,10 +2,29 @@
 #ifndef __GPIO_H__
 #define __GPIO_H__
 
+#include <stdint.h>
+
+/*
+ * Transport used to reach the pins (see gpio_set_transport()).
+ */
+typedef struct {
+   int (*open)(char *device, int pin, int output);
+   int (*close)(int pin, int fd);
+   void (*output)(int fd, int val);
+   int (*input)(int fd);
+   int (*wait)(int pin, int fd, int rising, int timeout);
+   int (*wait_stamp)(int pin, int fd, int rising, int timeout, uint64_t *stamp);   // optional
+} gpio_transport_t;
+
+void gpio_set_transport(gpio_transport_t *t);
+gpio_transport_t *gpio_get_transport(void);
+void gpio_set_chip(char *device);
 int gpio_open(int pin, int output);
+int gpio_open_chip(char *device, int pin, int output);
 int gpio_close(int pin, int fd);
 void gpio_output(int fd, int val);
 int gpio_input(int fd);
 int gpio_wait(int pin, int fd, int rising, int timeout);
+int gpio_wait_stamp(int pin, int fd, int rising, int timeout, uint64_t *stamp);
 
 #endif
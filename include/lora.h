@@ -2,32 +2,178 @@
 #ifndef __LORA_H__
 #define __LORA_H__
 
-void lora_reset(void);
-void lora_explicit_header_mode(void);
-void lora_implicit_header_mode(int size);
-void lora_idle(void);
-void lora_sleep(void); 
-void lora_receive(void);
-void lora_set_tx_power(int level);
-void lora_set_frequency(long frequency);
-void lora_set_spreading_factor(int sf);
-void lora_set_bandwidth(long sbw);
-void lora_set_coding_rate(int denominator);
-void lora_set_preamble_length(long length);
-void lora_set_sync_word(int sw);
-void lora_enable_crc(void);
-void lora_disable_crc(void);
-void lora_set_pins(char *spidev, int cs, int rst, int irq);
-int lora_init(void);
-void lora_send_packet(uint8_t *buf, int size);
-int lora_receive_packet(uint8_t *buf, int size);
-int lora_received(void);
-int lora_packet_rssi(void);
-float lora_packet_snr(void);
-void lora_close(void);
-int lora_initialized(void);
-void lora_dump_registers(void);
-void lora_wait_for_packet(int timeout);
-void lora_on_receive(void (*cb)(void));
+#include <stdint.h>
+
+/*
+ * Complete radio configuration (see lora_apply_config()).
+ */
+typedef struct {
+   long frequency;               // Hz
+   int spreading_factor;         // 6-12
+   long bandwidth;               // Hz
+   int coding_rate;              // 5-8 (denominator of 4/x)
+   long preamble_length;         // symbols
+   int sync_word;
+   int crc;                      // non-zero to enable CRC
+   int tx_power;                 // 2-17
+   int implicit_size;            // packet size for implicit header mode, 0 = explicit header
+} lora_config_t;
+
+/*
+ * Channel of a channel plan (see lora_set_channels()).
+ */
+#define LORA_MAX_CHANNELS        16
+#define LORA_MAX_DICT            32768    // compression dictionary size (LZ_MAX_DICT)
+
+typedef struct {
+   long frequency;               // Hz
+   int spreading_factor;         // 6-12, 0 = current one
+   long bandwidth;               // Hz, 0 = current one
+} lora_channel_t;
+
+/*
+ * End of transmission detection (see lora_set_tx_wait()).
+ */
+#define LORA_TX_WAIT_IRQ         0
+#define LORA_TX_WAIT_TIMED       1
+
+/*
+ * Priorities for the transmission queue (see lora_send_async()).
+ */
+#define LORA_PRIO_LOW            0
+#define LORA_PRIO_NORMAL         1
+#define LORA_PRIO_HIGH           2
+#define LORA_PRIO_URGENT         3
+
+/*
+ * Completion status of queued packets.
+ */
+#define LORA_TX_SENT             0
+#define LORA_TX_EXPIRED          1
+#define LORA_TX_CANCELLED        2
+#define LORA_TX_REJECTED         3        // refused or failed by lora_send_packet()
+
+/*
+ * Received packet with its metadata (see lora_rx_pop()).
+ */
+typedef struct {
+   uint8_t data[255];
+   int size;
+   int rssi;                     // dBm
+   float snr;                    // dB
+   int crc_error;                // non-zero if the payload CRC failed
+   uint64_t timestamp;           // RxDone interrupt, us (CLOCK_MONOTONIC, see lora_packet_timestamp())
+} lora_packet_t;
+
+/*
+ * Latency histogram: bucket 0 counts values below 1 us, bucket i (i > 0)
+ * values from 2^(i-1) to 2^i - 1 us; the last bucket also takes everything above.
+ */
+#define LORA_HIST_BUCKETS        24
+
+typedef struct {
+   uint64_t count;
+   uint64_t sum;                 // us
+   uint64_t max;                 // us
+   uint64_t buckets[LORA_HIST_BUCKETS];
+} lora_hist_t;
+
+/*
+ * Runtime statistics of a radio (see lora_get_stats()).
+ */
+typedef struct {
+   uint64_t tx_packets;
+   uint64_t tx_airtime;          // us
+   uint64_t rx_packets;
+   uint64_t crc_errors;
+   uint64_t rx_overruns;         // packets lost with the reception ring full
+   uint64_t cad_busy;            // transmissions put off by listen-before-talk
+   uint64_t spi_transactions;    // submitted SPI messages
+   uint64_t spi_transfers;
+   uint64_t spi_bytes;
+   uint64_t lock_count;          // radio lock acquisitions
+   uint64_t lock_contended;      // acquisitions that had to wait
+   lora_hist_t lock_wait;        // time waiting for the radio lock
+   lora_hist_t lock_hold;        // time holding the radio lock
+   lora_hist_t irq_latency;      // interrupt to receive callback
+} lora_stats_t;
+
+/*
+ * Handle for one radio transceiver (see lora_create() and lora_default()).
+ */
+typedef struct lora_dev lora_dev_t;
+
+typedef void (*lora_tx_done_t)(int handle, int status, void *arg);
+typedef int (*lora_rx_filter_t)(lora_packet_t *pkt, void *arg);
+
+lora_dev_t *lora_create(void);
+void lora_destroy(lora_dev_t *dev);
+lora_dev_t *lora_default(void);
+void lora_reset(lora_dev_t *dev);
+void lora_explicit_header_mode(lora_dev_t *dev);
+void lora_implicit_header_mode(lora_dev_t *dev, int size);
+void lora_idle(lora_dev_t *dev);
+void lora_sleep(lora_dev_t *dev);
+void lora_receive(lora_dev_t *dev);
+void lora_set_tx_power(lora_dev_t *dev, int level);
+void lora_set_frequency(lora_dev_t *dev, long frequency);
+void lora_set_spreading_factor(lora_dev_t *dev, int sf);
+void lora_set_bandwidth(lora_dev_t *dev, long sbw);
+void lora_set_coding_rate(lora_dev_t *dev, int denominator);
+void lora_set_preamble_length(lora_dev_t *dev, long length);
+void lora_set_sync_word(lora_dev_t *dev, int sw);
+void lora_enable_crc(lora_dev_t *dev);
+void lora_disable_crc(lora_dev_t *dev);
+void lora_get_config(lora_dev_t *dev, lora_config_t *cfg);
+void lora_apply_config(lora_dev_t *dev, lora_config_t *cfg);
+void lora_set_pins(lora_dev_t *dev, char *spidev, int cs, int rst, int irq);
+void lora_set_hw_cs(lora_dev_t *dev, int enable);
+void lora_set_gpio_chip(lora_dev_t *dev, char *device);
+int lora_init(lora_dev_t *dev);
+void lora_set_tx_wait(lora_dev_t *dev, int mode);
+void lora_set_transceive(lora_dev_t *dev, int enable);
+void lora_set_lbt(lora_dev_t *dev, int attempts, int slot);
+int lora_send_packet(lora_dev_t *dev, uint8_t *buf, int size);
+long lora_time_on_air(lora_dev_t *dev, int size);
+int lora_set_duty_cycle(lora_dev_t *dev, char *region);
+int lora_add_subband(lora_dev_t *dev, long low, long high, float duty);
+long lora_tx_delay(lora_dev_t *dev, int size);
+long lora_config_airtime(lora_config_t *cfg, int size);
+int lora_adr_report(lora_dev_t *dev, int peer, float snr, int delivered);
+void lora_adr_forget(lora_dev_t *dev, int peer);
+int lora_adr_set_target(lora_dev_t *dev, float delivery, float margin);
+int lora_adr_set_range(lora_dev_t *dev, int min_sf, int max_sf, long min_bw, long max_bw, int min_power, int max_power);
+int lora_adr_recommend(lora_dev_t *dev, int peer, lora_config_t *cfg);
+int lora_adr_apply(lora_dev_t *dev, int peer);
+int lora_set_compression(lora_dev_t *dev, uint8_t *dict, int size);
+int lora_set_channels(lora_dev_t *dev, lora_channel_t *list, int count);
+int lora_select_channel(lora_dev_t *dev, int index);
+int lora_current_channel(lora_dev_t *dev);
+int lora_get_channel(lora_dev_t *dev, int index, lora_channel_t *ch, uint64_t *airtime);
+int lora_send_async(lora_dev_t *dev, uint8_t *buf, int size, int priority, long deadline, lora_tx_done_t done, void *arg);
+int lora_tx_pending(lora_dev_t *dev);
+int lora_tx_flush(lora_dev_t *dev, int timeout);
+int lora_receive_packet(lora_dev_t *dev, uint8_t *buf, int size);
+int lora_receive_window(lora_dev_t *dev, uint64_t open_at, int symbols, uint8_t *buf, int size);
+uint64_t lora_clock_us(void);
+uint64_t lora_packet_timestamp(lora_dev_t *dev);
+uint64_t lora_tx_timestamp(lora_dev_t *dev);
+int lora_received(lora_dev_t *dev);
+int lora_packet_rssi(lora_dev_t *dev);
+float lora_packet_snr(lora_dev_t *dev);
+void lora_close(lora_dev_t *dev);
+int lora_initialized(lora_dev_t *dev);
+void lora_dump_registers(lora_dev_t *dev);
+int lora_verify_shadow(lora_dev_t *dev);
+void lora_wait_for_packet(lora_dev_t *dev, int timeout);
+void lora_on_receive(lora_dev_t *dev, void (*cb)(void *arg), void *arg);
+int lora_rx_start(lora_dev_t *dev);
+void lora_rx_stop(lora_dev_t *dev);
+int lora_rx_pop(lora_dev_t *dev, lora_packet_t *pkt);
+void lora_set_rx_filter(lora_dev_t *dev, lora_rx_filter_t filter, void *arg);
+int lora_set_rx_depth(lora_dev_t *dev, int depth);
+void lora_get_stats(lora_dev_t *dev, lora_stats_t *stats);
+void lora_reset_stats(lora_dev_t *dev);
+void lora_rx_ring_info(lora_dev_t *dev, int *depth, int *queued, unsigned long *received, unsigned long *overflows);
 
 #endif
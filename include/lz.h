@@ -0,0 +1,27 @@
+
+#ifndef __LZ_H__
+#define __LZ_H__
+
+#include <stdint.h>
+
+/*
+ * LZ77 compression of single frames against a shared dictionary (see lz.c).
+ */
+#define LZ_MAX_DICT              32768
+
+/*
+ * First byte of frames that need decoding; other frames are sent as they are.
+ */
+#define LZ_MARK_COMPRESSED       0xfc
+#define LZ_MARK_ESCAPED          0xfd     // raw frame starting with one of the marks
+
+typedef struct lz lz_t;
+
+lz_t *lz_create(uint8_t *dict, int size);
+void lz_destroy(lz_t *lz);
+int lz_compress(lz_t *lz, uint8_t *in, int size, uint8_t *out, int max);
+int lz_decompress(lz_t *lz, uint8_t *in, int size, uint8_t *out, int max);
+int lz_encode_frame(lz_t *lz, uint8_t *in, int size, uint8_t *out);
+int lz_decode_frame(lz_t *lz, uint8_t *in, int size, uint8_t *out);
+
+#endif
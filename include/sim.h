@@ -0,0 +1,22 @@
+
+#ifndef __SIM_H__
+#define __SIM_H__
+
+#include <stdint.h>
+
+/*
+ * Software model of a SX127x transceiver, reached through the SPI and
+ * GPIO transports (see sim_install()).
+ */
+typedef struct sim_radio sim_radio_t;
+
+void sim_install(void);
+void sim_uninstall(void);
+void sim_set_speed(int factor);
+sim_radio_t *sim_add_radio(char *spi_device, int rst_pin, int irq_pin);
+void sim_set_link(sim_radio_t *r, int rssi, float snr);
+long sim_inject(sim_radio_t *r, uint8_t *data, int size, int crc_error);
+long sim_airtime_us(sim_radio_t *r, int size);
+int sim_read_register(sim_radio_t *r, int reg);
+
+#endif
@@ -3,7 +3,48 @@
 #define __SPI_H__
 
 #include <stdint.h>
+#include <linux/types.h>
+#include <linux/spi/spidev.h>
+
+/*
+ * Limits for a queued SPI transaction.
+ */
+#define SPI_MSG_MAX_XFERS        16
+#define SPI_MSG_MAX_BYTES        320
+
+/*
+ * A sequence of transfers submitted to the kernel as a single message.
+ * Each transfer is framed by its own chip-select pulse.
+ */
+typedef struct {
+   int fd;
+   int cs;
+   int count;
+   int used;
+   int overflow;                       // a transfer did not fit (see spi_msg_add())
+   struct spi_ioc_transfer xfer[SPI_MSG_MAX_XFERS];
+   uint8_t tx[SPI_MSG_MAX_BYTES];
+   uint8_t rx[SPI_MSG_MAX_BYTES];
+} spi_msg_t;
+
+/*
+ * Transport used to reach the SPI devices (see spi_set_transport()).
+ */
+typedef struct {
+   int (*open)(char *device, int hw_cs);
+   int (*message)(int fd, struct spi_ioc_transfer *xfer, int count);
+   void (*close)(int fd);
+} spi_transport_t;
+
+void spi_set_transport(spi_transport_t *t);
+spi_transport_t *spi_get_transport(void);
 void spi_transfer(int fd, uint8_t *tx, uint8_t *rx, int size);
 int spi_init(char *device);
+int spi_open(char *device, int hw_cs);
+void spi_close(int fd);
+
+void spi_msg_init(spi_msg_t *m, int fd, int cs);
+uint8_t *spi_msg_add(spi_msg_t *m, uint8_t addr, uint8_t *data, int size);
+int spi_msg_submit(spi_msg_t *m);
 
 #endif
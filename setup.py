@@ -5,8 +5,13 @@ mod = Extension("PyLora",
                 sources = ["src/PyLora.c", 
                            "src/lora.c",
                            "src/gpio.c",
-                           "src/spi.c"],
-                extra_compile_args = ["-std=c99"],
+                           "src/spi.c",
+                           "src/sim.c",
+                           "src/dutycycle.c",
+                           "src/adr.c",
+                           "src/frag.c",
+                           "src/lz.c"],
+                extra_compile_args = ["-std=gnu99"],
                 include_dirs = ["./include"])
 
 setup(
@@ -1,10 +1,52 @@
 
 #include <Python.h>
 #include "lora.h"
+#include "frag.h"
 
-int check(void)
+/**
+ * Python side state of one radio.
+ */
+typedef struct {
+   lora_dev_t *dev;
+   PyObject *callback;                       // on_receive() callback
+   int callback_data;                        // callback gets the packet data
+   int callback_batch;                       // callback gets all packets in one list
+   frag_t *frag;                             // message transport, created on first use
+} radio_state_t;
+
+/**
+ * PyLora.Radio object.
+ */
+typedef struct {
+   PyObject_HEAD
+   radio_state_t state;
+} RadioObject;
+
+/*
+ * State of the radio used by the module level functions.
+ */
+static radio_state_t default_state = { NULL, NULL, 0, 0, NULL };
+
+/**
+ * Module level functions are called with self == NULL and work on the
+ * default radio; Radio methods work on their own radio.
+ */
+static radio_state_t *
+get_state(PyObject *self)
+{
+   if(self == NULL) return &default_state;
+   return &((RadioObject *)self)->state;
+}
+
+static lora_dev_t *
+get_dev(PyObject *self)
 {
-   if(lora_initialized()) return 1;
+   return get_state(self)->dev;
+}
+
+int check(lora_dev_t *dev)
+{
+   if(lora_initialized(dev)) return 1;
    PyErr_SetString(PyExc_RuntimeError, "Lora not initialized");
    return 0;
 }
@@ -12,164 +54,237 @@ int check(void)
 static PyObject *
 reset(PyObject *self)
 {
-   if(!check()) return NULL;
-   lora_reset();
+   lora_dev_t *dev = get_dev(self);
+   if(!check(dev)) return NULL;
+   lora_reset(dev);
    Py_RETURN_NONE;
 }
 
 static PyObject *
 explicit_header_mode(PyObject *self)
 {
-   if(!check()) return NULL;
-   lora_explicit_header_mode();
+   lora_dev_t *dev = get_dev(self);
+   if(!check(dev)) return NULL;
+   lora_explicit_header_mode(dev);
    Py_RETURN_NONE;
 }
 
 static PyObject *
 implicit_header_mode(PyObject *self, PyObject *args)
 {
+   lora_dev_t *dev = get_dev(self);
    int size;
-   if(!check()) return NULL;
+   if(!check(dev)) return NULL;
    if(!PyArg_ParseTuple(args, "i", &size)) return NULL;
-   lora_implicit_header_mode(size);
+   lora_implicit_header_mode(dev, size);
    Py_RETURN_NONE;
 }
 
 static PyObject *
 idle(PyObject *self)
 {
-   if(!check()) return NULL;
-   lora_idle();
+   lora_dev_t *dev = get_dev(self);
+   if(!check(dev)) return NULL;
+   lora_idle(dev);
    Py_RETURN_NONE;
 }
 
 static PyObject *
 _sleep(PyObject *self)
 {
-   if(!check()) return NULL;
-   lora_sleep();
+   lora_dev_t *dev = get_dev(self);
+   if(!check(dev)) return NULL;
+   lora_sleep(dev);
    Py_RETURN_NONE;
 }
 
 static PyObject *
 receive(PyObject *self)
 {
-   if(!check()) return NULL;
-   lora_receive();
+   lora_dev_t *dev = get_dev(self);
+   if(!check(dev)) return NULL;
+   lora_receive(dev);
    Py_RETURN_NONE;
 }
 
 static PyObject *
 set_tx_power(PyObject *self, PyObject *args)
 {
+   lora_dev_t *dev = get_dev(self);
    int power;
-   if(!check()) return NULL;
+   if(!check(dev)) return NULL;
    if(!PyArg_ParseTuple(args, "i", &power)) return NULL;
-   lora_set_tx_power(power);
+   lora_set_tx_power(dev, power);
    Py_RETURN_NONE;
 }
 
 static PyObject *
 set_frequency(PyObject *self, PyObject *args)
 {
+   lora_dev_t *dev = get_dev(self);
    long freq;
-   if(!check()) return NULL;
+   if(!check(dev)) return NULL;
    if(!PyArg_ParseTuple(args, "l", &freq)) return NULL;
-   lora_set_frequency(freq);
+   lora_set_frequency(dev, freq);
    Py_RETURN_NONE;
 }
 
 static PyObject *
 set_spreading_factor(PyObject *self, PyObject *args)
 {
+   lora_dev_t *dev = get_dev(self);
    int sf;
-   if(!check()) return NULL;
+   if(!check(dev)) return NULL;
    if(!PyArg_ParseTuple(args, "i", &sf)) return NULL;
-   lora_set_spreading_factor(sf);
+   lora_set_spreading_factor(dev, sf);
    Py_RETURN_NONE;
 }
 
 static PyObject *
 set_bandwidth(PyObject *self, PyObject *args)
 {
+   lora_dev_t *dev = get_dev(self);
    long bw;
-   if(!check()) return NULL;
+   if(!check(dev)) return NULL;
    if(!PyArg_ParseTuple(args, "l", &bw)) return NULL;
-   lora_set_bandwidth(bw);
+   lora_set_bandwidth(dev, bw);
    Py_RETURN_NONE;
 }
 
 static PyObject *
 set_coding_rate(PyObject *self, PyObject *args)
 {
+   lora_dev_t *dev = get_dev(self);
    int cr;
-   if(!check()) return NULL;
+   if(!check(dev)) return NULL;
    if(!PyArg_ParseTuple(args, "i", &cr)) return NULL;
-   lora_set_coding_rate(cr);
+   lora_set_coding_rate(dev, cr);
    Py_RETURN_NONE;
 }
 
 static PyObject *
 set_preamble_length(PyObject *self, PyObject *args)
 {
+   lora_dev_t *dev = get_dev(self);
    long pre;
-   if(!check()) return NULL;
+   if(!check(dev)) return NULL;
    if(!PyArg_ParseTuple(args, "l", &pre)) return NULL;
-   lora_set_preamble_length(pre);
+   lora_set_preamble_length(dev, pre);
    Py_RETURN_NONE;
 }
 
 static PyObject *
 set_sync_word(PyObject *self, PyObject *args)
 {
+   lora_dev_t *dev = get_dev(self);
    int w;
-   if(!check()) return NULL;
+   if(!check(dev)) return NULL;
    if(!PyArg_ParseTuple(args, "i", &w)) return NULL;
-   lora_set_sync_word(w);
+   lora_set_sync_word(dev, w);
    Py_RETURN_NONE;
 }
 
 static PyObject *
 enable_crc(PyObject *self)
 {
-   if(!check()) return NULL;
-   lora_enable_crc();
+   lora_dev_t *dev = get_dev(self);
+   if(!check(dev)) return NULL;
+   lora_enable_crc(dev);
    Py_RETURN_NONE;
 }
 
 static PyObject *
 disable_crc(PyObject *self)
 {
-   if(!check()) return NULL;
-   lora_disable_crc();
+   lora_dev_t *dev = get_dev(self);
+   if(!check(dev)) return NULL;
+   lora_disable_crc(dev);
+   Py_RETURN_NONE;
+}
+
+/**
+ * Convert a radio configuration into a dictionary.
+ */
+static PyObject *
+profile_dict(lora_config_t *cfg)
+{
+   return Py_BuildValue("{s:l,s:i,s:l,s:i,s:l,s:i,s:O,s:i,s:i}",
+      "frequency", cfg->frequency,
+      "spreading_factor", cfg->spreading_factor,
+      "bandwidth", cfg->bandwidth,
+      "coding_rate", cfg->coding_rate,
+      "preamble_length", cfg->preamble_length,
+      "sync_word", cfg->sync_word,
+      "crc", cfg->crc ? Py_True : Py_False,
+      "tx_power", cfg->tx_power,
+      "implicit_size", cfg->implicit_size);
+}
+
+static PyObject *
+get_profile(PyObject *self)
+{
+   lora_dev_t *dev = get_dev(self);
+   lora_config_t cfg;
+   if(!check(dev)) return NULL;
+   lora_get_config(dev, &cfg);
+   return profile_dict(&cfg);
+}
+
+static PyObject *
+apply_profile(PyObject *self, PyObject *args, PyObject *keywords)
+{
+   lora_dev_t *dev = get_dev(self);
+   char *keys[] = { "frequency", "spreading_factor", "bandwidth", "coding_rate", "preamble_length", 
+      "sync_word", "crc", "tx_power", "implicit_size", NULL };
+   lora_config_t cfg;
+   if(!check(dev)) return NULL;
+
+   /*
+    * Parameters not given keep their current values.
+    */
+   lora_get_config(dev, &cfg);
+   if(!PyArg_ParseTupleAndKeywords(args, keywords, "|lililiiii", keys, &cfg.frequency, &cfg.spreading_factor,
+         &cfg.bandwidth, &cfg.coding_rate, &cfg.preamble_length, &cfg.sync_word, &cfg.crc, &cfg.tx_power, 
+         &cfg.implicit_size))
+      return NULL;
+
+   Py_BEGIN_ALLOW_THREADS
+   lora_apply_config(dev, &cfg);
+   Py_END_ALLOW_THREADS
    Py_RETURN_NONE;
 }
 
 static PyObject *
 set_pins(PyObject *self, PyObject *args, PyObject *keywords)
 {
-   if(lora_initialized()) {
+   lora_dev_t *dev = get_dev(self);
+   if(lora_initialized(dev)) {
       PyErr_SetString(PyExc_RuntimeError, "set_pins() has no effect after initialization");
       return NULL;
    }
 
-   char *keys[] = { "spi_device", "cs_pin", "rst_pin", "irq_pin", NULL };
+   char *keys[] = { "spi_device", "cs_pin", "rst_pin", "irq_pin", "hw_cs", "gpio_chip", NULL };
    char *spidev = NULL;
+   char *chip = NULL;
    int cs = -1;
    int rst = -1;
    int irq = -1;
+   int hw_cs = -1;
 
-   if(!PyArg_ParseTupleAndKeywords(args, keywords, "|siii", keys, &spidev, &cs, &rst, &irq)) 
+   if(!PyArg_ParseTupleAndKeywords(args, keywords, "|siiiis", keys, &spidev, &cs, &rst, &irq, &hw_cs, &chip)) 
       return NULL;
 
-   lora_set_pins(spidev, cs, rst, irq);
+   lora_set_pins(dev, spidev, cs, rst, irq);
+   if(hw_cs >= 0) lora_set_hw_cs(dev, hw_cs);
+   if(chip != NULL) lora_set_gpio_chip(dev, chip);
    Py_RETURN_NONE;
 }
 
 static PyObject *
 init(PyObject *self)
 {
-   int res = lora_init();
+   lora_dev_t *dev = get_dev(self);
+   int res = lora_init(dev);
    PyEval_InitThreads();                     // it seems to be necessary for using the global interpreter lock (GIL)
    return PyInt_FromLong(res);
 }
@@ -177,31 +292,140 @@ init(PyObject *self)
 static PyObject *
 packet_rssi(PyObject *self)
 {
-   if(!check()) return NULL;
-   int res = lora_packet_rssi();
+   lora_dev_t *dev = get_dev(self);
+   if(!check(dev)) return NULL;
+   int res = lora_packet_rssi(dev);
    return PyInt_FromLong(res);
 }
 
+static PyObject *
+packet_timestamp(PyObject *self)
+{
+   lora_dev_t *dev = get_dev(self);
+   uint64_t t = lora_packet_timestamp(dev);
+   if(t == 0) Py_RETURN_NONE;
+   return PyFloat_FromDouble(t / 1e6);
+}
+
+static PyObject *
+tx_timestamp(PyObject *self)
+{
+   lora_dev_t *dev = get_dev(self);
+   uint64_t t = lora_tx_timestamp(dev);
+   if(t == 0) Py_RETURN_NONE;
+   return PyFloat_FromDouble(t / 1e6);
+}
+
 static PyObject *
 packet_snr(PyObject *self)
 {
-   if(!check()) return NULL;
-   float res = lora_packet_snr();
+   lora_dev_t *dev = get_dev(self);
+   if(!check(dev)) return NULL;
+   float res = lora_packet_snr(dev);
    return PyFloat_FromDouble(res);
 }
 
+static PyObject *
+verify_registers(PyObject *self)
+{
+   lora_dev_t *dev = get_dev(self);
+   if(!check(dev)) return NULL;
+   int res = lora_verify_shadow(dev);
+   return PyInt_FromLong(res);
+}
+
 static PyObject *
 _close(PyObject *self)
 {
-   lora_close();
+   radio_state_t *st = get_state(self);
+   lora_dev_t *dev = st->dev;
+   frag_t *f = st->frag;
+   st->frag = NULL;
+   Py_BEGIN_ALLOW_THREADS
+   frag_destroy(f);
+   lora_close(dev);
+   Py_END_ALLOW_THREADS
+   Py_CLEAR(st->callback);
+   Py_RETURN_NONE;
+}
+
+static PyObject *
+set_transceive(PyObject *self, PyObject *args)
+{
+   lora_dev_t *dev = get_dev(self);
+   int enable;
+   if(!PyArg_ParseTuple(args, "i", &enable)) return NULL;
+   if(!check(dev)) return NULL;
+   lora_set_transceive(dev, enable);
    Py_RETURN_NONE;
 }
 
+static PyObject *
+set_lbt(PyObject *self, PyObject *args)
+{
+   lora_dev_t *dev = get_dev(self);
+   int attempts, slot = 0;
+   if(!PyArg_ParseTuple(args, "i|i", &attempts, &slot)) return NULL;
+   lora_set_lbt(dev, attempts, slot);
+   Py_RETURN_NONE;
+}
+
+static PyObject *
+set_tx_wait(PyObject *self, PyObject *args)
+{
+   lora_dev_t *dev = get_dev(self);
+   int mode;
+   if(!PyArg_ParseTuple(args, "i", &mode)) return NULL;
+   lora_set_tx_wait(dev, mode);
+   Py_RETURN_NONE;
+}
+
+/**
+ * Access the data of a message without copying it.
+ * Any object supporting the buffer protocol (bytes, bytearray, memoryview...)
+ * is used directly; other objects are converted to a bytearray.
+ * @param arg Message object.
+ * @param view Buffer to fill (release with PyBuffer_Release()).
+ * @return 1 if successful, 0 if error (exception set).
+ */
+static int
+get_data(PyObject *arg, Py_buffer *view)
+{
+   if(PyObject_GetBuffer(arg, view, PyBUF_SIMPLE) == 0) return 1;
+   PyErr_Clear();
+
+   PyObject *msg = PyByteArray_FromObject(arg);
+   if(msg == NULL) return 0;
+   int res = (PyObject_GetBuffer(msg, view, PyBUF_SIMPLE) == 0);
+   Py_DECREF(msg);
+   return res;
+}
+
+/**
+ * Copy a packet to be sent, escaped once the message transport is in use
+ * (see frag_escape()).
+ * @param view Packet data (up to 255 bytes are sent).
+ * @param frame Buffer for the frame (255 bytes).
+ * @return Frame size, or -1 if the escaped packet does not fit.
+ */
+static int
+escape(PyObject *self, Py_buffer *view, uint8_t *frame)
+{
+   int size = view->len > 255 ? 255 : view->len;
+   if(get_state(self)->frag == NULL) {
+      memcpy(frame, view->buf, size);
+      return size;
+   }
+   return frag_escape((uint8_t *)view->buf, size, frame);
+}
+
 static PyObject *
 send_packet(PyObject *self, PyObject *args)
 {
-   PyObject *arg, *msg;
-   if(!check()) return NULL;
+   lora_dev_t *dev = get_dev(self);
+   PyObject *arg;
+   Py_buffer view;
+   if(!check(dev)) return NULL;
 
    /*
     * Check parameter count
@@ -211,90 +435,594 @@ send_packet(PyObject *self, PyObject *args)
       return NULL;
    }
 
+   arg = PyTuple_GetItem(args, 0);
+   if(!get_data(arg, &view)) return NULL;
+
+   uint8_t frame[255];
+   int size = escape(self, &view, frame);
+
+   int sent = 0;
+   Py_BEGIN_ALLOW_THREADS
+   if(size >= 0) sent = lora_send_packet(dev, frame, size);
+   Py_END_ALLOW_THREADS
+
+   PyBuffer_Release(&view);
+   if(!sent) {
+      PyErr_SetString(PyExc_RuntimeError, "Packet exceeds the duty cycle budget of the sub-band, the channel is busy, the transmission did not end or the packet does not fit");
+      return NULL;
+   }
+   Py_RETURN_NONE;
+}
+
+static void __packet_sent(int handle, int status, void *arg)
+{
+   PyObject *funct = (PyObject *)arg;
+   if(funct == NULL) return;
+
+   PyGILState_STATE gstate = PyGILState_Ensure();
+   PyObject *res = PyObject_CallFunction(funct, "ii", handle, status);
+   Py_XDECREF(res);
+   Py_DECREF(funct);
+   PyGILState_Release(gstate);
+}
+
+static PyObject *
+send_async(PyObject *self, PyObject *args, PyObject *keywords)
+{
+   lora_dev_t *dev = get_dev(self);
+   char *keys[] = { "data", "priority", "deadline", "callback", NULL };
+   PyObject *arg;
+   PyObject *funct = Py_None;
+   int priority = LORA_PRIO_NORMAL;
+   double deadline = 0;
+   if(!check(dev)) return NULL;
+
+   if(!PyArg_ParseTupleAndKeywords(args, keywords, "O|idO", keys, &arg, &priority, &deadline, &funct)) 
+      return NULL;
+
+   if((funct != Py_None) && !PyCallable_Check(funct)) {
+      PyErr_SetString(PyExc_RuntimeError, "Callback for send_async() must be callable");
+      return NULL;
+   }
+
    /*
-    * Check parameter type (bytearray).
-    * Convert types if necessary.
+    * Data is copied into the queue.
     */
-   arg = PyTuple_GetItem(args, 0);
-   Py_XINCREF(arg);
-   if(PyByteArray_Check(arg)) msg = arg;
-   else {
-      msg = PyByteArray_FromObject(arg);
-      Py_XDECREF(arg);
-      if(msg == NULL) return NULL;
+   Py_buffer view;
+   if(!get_data(arg, &view)) return NULL;
+
+   uint8_t frame[255];
+   int size = escape(self, &view, frame);
+   PyBuffer_Release(&view);
+   if(size < 0) {
+      PyErr_SetString(PyExc_RuntimeError, "Packet does not fit once escaped from the message transport");
+      return NULL;
+   }
+
+   if(funct == Py_None) funct = NULL;
+   else Py_INCREF(funct);
+
+   int handle = lora_send_async(dev, frame, size, priority, 
+         (long)(deadline * 1000), funct ? __packet_sent : NULL, funct);
+
+   if(handle < 0) {
+      Py_XDECREF(funct);
+      PyErr_SetString(PyExc_RuntimeError, "Transmission queue is full");
+      return NULL;
+   }
+   return PyInt_FromLong(handle);
+}
+
+static PyObject *
+time_on_air(PyObject *self, PyObject *args)
+{
+   lora_dev_t *dev = get_dev(self);
+   int size;
+   if(!check(dev)) return NULL;
+   if(!PyArg_ParseTuple(args, "i", &size)) return NULL;
+   return PyFloat_FromDouble(lora_time_on_air(dev, size) / 1e6);
+}
+
+static PyObject *
+set_duty_cycle(PyObject *self, PyObject *args)
+{
+   lora_dev_t *dev = get_dev(self);
+   char *region = NULL;
+   if(!PyArg_ParseTuple(args, "z", &region)) return NULL;
+   if(!lora_set_duty_cycle(dev, region)) {
+      PyErr_SetString(PyExc_RuntimeError, "Unknown region");
+      return NULL;
    }
+   Py_RETURN_NONE;
+}
+
+static PyObject *
+add_subband(PyObject *self, PyObject *args)
+{
+   lora_dev_t *dev = get_dev(self);
+   long low, high;
+   float duty;
+   if(!PyArg_ParseTuple(args, "llf", &low, &high, &duty)) return NULL;
+   if(!lora_add_subband(dev, low, high, duty)) {
+      PyErr_SetString(PyExc_RuntimeError, "Invalid sub-band");
+      return NULL;
+   }
+   Py_RETURN_NONE;
+}
+
+static PyObject *
+tx_delay(PyObject *self, PyObject *args)
+{
+   lora_dev_t *dev = get_dev(self);
+   int size;
+   if(!check(dev)) return NULL;
+   if(!PyArg_ParseTuple(args, "i", &size)) return NULL;
+   long res = lora_tx_delay(dev, size);
+   if(res < 0) Py_RETURN_NONE;
+   return PyFloat_FromDouble(res / 1e6);
+}
+
+static PyObject *
+set_compression(PyObject *self, PyObject *args)
+{
+   lora_dev_t *dev = get_dev(self);
+   PyObject *arg;
+   Py_buffer view;
+   int res;
+   if(!PyArg_ParseTuple(args, "O", &arg)) return NULL;
+
+   if(arg == Py_None) {
+      lora_set_compression(dev, NULL, 0);
+      Py_RETURN_NONE;
+   }
+   if(!get_data(arg, &view)) return NULL;
+   res = (view.len <= LORA_MAX_DICT) && lora_set_compression(dev, (uint8_t *)view.buf, view.len);
+   PyBuffer_Release(&view);
+   if(!res) {
+      PyErr_Format(PyExc_RuntimeError, "Dictionary is limited to %d bytes", LORA_MAX_DICT);
+      return NULL;
+   }
+   Py_RETURN_NONE;
+}
+
+static PyObject *
+set_channels(PyObject *self, PyObject *args)
+{
+   lora_dev_t *dev = get_dev(self);
+   lora_channel_t list[LORA_MAX_CHANNELS];
+   PyObject *seq, *item;
+   int i, count;
+   if(!PyArg_ParseTuple(args, "O", &seq)) return NULL;
 
    /*
-    * Use data from bytearray to send.
+    * Each channel is a frequency or a (frequency, spreading_factor, bandwidth) tuple.
     */
-   uint8_t *buf = PyByteArray_AsString(msg);
-   int size = PyByteArray_Size(msg);
+   seq = PySequence_Fast(seq, "Channel plan must be a sequence");
+   if(seq == NULL) return NULL;
+   count = PySequence_Fast_GET_SIZE(seq);
+   if(count > LORA_MAX_CHANNELS) {
+      Py_DECREF(seq);
+      PyErr_Format(PyExc_RuntimeError, "Channel plan is limited to %d channels", LORA_MAX_CHANNELS);
+      return NULL;
+   }
+   for(i=0; i<count; i++) {
+      item = PySequence_Fast_GET_ITEM(seq, i);
+      memset(&list[i], 0, sizeof(lora_channel_t));
+      if(PyTuple_Check(item)) {
+         if(!PyArg_ParseTuple(item, "l|il", &list[i].frequency, &list[i].spreading_factor, &list[i].bandwidth)) break;
+      } else {
+         list[i].frequency = PyInt_AsLong(item);
+         if(PyErr_Occurred()) break;
+      }
+   }
+   Py_DECREF(seq);
+   if(i < count) return NULL;
+
+   if(!lora_set_channels(dev, list, count)) {
+      PyErr_SetString(PyExc_RuntimeError, "Invalid channel in the plan");
+      return NULL;
+   }
+   Py_RETURN_NONE;
+}
+
+static PyObject *
+select_channel(PyObject *self, PyObject *args)
+{
+   lora_dev_t *dev = get_dev(self);
+   int index, res;
+   if(!check(dev)) return NULL;
+   if(!PyArg_ParseTuple(args, "i", &index)) return NULL;
    Py_BEGIN_ALLOW_THREADS
-   lora_send_packet(buf, size);
+   res = lora_select_channel(dev, index);
    Py_END_ALLOW_THREADS
-
-   Py_XDECREF(msg);
+   if(!res) {
+      PyErr_SetString(PyExc_RuntimeError, "Channel not in the plan");
+      return NULL;
+   }
    Py_RETURN_NONE;
 }
 
+static PyObject *
+current_channel(PyObject *self)
+{
+   lora_dev_t *dev = get_dev(self);
+   int index = lora_current_channel(dev);
+   if(index < 0) Py_RETURN_NONE;
+   return PyInt_FromLong(index);
+}
+
+static PyObject *
+channel_stats(PyObject *self)
+{
+   lora_dev_t *dev = get_dev(self);
+   lora_channel_t ch;
+   uint64_t airtime;
+   int i;
+   PyObject *res = PyList_New(0);
+   if(res == NULL) return NULL;
+   for(i=0; lora_get_channel(dev, i, &ch, &airtime); i++) {
+      PyObject *item = Py_BuildValue("{s:l,s:i,s:l,s:d}", "frequency", ch.frequency,
+         "spreading_factor", ch.spreading_factor, "bandwidth", ch.bandwidth, "airtime", airtime / 1e6);
+      if((item == NULL) || (PyList_Append(res, item) < 0)) {
+         Py_XDECREF(item);
+         Py_DECREF(res);
+         return NULL;
+      }
+      Py_DECREF(item);
+   }
+   return res;
+}
+
+static PyObject *
+tx_pending(PyObject *self)
+{
+   lora_dev_t *dev = get_dev(self);
+   return PyInt_FromLong(lora_tx_pending(dev));
+}
+
+static PyObject *
+tx_flush(PyObject *self, PyObject *args)
+{
+   lora_dev_t *dev = get_dev(self);
+   int timeout = -1, res;
+   if(!PyArg_ParseTuple(args, "|i", &timeout)) return NULL;
+
+   Py_BEGIN_ALLOW_THREADS
+   res = lora_tx_flush(dev, timeout);
+   Py_END_ALLOW_THREADS
+
+   if(res) Py_RETURN_TRUE;
+   Py_RETURN_FALSE;
+}
+
 static PyObject *
 packet_available(PyObject *self)
 {
-   if(lora_received()) Py_RETURN_TRUE;
+   lora_dev_t *dev = get_dev(self);
+   if(lora_received(dev)) Py_RETURN_TRUE;
    Py_RETURN_FALSE;
 }
 
+/*
+ * Scratch buffer for reading packets (always used with the GIL held).
+ */
+static uint8_t scratch[255];
+
 static PyObject *
 receive_packet(PyObject *self)
 {
-   if(!lora_received()) Py_RETURN_NONE;
+   lora_dev_t *dev = get_dev(self);
+   if(!lora_received(dev)) Py_RETURN_NONE;
 
-   /*
-    * Create temporary buffer.
-    */
-   char *buf = malloc(255);
-   if(buf == NULL) return PyErr_NoMemory();
-   
    /*
     * Read packet and convert data into bytearray object.
     */
-   int len = lora_receive_packet(buf, 255);
-   PyObject *res = PyByteArray_FromStringAndSize(buf, len);
+   int len = lora_receive_packet(dev, scratch, sizeof(scratch));
+   return PyByteArray_FromStringAndSize((char *)scratch, len);
+}
+
+static PyObject *
+receive_window(PyObject *self, PyObject *args)
+{
+   lora_dev_t *dev = get_dev(self);
+   double open_at;
+   int symbols, len;
+   uint8_t buf[255];
+   if(!PyArg_ParseTuple(args, "di", &open_at, &symbols)) return NULL;
+   if(!check(dev)) return NULL;
+
+   Py_BEGIN_ALLOW_THREADS
+   len = lora_receive_window(dev, open_at > 0 ? (uint64_t)(open_at * 1e6) : 0, symbols, buf, sizeof(buf));
+   Py_END_ALLOW_THREADS
+
+   if(len < 0) {
+      PyErr_SetString(PyExc_RuntimeError, "Not available with background reception");
+      return NULL;
+   }
+   if(len == 0) Py_RETURN_NONE;
+   return PyByteArray_FromStringAndSize((char *)buf, len);
+}
+
+static PyObject *
+_clock(PyObject *self)
+{
+   return PyFloat_FromDouble(lora_clock_us() / 1e6);
+}
+
+/**
+ * Message transport of a radio, created on first use.
+ * @return Transport, or NULL if out of memory (exception set).
+ */
+static frag_t *
+get_frag(radio_state_t *st)
+{
+   if(st->frag == NULL) st->frag = frag_create(st->dev);
+   if(st->frag == NULL) PyErr_NoMemory();
+   return st->frag;
+}
+
+static PyObject *
+send_message(PyObject *self, PyObject *args, PyObject *keywords)
+{
+   radio_state_t *st = get_state(self);
+   char *keys[] = { "data", "reliable", NULL };
+   PyObject *arg;
+   Py_buffer view;
+   frag_t *f;
+   int sent, reliable = 0;
+   if(!check(st->dev)) return NULL;
+   if(!PyArg_ParseTupleAndKeywords(args, keywords, "O|i", keys, &arg, &reliable)) return NULL;
+   if((f = get_frag(st)) == NULL) return NULL;
+   if(!get_data(arg, &view)) return NULL;
+
+   Py_BEGIN_ALLOW_THREADS
+   if(reliable) sent = frag_send_reliable(f, (uint8_t *)view.buf, view.len);
+   else sent = frag_send(f, (uint8_t *)view.buf, view.len);
+   Py_END_ALLOW_THREADS
+
+   PyBuffer_Release(&view);
+   if(!sent) {
+      PyErr_SetString(PyExc_RuntimeError, reliable ? "Message too large, rejected by the duty cycle or not acknowledged" :
+         "Message too large or rejected by the duty cycle");
+      return NULL;
+   }
+   Py_RETURN_NONE;
+}
+
+static PyObject *
+receive_message(PyObject *self, PyObject *args)
+{
+   radio_state_t *st = get_state(self);
+   int timeout = -1;
+   uint8_t *buf;
+   long len;
+   frag_t *f;
+   if(!check(st->dev)) return NULL;
+   if(!PyArg_ParseTuple(args, "|i", &timeout)) return NULL;
+   if((f = get_frag(st)) == NULL) return NULL;
+
+   Py_BEGIN_ALLOW_THREADS
+   len = frag_receive(f, &buf, timeout);
+   Py_END_ALLOW_THREADS
+
+   if(len < 0) Py_RETURN_NONE;
+   PyObject *res = PyByteArray_FromStringAndSize((char *)buf, len);
    free(buf);
    return res;
 }
 
-static PyObject *callback_function = NULL;
+static PyObject *
+post_message(PyObject *self, PyObject *args)
+{
+   radio_state_t *st = get_state(self);
+   PyObject *arg;
+   Py_buffer view;
+   frag_t *f;
+   int sent;
+   if(!check(st->dev)) return NULL;
+   if(!PyArg_ParseTuple(args, "O", &arg)) return NULL;
+   if((f = get_frag(st)) == NULL) return NULL;
+   if(!get_data(arg, &view)) return NULL;
 
-static void __packet_received(void)
+   Py_BEGIN_ALLOW_THREADS
+   sent = frag_post(f, (uint8_t *)view.buf, view.len);
+   Py_END_ALLOW_THREADS
+
+   PyBuffer_Release(&view);
+   if(!sent) {
+      PyErr_SetString(PyExc_RuntimeError, "Message too large or rejected by the duty cycle");
+      return NULL;
+   }
+   Py_RETURN_NONE;
+}
+
+static PyObject *
+flush_messages(PyObject *self)
 {
-   if(callback_function == NULL) return;
-   
+   radio_state_t *st = get_state(self);
+   frag_t *f;
+   int sent;
+   if(!check(st->dev)) return NULL;
+   if((f = get_frag(st)) == NULL) return NULL;
+
+   Py_BEGIN_ALLOW_THREADS
+   sent = frag_flush(f);
+   Py_END_ALLOW_THREADS
+
+   if(!sent) {
+      PyErr_SetString(PyExc_RuntimeError, "Rejected by the duty cycle");
+      return NULL;
+   }
+   Py_RETURN_NONE;
+}
+
+static PyObject *
+batch_stats(PyObject *self)
+{
+   radio_state_t *st = get_state(self);
+   unsigned long sent, rejected;
+   frag_t *f;
+   if((f = get_frag(st)) == NULL) return NULL;
+   frag_batch_info(f, &sent, &rejected);
+   return Py_BuildValue("{s:k,s:k}", "sent", sent, "rejected", rejected);
+}
+
+static PyObject *
+set_batching(PyObject *self, PyObject *args)
+{
+   radio_state_t *st = get_state(self);
+   int frame_size, latency = -1;
+   frag_t *f;
+   if(!PyArg_ParseTuple(args, "i|i", &frame_size, &latency)) return NULL;
+   if((f = get_frag(st)) == NULL) return NULL;
+   frag_set_batching(f, frame_size, latency);
+   Py_RETURN_NONE;
+}
+
+static PyObject *
+set_message_limits(PyObject *self, PyObject *args)
+{
+   radio_state_t *st = get_state(self);
+   long max_size;
+   int timeout = 0;
+   frag_t *f;
+   if(!PyArg_ParseTuple(args, "l|i", &max_size, &timeout)) return NULL;
+   if((f = get_frag(st)) == NULL) return NULL;
+   frag_set_limits(f, max_size, timeout);
+   Py_RETURN_NONE;
+}
+
+static PyObject *
+set_window(PyObject *self, PyObject *args)
+{
+   radio_state_t *st = get_state(self);
+   int window, retries = 0;
+   frag_t *f;
+   if(!PyArg_ParseTuple(args, "i|i", &window, &retries)) return NULL;
+   if((f = get_frag(st)) == NULL) return NULL;
+   frag_set_window(f, window, retries);
+   Py_RETURN_NONE;
+}
+
+static PyObject *
+arq_stats(PyObject *self)
+{
+   radio_state_t *st = get_state(self);
+   long rtt, rto;
+   unsigned long retransmissions;
+   frag_t *f;
+   if((f = get_frag(st)) == NULL) return NULL;
+   frag_arq_info(f, &rtt, &rto, &retransmissions);
+   return Py_BuildValue("{s:d,s:d,s:k}", "rtt", rtt / 1e6, "rto", rto / 1e6, "retransmissions", retransmissions);
+}
+
+static PyObject *
+receive_packet_into(PyObject *self, PyObject *args)
+{
+   lora_dev_t *dev = get_dev(self);
+   PyObject *arg;
+   Py_buffer view;
+   int len = 0;
+
+   if(!PyArg_ParseTuple(args, "O", &arg)) return NULL;
+   if(PyObject_GetBuffer(arg, &view, PyBUF_WRITABLE) < 0) return NULL;
+
+   /*
+    * Packet is copied straight into the caller's buffer.
+    */
+   if(lora_received(dev))
+      len = lora_receive_packet(dev, (uint8_t *)view.buf, view.len);
+
+   PyBuffer_Release(&view);
+   return PyInt_FromLong(len);
+}
+
+/**
+ * Build the (data, rssi, snr, timestamp) tuple for a received packet.
+ */
+static PyObject *
+packet_tuple(lora_packet_t *pkt)
+{
+   return Py_BuildValue("(N,i,d,d)", PyByteArray_FromStringAndSize((char *)pkt->data, pkt->size),
+      pkt->rssi, (double)pkt->snr, pkt->timestamp / 1e6);
+}
+
+static void __packet_received(void *arg)
+{
+   radio_state_t *st = (radio_state_t *)arg;
+   lora_dev_t *dev = st->dev;
+   lora_packet_t pkt;
+   PyObject *res, *list, *item;
+
    PyGILState_STATE gstate = PyGILState_Ensure();
-   if(!PyCallable_Check(callback_function)) {
+   PyObject *funct = st->callback;
+   if((funct == NULL) || !PyCallable_Check(funct)) {
       PyGILState_Release(gstate);
       return;
    }
+   Py_INCREF(funct);
 
-   PyObject *args = Py_BuildValue("()");
-   PyObject *res = PyEval_CallObject(callback_function, args);
-   Py_XDECREF(args);
-   Py_XDECREF(res);
+   if(!st->callback_data) {
+      /*
+       * Plain notification: the callback reads the packets itself.
+       */
+      res = PyObject_CallObject(funct, NULL);
+      Py_XDECREF(res);
+   } else if(st->callback_batch) {
+      /*
+       * All packets available, in a single call.
+       */
+      list = PyList_New(0);
+      while((list != NULL) && lora_rx_pop(dev, &pkt)) {
+         if(pkt.crc_error) continue;
+         item = packet_tuple(&pkt);
+         if(item != NULL) PyList_Append(list, item);
+         Py_XDECREF(item);
+      }
+      if((list != NULL) && (PyList_Size(list) > 0)) {
+         res = PyObject_CallFunctionObjArgs(funct, list, NULL);
+         Py_XDECREF(res);
+      }
+      Py_XDECREF(list);
+   } else {
+      /*
+       * One call for each packet, all under the same GIL acquisition.
+       */
+      while(lora_rx_pop(dev, &pkt)) {
+         if(pkt.crc_error) continue;
+         item = packet_tuple(&pkt);
+         if(item == NULL) break;
+         res = PyObject_CallObject(funct, item);
+         Py_DECREF(item);
+         Py_XDECREF(res);
+      }
+   }
+
+   Py_DECREF(funct);
    PyGILState_Release(gstate);
 }
 
 static PyObject *
-on_receive(PyObject *self, PyObject *args)
+on_receive(PyObject *self, PyObject *args, PyObject *keywords)
 {
+   radio_state_t *st = get_state(self);
+   lora_dev_t *dev = st->dev;
+   char *keys[] = { "callback", "data", "batch", NULL };
    PyObject *funct;
-   if(!check()) return NULL;
+   int data = 0, batch = 0;
+   if(!check(dev)) return NULL;
    
-   if(!PyArg_ParseTuple(args, "O", &funct)) return NULL;
+   if(!PyArg_ParseTupleAndKeywords(args, keywords, "O|ii", keys, &funct, &data, &batch)) return NULL;
    
    if(funct == Py_None) {
-      Py_XDECREF(callback_function);
-      callback_function = NULL;
-      lora_on_receive(NULL);
+      /*
+       * The callback thread may be waiting for the GIL.
+       */
+      Py_BEGIN_ALLOW_THREADS
+      lora_on_receive(dev, NULL, NULL);
+      Py_END_ALLOW_THREADS
+      Py_XDECREF(st->callback);
+      st->callback = NULL;
       Py_RETURN_NONE;
    } 
    
@@ -304,21 +1032,188 @@ on_receive(PyObject *self, PyObject *args)
    }
    
    Py_XINCREF(funct);
-   Py_XDECREF(callback_function);
-   callback_function = funct;
-   lora_on_receive(__packet_received);
+   Py_XDECREF(st->callback);
+   st->callback = funct;
+   st->callback_data = data || batch;
+   st->callback_batch = batch;
+   lora_on_receive(dev, __packet_received, st);
    Py_RETURN_NONE;
 }
 
+static PyObject *
+rx_start(PyObject *self)
+{
+   lora_dev_t *dev = get_dev(self);
+   if(!check(dev)) return NULL;
+   if(!lora_rx_start(dev)) return PyErr_NoMemory();
+   Py_RETURN_NONE;
+}
+
+static PyObject *
+rx_stop(PyObject *self)
+{
+   lora_dev_t *dev = get_dev(self);
+   Py_BEGIN_ALLOW_THREADS
+   lora_rx_stop(dev);
+   Py_END_ALLOW_THREADS
+   Py_RETURN_NONE;
+}
+
+static PyObject *
+set_rx_depth(PyObject *self, PyObject *args)
+{
+   lora_dev_t *dev = get_dev(self);
+   int depth;
+   if(!PyArg_ParseTuple(args, "i", &depth)) return NULL;
+   if(!lora_set_rx_depth(dev, depth)) {
+      PyErr_SetString(PyExc_RuntimeError, "Reception ring depth must be positive and set while reception is stopped");
+      return NULL;
+   }
+   Py_RETURN_NONE;
+}
+
+static PyObject *
+rx_stats(PyObject *self)
+{
+   lora_dev_t *dev = get_dev(self);
+   int depth, queued;
+   unsigned long received, overflows;
+   lora_rx_ring_info(dev, &depth, &queued, &received, &overflows);
+   return Py_BuildValue("{s:i,s:i,s:k,s:k}", "depth", depth, "queued", queued, 
+      "received", received, "overflows", overflows);
+}
+
+/**
+ * Convert a latency histogram into a dictionary.
+ */
+static PyObject *
+hist_dict(lora_hist_t *h)
+{
+   int i;
+   PyObject *buckets = PyList_New(LORA_HIST_BUCKETS);
+   if(buckets == NULL) return NULL;
+   for(i=0; i<LORA_HIST_BUCKETS; i++)
+      PyList_SET_ITEM(buckets, i, PyLong_FromUnsignedLongLong(h->buckets[i]));
+   return Py_BuildValue("{s:K,s:K,s:K,s:N}", "count", h->count, "sum_us", h->sum, 
+      "max_us", h->max, "buckets", buckets);
+}
+
+static PyObject *
+stats(PyObject *self)
+{
+   lora_dev_t *dev = get_dev(self);
+   lora_stats_t st;
+   lora_get_stats(dev, &st);
+   return Py_BuildValue("{s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:N,s:N,s:N}",
+      "tx_packets", st.tx_packets,
+      "tx_airtime_us", st.tx_airtime,
+      "rx_packets", st.rx_packets,
+      "crc_errors", st.crc_errors,
+      "rx_overruns", st.rx_overruns,
+      "cad_busy", st.cad_busy,
+      "spi_transactions", st.spi_transactions,
+      "spi_transfers", st.spi_transfers,
+      "spi_bytes", st.spi_bytes,
+      "lock_count", st.lock_count,
+      "lock_contended", st.lock_contended,
+      "lock_wait", hist_dict(&st.lock_wait),
+      "lock_hold", hist_dict(&st.lock_hold),
+      "irq_latency", hist_dict(&st.irq_latency));
+}
+
+static PyObject *
+reset_stats(PyObject *self)
+{
+   lora_dev_t *dev = get_dev(self);
+   lora_reset_stats(dev);
+   Py_RETURN_NONE;
+}
+
+static PyObject *
+adr_report(PyObject *self, PyObject *args, PyObject *keywords)
+{
+   lora_dev_t *dev = get_dev(self);
+   char *keys[] = { "peer", "snr", "delivered", "apply", NULL };
+   int peer, delivered = 1, apply = 0;
+   float snr;
+   if(!check(dev)) return NULL;
+   if(!PyArg_ParseTupleAndKeywords(args, keywords, "if|ii", keys, &peer, &snr, &delivered, &apply)) return NULL;
+
+   if(!lora_adr_report(dev, peer, snr, delivered)) return PyErr_NoMemory();
+   if(apply) {
+      Py_BEGIN_ALLOW_THREADS
+      lora_adr_apply(dev, peer);
+      Py_END_ALLOW_THREADS
+   }
+   Py_RETURN_NONE;
+}
+
+static PyObject *
+adr_forget(PyObject *self, PyObject *args)
+{
+   lora_dev_t *dev = get_dev(self);
+   int peer;
+   if(!PyArg_ParseTuple(args, "i", &peer)) return NULL;
+   lora_adr_forget(dev, peer);
+   Py_RETURN_NONE;
+}
+
+static PyObject *
+adr_set_target(PyObject *self, PyObject *args)
+{
+   lora_dev_t *dev = get_dev(self);
+   float delivery, margin = 3.0;
+   if(!PyArg_ParseTuple(args, "f|f", &delivery, &margin)) return NULL;
+   if(!lora_adr_set_target(dev, delivery, margin)) return PyErr_NoMemory();
+   Py_RETURN_NONE;
+}
+
+static PyObject *
+adr_set_range(PyObject *self, PyObject *args)
+{
+   lora_dev_t *dev = get_dev(self);
+   int min_sf, max_sf, min_power = 2, max_power = 17;
+   long min_bw, max_bw;
+   if(!PyArg_ParseTuple(args, "iill|ii", &min_sf, &max_sf, &min_bw, &max_bw, &min_power, &max_power)) return NULL;
+   if(!lora_adr_set_range(dev, min_sf, max_sf, min_bw, max_bw, min_power, max_power)) return PyErr_NoMemory();
+   Py_RETURN_NONE;
+}
+
+static PyObject *
+adr_recommend(PyObject *self, PyObject *args)
+{
+   lora_dev_t *dev = get_dev(self);
+   lora_config_t cfg;
+   int peer;
+   if(!check(dev)) return NULL;
+   if(!PyArg_ParseTuple(args, "i", &peer)) return NULL;
+   if(!lora_adr_recommend(dev, peer, &cfg)) Py_RETURN_NONE;
+   return profile_dict(&cfg);
+}
+
+static PyObject *
+adr_apply(PyObject *self, PyObject *args)
+{
+   lora_dev_t *dev = get_dev(self);
+   int peer, res;
+   if(!check(dev)) return NULL;
+   if(!PyArg_ParseTuple(args, "i", &peer)) return NULL;
+   Py_BEGIN_ALLOW_THREADS
+   res = lora_adr_apply(dev, peer);
+   Py_END_ALLOW_THREADS
+   return PyBool_FromLong(res);
+}
+
 static PyObject *
 wait_for_packet(PyObject *self, PyObject *args)
 {
+   lora_dev_t *dev = get_dev(self);
    int timeout = -1;
-   if(!check()) return NULL;
+   if(!check(dev)) return NULL;
    if(!PyArg_ParseTuple(args, "|i", &timeout)) return NULL;
  
    Py_BEGIN_ALLOW_THREADS
-   lora_wait_for_packet(timeout);
+   lora_wait_for_packet(dev, timeout);
    Py_END_ALLOW_THREADS
  
    Py_RETURN_NONE;
@@ -343,24 +1238,155 @@ static PyMethodDef metodos[] = {
    { "set_sync_word", set_sync_word, METH_VARARGS, "Set sync word for messages" },
    { "enable_crc", enable_crc, METH_NOARGS, "Enable CRC in message frame" },
    { "disable_crc", disable_crc, METH_NOARGS, "Disable CRC in message frame" },
+   { "get_profile", get_profile, METH_NOARGS, "Returns the current radio configuration as a dictionary" },
+   { "apply_profile", apply_profile, METH_VARARGS | METH_KEYWORDS, "Apply several configuration parameters at once" },
    { "set_pins", set_pins, METH_VARARGS | METH_KEYWORDS, "Configure interface with transceiver" },
    { "init", init, METH_NOARGS, "Radio transceiver initialization" },
    { "packet_rssi", packet_rssi, METH_NOARGS, "Returns last packet RSSI" },
    { "packet_snr", packet_snr, METH_NOARGS, "Returns last packet SNR" },
+   { "packet_timestamp", packet_timestamp, METH_NOARGS, "Returns the arrival time of the last packet (s, see clock())" },
+   { "tx_timestamp", tx_timestamp, METH_NOARGS, "Returns the end time of the last transmission (s, see clock())" },
+   { "verify_registers", verify_registers, METH_NOARGS, "Check cached registers against the radio, returns mismatch count" },
    { "close", _close, METH_NOARGS, "End radio library" },
+   { "set_transceive", set_transceive, METH_VARARGS, "Listen whenever not transmitting, with separate FIFO regions" },
+   { "set_lbt", set_lbt, METH_VARARGS, "Check the channel with CAD before each transmission (attempts, backoff slot in ms), 0 to disable" },
+   { "set_tx_wait", set_tx_wait, METH_VARARGS, "Select how the end of transmission is detected (TX_WAIT_IRQ or TX_WAIT_TIMED)" },
    { "send_packet", send_packet, METH_VARARGS, "Broadcast a message" },
+   { "send_async", send_async, METH_VARARGS | METH_KEYWORDS, "Queue a message for transmission and return immediately" },
+   { "time_on_air", time_on_air, METH_VARARGS, "Time on air in seconds of a packet with size bytes" },
+   { "set_duty_cycle", set_duty_cycle, METH_VARARGS, "Limit transmissions to the duty cycle of a region (\"EU868\"), None to remove limits" },
+   { "add_subband", add_subband, METH_VARARGS, "Add a sub-band (low Hz, high Hz, duty fraction) with its own duty cycle" },
+   { "tx_delay", tx_delay, METH_VARARGS, "Seconds a packet with size bytes would wait for the duty cycle, None if never allowed" },
+   { "adr_report", adr_report, METH_VARARGS | METH_KEYWORDS, "Add a packet (peer, snr, delivered) to the link history, apply=True to adapt the radio at once" },
+   { "adr_forget", adr_forget, METH_VARARGS, "Discard the link history of a peer" },
+   { "adr_set_target", adr_set_target, METH_VARARGS, "Set the delivery probability and SNR margin (dB) aimed at by the adaptive data rate" },
+   { "adr_set_range", adr_set_range, METH_VARARGS, "Limit the adaptive data rate to (min_sf, max_sf, min_bw, max_bw, min_power, max_power)" },
+   { "adr_recommend", adr_recommend, METH_VARARGS, "Configuration recommended for a peer, None without enough history" },
+   { "adr_apply", adr_apply, METH_VARARGS, "Apply the configuration recommended for a peer" },
+   { "set_compression", set_compression, METH_VARARGS, "Compress payloads against a shared dictionary, None to disable" },
+   { "set_channels", set_channels, METH_VARARGS, "Define the channel plan, a list of frequencies or (frequency, spreading_factor, bandwidth)" },
+   { "select_channel", select_channel, METH_VARARGS, "Tune to a channel of the plan, used for reception" },
+   { "current_channel", current_channel, METH_NOARGS, "Index of the channel the radio is tuned to, None if out of the plan" },
+   { "channel_stats", channel_stats, METH_NOARGS, "Returns the channels of the plan with the time transmitted on each" },
+   { "tx_pending", tx_pending, METH_NOARGS, "Number of messages waiting for transmission" },
+   { "tx_flush", tx_flush, METH_VARARGS, "Wait until all queued messages are sent (timeout in ms)" },
+   { "receive_window", receive_window, METH_VARARGS, "Listen for a number of symbols from a time of clock(), None if no packet arrived" },
+   { "clock", _clock, METH_NOARGS, "Returns the time base of packet timestamps and reception windows (s)" },
    { "packet_available", packet_available, METH_NOARGS, "Check if data is received" },
    { "receive_packet", receive_packet, METH_NOARGS, "Read the last received packet" },
-   { "on_receive", on_receive, METH_VARARGS, "Register a callback function for packet reception" },
+   { "receive_packet_into", receive_packet_into, METH_VARARGS, "Read the last received packet into a writable buffer, returns its size" },
+   { "send_message", send_message, METH_VARARGS | METH_KEYWORDS, "Send a message of any size, split in as many packets as needed, reliable=True to wait for acknowledgements" },
+   { "receive_message", receive_message, METH_VARARGS, "Wait for a complete message (timeout in ms), None if timed out" },
+   { "set_message_limits", set_message_limits, METH_VARARGS, "Set the largest message accepted (bytes) and the reassembly timeout (ms)" },
+   { "post_message", post_message, METH_VARARGS, "Queue a small message to be sent together with others" },
+   { "flush_messages", flush_messages, METH_NOARGS, "Send the posted messages now" },
+   { "batch_stats", batch_stats, METH_NOARGS, "Returns the frames of posted messages sent and rejected" },
+   { "set_batching", set_batching, METH_VARARGS, "Set the frame size and latency of posted messages" },
+   { "set_window", set_window, METH_VARARGS, "Set the fragments sent before each acknowledgement and the retries of reliable messages" },
+   { "arq_stats", arq_stats, METH_NOARGS, "Returns the round trip time, retransmission timeout (s) and retransmissions of reliable messages" },
+   { "on_receive", on_receive, METH_VARARGS | METH_KEYWORDS, "Register a callback function for packet reception" },
+   { "rx_start", rx_start, METH_NOARGS, "Start background reception into the reception ring" },
+   { "rx_stop", rx_stop, METH_NOARGS, "Stop background reception" },
+   { "set_rx_depth", set_rx_depth, METH_VARARGS, "Set the number of packets held by the reception ring" },
+   { "rx_stats", rx_stats, METH_NOARGS, "Returns counters of the reception ring" },
+   { "stats", stats, METH_NOARGS, "Returns the runtime statistics of the radio" },
+   { "reset_stats", reset_stats, METH_NOARGS, "Clear the runtime statistics" },
    { "wait_for_packet", wait_for_packet, METH_VARARGS, "Suspend execution until a packet arrives or a timeout occurs" },
    { NULL, NULL, 0, NULL }
 };
 
+static PyObject *
+radio_new(PyTypeObject *type, PyObject *args, PyObject *keywords)
+{
+   PyObject *self = type->tp_alloc(type, 0);
+   if(self == NULL) return NULL;
+
+   radio_state_t *st = get_state(self);
+   st->dev = lora_create();
+   if(st->dev == NULL) {
+      Py_DECREF(self);
+      return PyErr_NoMemory();
+   }
+   return self;
+}
+
+/**
+ * Radio(spi_device, cs_pin, rst_pin, irq_pin, hw_cs, gpio_chip)
+ * Each object owns a transceiver, with its own lock and threads.
+ * Parameters are the same as set_pins().
+ */
+static int
+radio_init(PyObject *self, PyObject *args, PyObject *keywords)
+{
+   PyObject *res = set_pins(self, args, keywords);
+   if(res == NULL) return -1;
+   Py_DECREF(res);
+   return 0;
+}
+
+static void
+radio_dealloc(PyObject *self)
+{
+   radio_state_t *st = get_state(self);
+   lora_dev_t *dev = st->dev;
+
+   /*
+    * Threads of the radio may be waiting for the GIL. The transport goes
+    * first: its batch thread still sends through the radio.
+    */
+   Py_BEGIN_ALLOW_THREADS
+   frag_destroy(st->frag);
+   lora_destroy(dev);
+   Py_END_ALLOW_THREADS
+   st->frag = NULL;
+   Py_CLEAR(st->callback);
+   Py_TYPE(self)->tp_free(self);
+}
+
+static PyTypeObject RadioType = {
+   PyVarObject_HEAD_INIT(NULL, 0)
+   "PyLora.Radio",                           // tp_name
+   sizeof(RadioObject),                      // tp_basicsize
+};
+
 /**
  * Initialization function for the Python interpreter.
  */
 void
 initPyLora(void)
 {
-   Py_InitModule("PyLora", metodos);
+   /*
+    * Module level functions work on the default radio.
+    */
+   default_state.dev = lora_default();
+   if(default_state.dev == NULL) {
+      PyErr_NoMemory();
+      return;
+   }
+
+   /*
+    * Radio objects share the method table with the module.
+    */
+   RadioType.tp_flags = Py_TPFLAGS_DEFAULT;
+   RadioType.tp_doc = "LoRa radio transceiver";
+   RadioType.tp_methods = metodos;
+   RadioType.tp_init = radio_init;
+   RadioType.tp_new = radio_new;
+   RadioType.tp_dealloc = radio_dealloc;
+   if(PyType_Ready(&RadioType) < 0) return;
+
+   PyObject *m = Py_InitModule("PyLora", metodos);
+   if(m == NULL) return;
+   Py_INCREF(&RadioType);
+   PyModule_AddObject(m, "Radio", (PyObject *)&RadioType);
+   PyModule_AddIntConstant(m, "TX_WAIT_IRQ", LORA_TX_WAIT_IRQ);
+   PyModule_AddIntConstant(m, "TX_WAIT_TIMED", LORA_TX_WAIT_TIMED);
+   PyModule_AddIntConstant(m, "PRIO_LOW", LORA_PRIO_LOW);
+   PyModule_AddIntConstant(m, "PRIO_NORMAL", LORA_PRIO_NORMAL);
+   PyModule_AddIntConstant(m, "PRIO_HIGH", LORA_PRIO_HIGH);
+   PyModule_AddIntConstant(m, "PRIO_URGENT", LORA_PRIO_URGENT);
+   PyModule_AddIntConstant(m, "TX_SENT", LORA_TX_SENT);
+   PyModule_AddIntConstant(m, "TX_EXPIRED", LORA_TX_EXPIRED);
+   PyModule_AddIntConstant(m, "TX_CANCELLED", LORA_TX_CANCELLED);
+   PyModule_AddIntConstant(m, "TX_REJECTED", LORA_TX_REJECTED);
 }
@@ -0,0 +1,257 @@
+#include "adr.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ADR_LOST                 -1000.0f       // history entry of a lost packet
+
+/*
+ * Link history of a peer. Each entry is the SNR the packet would have had
+ * at 0 dBm and 125 kHz (see adr_report()), so entries taken with different
+ * configurations can be compared.
+ */
+typedef struct {
+   int peer;
+   int used;
+   uint32_t stamp;                     // last report, for replacement
+   float link[ADR_HISTORY];
+   int next;
+   int count;
+} adr_peer_t;
+
+struct adr {
+   float delivery;                     // target delivery probability
+   float margin;                       // dB above the demodulation floor
+   int min_sf, max_sf;
+   long min_bw, max_bw;                // Hz
+   int min_power, max_power;           // dBm
+   uint32_t clock;
+   adr_peer_t peers[ADR_MAX_PEERS];
+};
+
+/*
+ * Noise bandwidth relative to 125 kHz, 10*log10(bw/125000).
+ */
+static const struct {
+   long bw;
+   float db;
+} __bandwidths[] = {
+   { 7800, -12.0 }, { 10400, -10.8 }, { 15600, -9.0 }, { 20800, -7.8 }, { 31250, -6.0 },
+   { 41700, -4.8 }, { 62500, -3.0 }, { 125000, 0.0 }, { 250000, 3.0 }, { 500000, 6.0 },
+   { 0, 0 }
+};
+
+/*
+ * Lowest SNR demodulated by each spreading factor (SX1276 datasheet, table 13).
+ */
+static const float __snr_floor[13] = {
+   0, 0, 0, 0, 0, 0, -5.0, -7.5, -10.0, -12.5, -15.0, -17.5, -20.0
+};
+
+/**
+ * Create an engine without history, aiming at 90% delivery with 3 dB of margin,
+ * choosing among SF7-12 at 125 kHz and 2-17 dBm.
+ * @return Engine, or NULL if out of memory.
+ */
+adr_t *
+adr_create(void)
+{
+   adr_t *adr = calloc(1, sizeof(adr_t));
+   if(adr == NULL) return NULL;
+   adr_set_target(adr, 0.9, 3.0);
+   adr_set_range(adr, 7, 12, 125000, 125000, 2, 17);
+   return adr;
+}
+
+void
+adr_destroy(adr_t *adr)
+{
+   free(adr);
+}
+
+/**
+ * Set the delivery goal.
+ * @param adr Engine.
+ * @param delivery Probability of delivery to aim at (0-1).
+ * @param margin Extra SNR above the demodulation floor (dB), against fading.
+ */
+void
+adr_set_target(adr_t *adr, float delivery, float margin)
+{
+   if(delivery <= 0) delivery = 0.01;
+   else if(delivery > 1) delivery = 1;
+   if(margin < 0) margin = 0;
+   adr->delivery = delivery;
+   adr->margin = margin;
+}
+
+/**
+ * Limit the configurations the engine may recommend.
+ * @param adr Engine.
+ * @param min_sf Fastest spreading factor (6-12).
+ * @param max_sf Most robust spreading factor (6-12).
+ * @param min_bw Narrowest bandwidth (Hz).
+ * @param max_bw Widest bandwidth (Hz).
+ * @param min_power Lowest transmission power (2-17).
+ * @param max_power Highest transmission power (2-17).
+ */
+void
+adr_set_range(adr_t *adr, int min_sf, int max_sf, long min_bw, long max_bw, int min_power, int max_power)
+{
+   if(min_sf < 6) min_sf = 6;
+   if(max_sf > 12) max_sf = 12;
+   if(max_sf < min_sf) max_sf = min_sf;
+   if(max_bw < min_bw) max_bw = min_bw;
+   if(min_power < 2) min_power = 2;
+   if(max_power > 17) max_power = 17;
+   if(max_power < min_power) max_power = min_power;
+
+   adr->min_sf = min_sf;
+   adr->max_sf = max_sf;
+   adr->min_bw = min_bw;
+   adr->max_bw = max_bw;
+   adr->min_power = min_power;
+   adr->max_power = max_power;
+}
+
+/**
+ * Noise bandwidth of the register setting used for a bandwidth.
+ */
+static float
+adr_bw_db(long bw)
+{
+   int i;
+   for(i=0; __bandwidths[i+1].bw; i++)
+      if(bw <= __bandwidths[i].bw) break;
+   return __bandwidths[i].db;
+}
+
+/**
+ * Find the history of a peer.
+ * @param create Non-zero to take a free slot (or the least recently used) if not found.
+ */
+static adr_peer_t *
+adr_find(adr_t *adr, int peer, int create)
+{
+   int i;
+   adr_peer_t *p, *old = NULL;
+   for(i=0; i<ADR_MAX_PEERS; i++) {
+      p = &adr->peers[i];
+      if(p->used && (p->peer == peer)) return p;
+      if((old == NULL) || !p->used || (old->used && (p->stamp < old->stamp))) old = p;
+   }
+   if(!create) return NULL;
+
+   memset(old, 0, sizeof(*old));
+   old->used = 1;
+   old->peer = peer;
+   return old;
+}
+
+/**
+ * Add a packet to the history of a peer.
+ * @param adr Engine.
+ * @param peer Application address of the peer.
+ * @param cfg Configuration the packet was sent with (bandwidth and power are used).
+ * @param snr SNR of the packet at the receiver (dB).
+ * @param delivered Zero if the packet was lost (snr is ignored).
+ */
+void
+adr_report(adr_t *adr, int peer, lora_config_t *cfg, float snr, int delivered)
+{
+   adr_peer_t *p = adr_find(adr, peer, 1);
+   p->stamp = ++adr->clock;
+   p->link[p->next] = delivered ? snr - cfg->tx_power + adr_bw_db(cfg->bandwidth) : ADR_LOST;
+   p->next = (p->next + 1) % ADR_HISTORY;
+   if(p->count < ADR_HISTORY) p->count++;
+}
+
+/**
+ * Discard the history of a peer.
+ */
+void
+adr_forget(adr_t *adr, int peer)
+{
+   adr_peer_t *p = adr_find(adr, peer, 0);
+   if(p != NULL) p->used = 0;
+}
+
+/**
+ * Link quality reached by the target fraction of the packets.
+ * @return Normalized SNR (dB), or ADR_LOST if too many packets were lost.
+ */
+static float
+adr_quantile(adr_t *adr, adr_peer_t *p)
+{
+   float v[ADR_HISTORY];
+   int i, j;
+
+   for(i=0; i<p->count; i++) {
+      float x = p->link[i];
+      for(j=i; (j > 0) && (v[j-1] > x); j--) v[j] = v[j-1];
+      v[j] = x;
+   }
+
+   i = (int)((1 - adr->delivery) * p->count);
+   if(i >= p->count) i = p->count - 1;
+   return v[i];
+}
+
+/**
+ * Recommend the configuration with the shortest time on air whose predicted
+ * SNR, for the target fraction of the packets, stays above the demodulation
+ * floor plus the margin. Among equally fast ones, the lowest power is chosen.
+ * If no configuration qualifies, the most robust one is recommended.
+ * @param adr Engine.
+ * @param peer Application address of the peer.
+ * @param cfg Current configuration; spreading factor, bandwidth and power are replaced.
+ * @return 1 if successful, 0 if there is not enough history for the peer (cfg is unchanged).
+ */
+int
+adr_recommend(adr_t *adr, int peer, lora_config_t *cfg)
+{
+   int i, sf;
+   adr_peer_t *p = adr_find(adr, peer, 0);
+   if((p == NULL) || (p->count < ADR_MIN_SAMPLES)) return 0;
+
+   float q = adr_quantile(adr, p);
+   int size = cfg->implicit_size > 0 ? cfg->implicit_size : ADR_PAYLOAD;
+   lora_config_t c = *cfg, best = *cfg;
+   long t, best_airtime = -1;
+
+   for(sf=adr->min_sf; (q > ADR_LOST) && (sf<=adr->max_sf); sf++) {
+      if((sf == 6) && (cfg->implicit_size == 0)) continue;
+      for(i=0; __bandwidths[i].bw; i++) {
+         if((__bandwidths[i].bw < adr->min_bw) || (__bandwidths[i].bw > adr->max_bw)) continue;
+
+         float need = __snr_floor[sf] + adr->margin + __bandwidths[i].db - q;
+         int power = (int)need;
+         if(power < need) power++;
+         if(power < adr->min_power) power = adr->min_power;
+         if(power > adr->max_power) continue;
+
+         c.spreading_factor = sf;
+         c.bandwidth = __bandwidths[i].bw;
+         c.tx_power = power;
+         t = lora_config_airtime(&c, size);
+         if((best_airtime < 0) || (t < best_airtime) || ((t == best_airtime) && (power < best.tx_power))) {
+            best = c;
+            best_airtime = t;
+         }
+      }
+   }
+
+   if(best_airtime < 0) {
+      best.spreading_factor = adr->max_sf;
+      best.bandwidth = adr->max_bw;
+      for(i=0; __bandwidths[i].bw; i++) {
+         if(__bandwidths[i].bw < adr->min_bw) continue;
+         if(__bandwidths[i].bw <= adr->max_bw) best.bandwidth = __bandwidths[i].bw;
+         break;
+      }
+      best.tx_power = adr->max_power;
+   }
+
+   *cfg = best;
+   return 1;
+}
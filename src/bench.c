@@ -0,0 +1,407 @@
+#include "gpio.h"
+#include "spi.h"
+#include "lora.h"
+#include "sim.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * Driver benchmark: runs each public operation against the simulated
+ * transceiver and prints one JSON object per line with the average cost.
+ *
+ * usage: bench_lora [-n iterations] [-s speed] [-a]
+ *    -n    iterations for each measurement (default 20)
+ *    -s    simulation speed, divides the times on air (default 100)
+ *    -a    every payload size from 1 to 255 (default: powers of two and 255)
+ */
+
+#define BENCH_SPI_DEVICE         "bench0"
+#define BENCH_RX_SPI_DEVICE      "bench1"
+
+/*
+ * Bus and kernel accounting.
+ * Syscalls are the kernel calls each transport operation costs with the
+ * spidev/GPIO character device transport (a wait is a level check plus poll()).
+ */
+typedef struct {
+   unsigned long spi_msgs;
+   unsigned long spi_xfers;
+   unsigned long spi_bytes;
+   unsigned long gpio_calls;
+   unsigned long syscalls;
+} counters_t;
+
+static counters_t __count;
+static spi_transport_t *__spi;
+static gpio_transport_t *__gpio;
+
+#define account(field, n)        __atomic_add_fetch(&__count.field, (n), __ATOMIC_RELAXED)
+
+static int
+bench_spi_open(char *device, int hw_cs)
+{
+   return __spi->open(device, hw_cs);
+}
+
+static int
+bench_spi_message(int fd, struct spi_ioc_transfer *xfer, int count)
+{
+   int i;
+   account(spi_msgs, 1);
+   account(spi_xfers, count);
+   for(i=0; i<count; i++) account(spi_bytes, xfer[i].len);
+   account(syscalls, 1);
+   return __spi->message(fd, xfer, count);
+}
+
+static void
+bench_spi_close(int fd)
+{
+   __spi->close(fd);
+}
+
+static int
+bench_gpio_open(char *device, int pin, int output)
+{
+   return __gpio->open(device, pin, output);
+}
+
+static int
+bench_gpio_close(int pin, int fd)
+{
+   return __gpio->close(pin, fd);
+}
+
+static void
+bench_gpio_output(int fd, int val)
+{
+   account(gpio_calls, 1);
+   account(syscalls, 1);
+   __gpio->output(fd, val);
+}
+
+static int
+bench_gpio_input(int fd)
+{
+   account(gpio_calls, 1);
+   account(syscalls, 1);
+   return __gpio->input(fd);
+}
+
+static int
+bench_gpio_wait(int pin, int fd, int rising, int timeout)
+{
+   account(gpio_calls, 1);
+   account(syscalls, 2);
+   return __gpio->wait(pin, fd, rising, timeout);
+}
+
+static spi_transport_t __bench_spi = { bench_spi_open, bench_spi_message, bench_spi_close };
+static gpio_transport_t __bench_gpio = { bench_gpio_open, bench_gpio_close, bench_gpio_output, bench_gpio_input, bench_gpio_wait, NULL };   // edges not stamped
+
+/*
+ * Accumulated cost of an operation.
+ */
+typedef struct {
+   counters_t total;
+   uint64_t wall;
+   uint64_t cpu;
+   int n;
+   counters_t mark;
+   uint64_t wall_mark;
+   uint64_t cpu_mark;
+} sample_t;
+
+static int __iterations = 20;
+static int __speed = 100;
+
+static uint64_t
+clock_us(clockid_t id)
+{
+   struct timespec ts;
+   clock_gettime(id, &ts);
+   return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+sample_reset(sample_t *s)
+{
+   memset(s, 0, sizeof(*s));
+}
+
+/**
+ * Start measuring one operation.
+ */
+static void
+sample_begin(sample_t *s)
+{
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   s->mark = __count;
+   s->cpu_mark = clock_us(CLOCK_PROCESS_CPUTIME_ID);
+   s->wall_mark = clock_us(CLOCK_MONOTONIC);
+}
+
+/**
+ * Finish measuring one operation.
+ */
+static void
+sample_stop(sample_t *s)
+{
+   s->wall += clock_us(CLOCK_MONOTONIC) - s->wall_mark;
+   s->cpu += clock_us(CLOCK_PROCESS_CPUTIME_ID) - s->cpu_mark;
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   s->total.spi_msgs += __count.spi_msgs - s->mark.spi_msgs;
+   s->total.spi_xfers += __count.spi_xfers - s->mark.spi_xfers;
+   s->total.spi_bytes += __count.spi_bytes - s->mark.spi_bytes;
+   s->total.gpio_calls += __count.gpio_calls - s->mark.gpio_calls;
+   s->total.syscalls += __count.syscalls - s->mark.syscalls;
+   s->n++;
+}
+
+/**
+ * Print the average cost of an operation as a JSON object.
+ * @param s Measurements.
+ * @param op Operation name.
+ * @param size Payload size (negative if not applicable).
+ */
+static void
+sample_print(sample_t *s, char *op, int size)
+{
+   double n = (s->n > 0) ? s->n : 1;
+   printf("{\"op\": \"%s\", ", op);
+   if(size >= 0) printf("\"size\": %d, ", size);
+   printf("\"n\": %d, \"spi_msgs\": %.2f, \"spi_xfers\": %.2f, \"spi_bytes\": %.1f, "
+         "\"gpio_calls\": %.2f, \"syscalls\": %.2f, \"wall_us\": %.1f, \"cpu_us\": %.1f}\n",
+      s->n, s->total.spi_msgs / n, s->total.spi_xfers / n, s->total.spi_bytes / n,
+      s->total.gpio_calls / n, s->total.syscalls / n, s->wall / n, s->cpu / n);
+   fflush(stdout);
+}
+
+/*
+ * Setters, each called with alternating values so every call changes the radio.
+ */
+static void set_tx_power(lora_dev_t *d, int i) { lora_set_tx_power(d, (i & 1) ? 10 : 17); }
+static void set_frequency(lora_dev_t *d, int i) { lora_set_frequency(d, (i & 1) ? 868300000 : 868100000); }
+static void set_spreading_factor(lora_dev_t *d, int i) { lora_set_spreading_factor(d, (i & 1) ? 8 : 7); }
+static void set_bandwidth(lora_dev_t *d, int i) { lora_set_bandwidth(d, (i & 1) ? 250000 : 125000); }
+static void set_coding_rate(lora_dev_t *d, int i) { lora_set_coding_rate(d, (i & 1) ? 6 : 5); }
+static void set_preamble_length(lora_dev_t *d, int i) { lora_set_preamble_length(d, (i & 1) ? 12 : 8); }
+static void set_sync_word(lora_dev_t *d, int i) { lora_set_sync_word(d, (i & 1) ? 0x34 : 0x12); }
+static void set_crc(lora_dev_t *d, int i) { if(i & 1) lora_disable_crc(d); else lora_enable_crc(d); }
+static void set_header_mode(lora_dev_t *d, int i) { if(i & 1) lora_implicit_header_mode(d, 16); else lora_explicit_header_mode(d); }
+
+static struct {
+   char *name;
+   void (*set)(lora_dev_t *d, int i);
+} __setters[] = {
+   { "lora_set_tx_power", set_tx_power },
+   { "lora_set_frequency", set_frequency },
+   { "lora_set_spreading_factor", set_spreading_factor },
+   { "lora_set_bandwidth", set_bandwidth },
+   { "lora_set_coding_rate", set_coding_rate },
+   { "lora_set_preamble_length", set_preamble_length },
+   { "lora_set_sync_word", set_sync_word },
+   { "lora_enable_crc", set_crc },
+   { "lora_header_mode", set_header_mode },
+   { NULL, NULL }
+};
+
+/**
+ * Create and initialize a radio on a simulated transceiver.
+ */
+static lora_dev_t *
+open_radio(char *spidev, int cs, int rst, int irq)
+{
+   lora_dev_t *dev = lora_create();
+   if(dev == NULL) return NULL;
+   lora_set_pins(dev, spidev, cs, rst, irq);
+   if(lora_init(dev) != 1) {
+      lora_destroy(dev);
+      return NULL;
+   }
+   return dev;
+}
+
+static void
+bench_init(void)
+{
+   sample_t s;
+   int i;
+
+   sample_reset(&s);
+   for(i=0; i<__iterations; i++) {
+      lora_dev_t *dev = lora_create();
+      lora_set_pins(dev, BENCH_SPI_DEVICE, 25, 17, 4);
+      sample_begin(&s);
+      lora_init(dev);
+      sample_stop(&s);
+      lora_destroy(dev);
+   }
+   sample_print(&s, "lora_init", -1);
+}
+
+/**
+ * Each setter twice: changing the value, and writing the value it already has
+ * (what the register cache saves).
+ */
+static void
+bench_setters(lora_dev_t *dev)
+{
+   sample_t s;
+   char name[80];
+   int i, j;
+
+   for(j=0; __setters[j].name != NULL; j++) {
+      sample_reset(&s);
+      for(i=0; i<__iterations; i++) {
+         sample_begin(&s);
+         __setters[j].set(dev, i);
+         sample_stop(&s);
+      }
+      sample_print(&s, __setters[j].name, -1);
+
+      sample_reset(&s);
+      for(i=0; i<__iterations; i++) {
+         sample_begin(&s);
+         __setters[j].set(dev, 0);
+         sample_stop(&s);
+      }
+      snprintf(name, sizeof(name), "%s/unchanged", __setters[j].name);
+      sample_print(&s, name, -1);
+   }
+   lora_explicit_header_mode(dev);
+}
+
+static void
+bench_send(lora_dev_t *dev, int size, uint8_t *buf)
+{
+   sample_t s;
+   int i;
+
+   sample_reset(&s);
+   for(i=0; i<__iterations; i++) {
+      sample_begin(&s);
+      lora_send_packet(dev, buf, size);
+      sample_stop(&s);
+   }
+   sample_print(&s, "lora_send_packet", size);
+}
+
+/**
+ * Reception without the background thread: the packet is already in the
+ * radio FIFO when lora_received() and lora_receive_packet() are called.
+ */
+static void
+bench_receive(lora_dev_t *dev, sim_radio_t *r, int size, uint8_t *buf)
+{
+   sample_t s1, s2;
+   uint8_t data[255];
+   int i;
+
+   sample_reset(&s1);
+   sample_reset(&s2);
+   for(i=0; i<__iterations; i++) {
+      lora_receive(dev);
+      long airtime = sim_inject(r, buf, size, 0);
+      usleep(airtime + 200);
+
+      sample_begin(&s1);
+      lora_received(dev);
+      sample_stop(&s1);
+
+      sample_begin(&s2);
+      lora_receive_packet(dev, data, sizeof(data));
+      sample_stop(&s2);
+   }
+   sample_print(&s1, "lora_received", size);
+   sample_print(&s2, "lora_receive_packet", size);
+}
+
+/**
+ * Reception with the background thread: time from the end of the packet
+ * on the air until lora_wait_for_packet() returns.
+ */
+static void
+bench_irq_wakeup(lora_dev_t *dev, sim_radio_t *r, int size, uint8_t *buf)
+{
+   sample_t s;
+   lora_packet_t pkt;
+   int i;
+
+   sample_reset(&s);
+   for(i=0; i<__iterations; i++) {
+      sample_begin(&s);
+      long airtime = sim_inject(r, buf, size, 0);
+      s.wall_mark += airtime;
+      lora_wait_for_packet(dev, 1000);
+      sample_stop(&s);
+      while(lora_rx_pop(dev, &pkt));
+   }
+   sample_print(&s, "irq_wakeup", size);
+}
+
+int
+main(int argc, char **argv)
+{
+   static const int sizes[] = { 1, 2, 4, 8, 16, 32, 64, 128, 255, 0 };
+   uint8_t buf[255];
+   int all = 0;
+   int i, c;
+
+   while((c = getopt(argc, argv, "n:s:a")) != -1) {
+      switch(c) {
+         case 'n': __iterations = atoi(optarg); break;
+         case 's': __speed = atoi(optarg); break;
+         case 'a': all = 1; break;
+         default:
+            fprintf(stderr, "usage: %s [-n iterations] [-s speed] [-a]\n", argv[0]);
+            return 1;
+      }
+   }
+   if(__iterations < 1) __iterations = 1;
+   for(i=0; i<(int)sizeof(buf); i++) buf[i] = i;
+
+   /*
+    * Simulated radios behind the counting transports.
+    */
+   sim_install();
+   sim_set_speed(__speed);
+   sim_radio_t *tx_sim = sim_add_radio(BENCH_SPI_DEVICE, 17, 4);
+   sim_radio_t *rx_sim = sim_add_radio(BENCH_RX_SPI_DEVICE, 27, 22);
+   if((tx_sim == NULL) || (rx_sim == NULL)) return 1;
+   __spi = spi_get_transport();
+   __gpio = gpio_get_transport();
+   spi_set_transport(&__bench_spi);
+   gpio_set_transport(&__bench_gpio);
+
+   bench_init();
+
+   lora_dev_t *tx = open_radio(BENCH_SPI_DEVICE, 25, 17, 4);
+   lora_dev_t *rx = open_radio(BENCH_RX_SPI_DEVICE, 24, 27, 22);
+   if((tx == NULL) || (rx == NULL)) {
+      fprintf(stderr, "Radio initialization failed\n");
+      return 1;
+   }
+
+   bench_setters(tx);
+
+   for(i=1; i<=255; i++) {
+      if(!all && (i != 255) && (i & (i - 1))) continue;
+      bench_send(tx, i, buf);
+      bench_receive(rx, rx_sim, i, buf);
+   }
+
+   lora_rx_start(rx);
+   usleep(1000);
+   for(i=0; sizes[i]; i++)
+      bench_irq_wakeup(rx, rx_sim, sizes[i], buf);
+
+   lora_destroy(tx);
+   lora_destroy(rx);
+   sim_uninstall();
+   return 0;
+}
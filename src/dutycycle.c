@@ -0,0 +1,210 @@
+#include "dutycycle.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DC_MAX_BANDS             8
+#define DC_HISTORY               64
+
+/*
+ * A past transmission (or several merged ones).
+ */
+typedef struct {
+   uint64_t end;                       // us (CLOCK_MONOTONIC)
+   uint64_t airtime;                   // us
+} dc_frame_t;
+
+typedef struct {
+   long low;                           // Hz, inclusive
+   long high;                          // Hz, exclusive
+   uint64_t budget;                    // airtime allowed in a window, us
+   dc_frame_t hist[DC_HISTORY];        // oldest first
+   int first;
+   int count;
+} dc_band_t;
+
+struct dc {
+   int count;
+   dc_band_t bands[DC_MAX_BANDS];
+};
+
+/*
+ * Regional plans.
+ */
+typedef struct {
+   long low;
+   long high;
+   float duty;
+} dc_plan_t;
+
+static const dc_plan_t __eu868[] = {
+   { 863000000, 868000000, 0.01 },
+   { 868000000, 868600000, 0.01 },
+   { 868700000, 869200000, 0.001 },
+   { 869400000, 869650000, 0.1 },
+   { 869700000, 870000000, 0.01 },
+   { 0, 0, 0 }
+};
+
+static const struct {
+   char *name;
+   const dc_plan_t *plan;
+} __regions[] = {
+   { "EU868", __eu868 },
+   { NULL, NULL }
+};
+
+/**
+ * Create an empty tracker (no restrictions).
+ * @return Tracker, or NULL if out of memory.
+ */
+dc_t *
+dc_create(void)
+{
+   return calloc(1, sizeof(dc_t));
+}
+
+void
+dc_destroy(dc_t *dc)
+{
+   free(dc);
+}
+
+/**
+ * Remove all sub-bands.
+ */
+void
+dc_clear(dc_t *dc)
+{
+   dc->count = 0;
+}
+
+/**
+ * Define a sub-band with a duty cycle limit.
+ * @param dc Tracker.
+ * @param low Lowest frequency of the sub-band (Hz).
+ * @param high Frequency just above the sub-band (Hz).
+ * @param duty Fraction of the time the sub-band may be used (0.01 = 1%).
+ * @return 1 if successful, 0 if invalid or too many sub-bands.
+ */
+int
+dc_add_band(dc_t *dc, long low, long high, float duty)
+{
+   if((dc->count >= DC_MAX_BANDS) || (high <= low) || (duty <= 0) || (duty > 1)) return 0;
+
+   dc_band_t *b = &dc->bands[dc->count++];
+   memset(b, 0, sizeof(*b));
+   b->low = low;
+   b->high = high;
+   b->budget = (uint64_t)(duty * DC_WINDOW_US);
+   return 1;
+}
+
+/**
+ * Replace the sub-bands with a regional plan.
+ * @param dc Tracker.
+ * @param region Region name, like "EU868".
+ * @return 1 if successful, 0 if the region is unknown.
+ */
+int
+dc_load_region(dc_t *dc, char *region)
+{
+   int i;
+   const dc_plan_t *p;
+
+   for(i=0; __regions[i].name != NULL; i++) {
+      if(strcmp(__regions[i].name, region)) continue;
+      dc_clear(dc);
+      for(p = __regions[i].plan; p->high; p++) dc_add_band(dc, p->low, p->high, p->duty);
+      return 1;
+   }
+   return 0;
+}
+
+static dc_band_t *
+dc_find(dc_t *dc, long frequency)
+{
+   int i;
+   for(i=0; i<dc->count; i++)
+      if((frequency >= dc->bands[i].low) && (frequency < dc->bands[i].high)) return &dc->bands[i];
+   return NULL;
+}
+
+/**
+ * Forget transmissions that left the window.
+ */
+static void
+dc_expire(dc_band_t *b, uint64_t now)
+{
+   while((b->count > 0) && (b->hist[b->first].end + DC_WINDOW_US <= now)) {
+      b->first = (b->first + 1) % DC_HISTORY;
+      b->count--;
+   }
+}
+
+/**
+ * Compute how long a frame must wait to comply with the duty cycle.
+ * The frame may start at the earliest instant where the airtime of the
+ * frames still inside the window ending with it, plus its own, fits in the budget.
+ * @param dc Tracker.
+ * @param frequency Channel frequency (Hz). Frequencies out of every sub-band are not limited.
+ * @param now Current time (us, CLOCK_MONOTONIC).
+ * @param airtime Time on air of the frame (us).
+ * @return Time to wait in us (0 = now), or DC_NEVER if the frame exceeds the budget.
+ */
+uint64_t
+dc_delay(dc_t *dc, long frequency, uint64_t now, uint64_t airtime)
+{
+   int i;
+   dc_band_t *b = dc_find(dc, frequency);
+   if(b == NULL) return 0;
+   if(airtime > b->budget) return DC_NEVER;
+
+   dc_expire(b, now);
+
+   uint64_t used = 0;
+   for(i=0; i<b->count; i++) used += b->hist[(b->first + i) % DC_HISTORY].airtime;
+
+   /*
+    * Drop the oldest frames until the rest fits; the frame can start when
+    * the last one dropped is out of its window.
+    */
+   uint64_t t = now;
+   for(i=0; used + airtime > b->budget; i++) {
+      dc_frame_t *f = &b->hist[(b->first + i) % DC_HISTORY];
+      used -= f->airtime;
+      if(f->end + DC_WINDOW_US - airtime > t) t = f->end + DC_WINDOW_US - airtime;
+   }
+   return t - now;
+}
+
+/**
+ * Account a transmission.
+ * @param dc Tracker.
+ * @param frequency Channel frequency (Hz).
+ * @param start Start of the transmission (us, CLOCK_MONOTONIC).
+ * @param airtime Time on air (us).
+ */
+void
+dc_record(dc_t *dc, long frequency, uint64_t start, uint64_t airtime)
+{
+   dc_band_t *b = dc_find(dc, frequency);
+   if(b == NULL) return;
+
+   dc_expire(b, start);
+   if(b->count == DC_HISTORY) {
+      /*
+       * History full: the two oldest frames become one, ending with the
+       * newer of them (the budget stays on the safe side).
+       */
+      dc_frame_t *f0 = &b->hist[b->first];
+      b->first = (b->first + 1) % DC_HISTORY;
+      b->count--;
+      b->hist[b->first].airtime += f0->airtime;
+   }
+
+   dc_frame_t *f = &b->hist[(b->first + b->count) % DC_HISTORY];
+   f->end = start + airtime;
+   f->airtime = airtime;
+   b->count++;
+}
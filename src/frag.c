@@ -0,0 +1,937 @@
+#include "frag.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+/*
+ * Fragment header:
+ *    0     FRAG_TYPE_DATA, with FRAG_FLAG_RELIABLE and FRAG_FLAG_POLL
+ *    1-2   message id (big endian)
+ *    3-5   fragment index (12 bits), fragment count - 1 (12 bits)
+ * Every fragment but the last carries exactly FRAG_PAYLOAD bytes, so the
+ * message size is only known when the last one arrives.
+ *
+ * Reliable messages are sent with selective repeat: a burst of up to a
+ * window of fragments, the last one with FRAG_FLAG_POLL, answered with
+ * a selective acknowledgement:
+ *    0     FRAG_TYPE_ACK
+ *    1-2   message id
+ *    3-4   fragments received in sequence (all below this index)
+ *    5-12  one bit for each of the next 64 fragments, received or not
+ *
+ * Small messages posted with frag_post() share frames:
+ *    0     FRAG_TYPE_BATCH
+ *    1-    for each message, its size (one byte) and its data
+ *
+ * Other packets starting with one of the types (or FRAG_TYPE_ESCAPED) are
+ * sent after FRAG_TYPE_ESCAPED, removed before they reach the ring.
+ */
+
+#define DEFAULT_MAX_SIZE         65536
+#define DEFAULT_TIMEOUT          10000             // ms
+#define DEFAULT_WINDOW           16
+#define DEFAULT_RETRIES          8
+#define DEFAULT_LATENCY          1000              // ms a posted message may wait
+
+#define FRAG_ACK_SIZE            13
+#define FRAG_MAX_DONE            64                // complete messages waiting for frag_receive()
+#define FRAG_RECENT              16                // complete reliable messages remembered
+
+/*
+ * Message being reassembled.
+ */
+typedef struct {
+   int used;
+   uint16_t id;
+   int count;                          // fragments
+   int received;
+   long size;                          // bytes, -1 until the last fragment arrives
+   uint8_t *data;                      // count * FRAG_PAYLOAD bytes
+   uint8_t *map;                       // one bit per fragment received
+   uint64_t last;                      // last fragment, us (CLOCK_MONOTONIC)
+} frag_msg_t;
+
+/*
+ * Reliable message being sent.
+ */
+typedef struct frag_tx {
+   struct frag_tx *next;
+   uint16_t id;
+   int count;
+   int base;                           // first fragment not acknowledged
+   uint8_t *acked;                     // one bit per fragment
+   int ack_seen;                       // acknowledgement received since the last poll
+   uint64_t ack_at;                    // its reception time, us
+} frag_tx_t;
+
+struct frag {
+   lora_dev_t *dev;
+   uint16_t next_id;
+   long max_size;                      // bytes per message
+   uint64_t timeout;                   // us without fragments before a message is dropped
+   int window;
+   int retries;
+   pthread_mutex_t mutex;
+   pthread_cond_t cond;
+   frag_msg_t msgs[FRAG_MAX_MESSAGES];
+
+   struct {
+      uint8_t *data;
+      long size;
+   } done[FRAG_MAX_DONE];
+   int done_first;
+   int done_count;
+
+   struct {
+      uint16_t id;
+      int count;
+   } recent[FRAG_RECENT];
+   int recent_next;
+
+   uint16_t acks[FRAG_MAX_MESSAGES];   // acknowledgements to send
+   int ack_count;
+
+   /*
+    * Frame of posted messages, sent when full or at its deadline by the
+    * batch thread.
+    */
+   struct {
+      pthread_mutex_t mutex;
+      pthread_cond_t cond;
+      pthread_t thid;
+      int running;
+      uint8_t frame[255];
+      int size;                        // bytes in frame, 0 when empty
+      int sending;                     // a frame is being transmitted
+      unsigned long sent;              // frames sent
+      unsigned long rejected;          // frames refused by lora_send_packet()
+      int max;                         // frame size limit
+      uint64_t latency;                // us
+      uint64_t deadline;               // us (CLOCK_MONOTONIC), for the first message in frame
+   } batch;
+
+   frag_tx_t *tx;
+   long srtt;                          // smoothed round trip time, us (0 = unknown)
+   long rttvar;
+   unsigned long retransmissions;
+};
+
+static int frag_filter(lora_packet_t *pkt, void *arg);
+
+static uint64_t
+frag_now_us(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Create the transport for a radio.
+ * From then on, its packets are taken by the transport in the reception
+ * thread and never reach the reception ring.
+ * @param dev Radio handle.
+ * @return Transport, or NULL if out of memory.
+ */
+frag_t *
+frag_create(lora_dev_t *dev)
+{
+   pthread_condattr_t attr;
+   frag_t *f = calloc(1, sizeof(frag_t));
+   if(f == NULL) return NULL;
+   f->dev = dev;
+   f->next_id = (uint16_t)(frag_now_us() ^ (uintptr_t)f);
+   f->max_size = DEFAULT_MAX_SIZE;
+   f->timeout = DEFAULT_TIMEOUT * 1000ULL;
+   f->window = DEFAULT_WINDOW;
+   f->retries = DEFAULT_RETRIES;
+   f->batch.max = 255;
+   f->batch.latency = DEFAULT_LATENCY * 1000ULL;
+   pthread_mutex_init(&f->mutex, NULL);
+   pthread_mutex_init(&f->batch.mutex, NULL);
+   pthread_condattr_init(&attr);
+   pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+   pthread_cond_init(&f->cond, &attr);
+   pthread_cond_init(&f->batch.cond, &attr);
+   pthread_condattr_destroy(&attr);
+   lora_set_rx_filter(dev, frag_filter, f);
+   return f;
+}
+
+static void
+frag_drop(frag_msg_t *msg)
+{
+   free(msg->data);
+   free(msg->map);
+   memset(msg, 0, sizeof(*msg));
+}
+
+void
+frag_destroy(frag_t *f)
+{
+   int i;
+   if(f == NULL) return;
+   lora_set_rx_filter(f->dev, NULL, NULL);
+
+   /*
+    * The batch thread sends the pending frame before leaving.
+    */
+   pthread_mutex_lock(&f->batch.mutex);
+   int running = f->batch.running;
+   f->batch.running = 0;
+   pthread_cond_broadcast(&f->batch.cond);
+   pthread_mutex_unlock(&f->batch.mutex);
+   if(running) pthread_join(f->batch.thid, NULL);
+
+   for(i=0; i<FRAG_MAX_MESSAGES; i++) frag_drop(&f->msgs[i]);
+   for(i=0; i<f->done_count; i++) free(f->done[(f->done_first + i) % FRAG_MAX_DONE].data);
+   pthread_mutex_destroy(&f->mutex);
+   pthread_cond_destroy(&f->cond);
+   pthread_mutex_destroy(&f->batch.mutex);
+   pthread_cond_destroy(&f->batch.cond);
+   free(f);
+}
+
+/**
+ * Limit the memory used for reassembly.
+ * @param f Transport.
+ * @param max_size Largest message accepted (bytes); fragments of larger ones are discarded.
+ * @param timeout Time without fragments after which a partial message is dropped (ms).
+ */
+void
+frag_set_limits(frag_t *f, long max_size, int timeout)
+{
+   pthread_mutex_lock(&f->mutex);
+   if(max_size > 0) f->max_size = max_size;
+   if(timeout > 0) f->timeout = timeout * 1000ULL;
+   pthread_mutex_unlock(&f->mutex);
+}
+
+/**
+ * Configure reliable transfers.
+ * @param f Transport.
+ * @param window Fragments sent before waiting for an acknowledgement (1-FRAG_MAX_WINDOW).
+ * @param retries Consecutive acknowledgement timeouts before a transfer fails.
+ */
+void
+frag_set_window(frag_t *f, int window, int retries)
+{
+   if(window < 1) window = 1;
+   else if(window > FRAG_MAX_WINDOW) window = FRAG_MAX_WINDOW;
+   pthread_mutex_lock(&f->mutex);
+   f->window = window;
+   if(retries > 0) f->retries = retries;
+   pthread_mutex_unlock(&f->mutex);
+}
+
+/**
+ * Send one fragment.
+ * @param type First byte of the header (type and flags).
+ * @return Result of lora_send_packet().
+ */
+static int
+frag_send_one(frag_t *f, int type, uint16_t id, int index, int count, uint8_t *buf, long size)
+{
+   uint8_t pkt[255];
+   long len = size - (long)index * FRAG_PAYLOAD;
+   if(len > FRAG_PAYLOAD) len = FRAG_PAYLOAD;
+
+   pkt[0] = type;
+   pkt[1] = id >> 8;
+   pkt[2] = id & 0xff;
+   pkt[3] = index >> 4;
+   pkt[4] = ((index & 0x0f) << 4) | ((count - 1) >> 8);
+   pkt[5] = (count - 1) & 0xff;
+   memcpy(pkt + FRAG_HEADER, buf + (long)index * FRAG_PAYLOAD, len);
+   return lora_send_packet(f->dev, pkt, FRAG_HEADER + len);
+}
+
+/**
+ * Number of fragments of a message.
+ * @return Fragment count, or 0 if too large.
+ */
+static int
+frag_count(long size)
+{
+   long count = (size + FRAG_PAYLOAD - 1) / FRAG_PAYLOAD;
+   if(count == 0) count = 1;
+   if((size < 0) || (count > FRAG_MAX_COUNT)) return 0;
+   return count;
+}
+
+/**
+ * Send a message, in as many packets as needed, without acknowledgements.
+ * @param f Transport.
+ * @param buf Message data.
+ * @param size Message size, up to FRAG_MAX_COUNT * FRAG_PAYLOAD bytes.
+ * @return 1 if sent, 0 if too large or a packet was rejected by the duty cycle.
+ */
+int
+frag_send(frag_t *f, uint8_t *buf, long size)
+{
+   int i, count = frag_count(size);
+   if(count == 0) return 0;
+
+   uint16_t id = __atomic_fetch_add(&f->next_id, 1, __ATOMIC_RELAXED);
+   for(i=0; i<count; i++)
+      if(!frag_send_one(f, FRAG_TYPE_DATA, id, i, count, buf, size)) return 0;
+   return 1;
+}
+
+/**
+ * Drop the messages that stopped receiving fragments.
+ * Must be called with the mutex held.
+ */
+static void
+frag_expire(frag_t *f, uint64_t now)
+{
+   int i;
+   for(i=0; i<FRAG_MAX_MESSAGES; i++)
+      if(f->msgs[i].used && (f->msgs[i].last + f->timeout < now)) frag_drop(&f->msgs[i]);
+}
+
+/**
+ * Find the message a fragment belongs to.
+ * Must be called with the mutex held.
+ * @param create Non-zero to start a new message if needed (replacing the
+ * one that was updated least recently if all are in use).
+ * @return Message, or NULL if not found, too large or out of memory.
+ */
+static frag_msg_t *
+frag_find(frag_t *f, uint16_t id, int count, int create)
+{
+   int i;
+   frag_msg_t *msg, *old = NULL;
+   for(i=0; i<FRAG_MAX_MESSAGES; i++) {
+      msg = &f->msgs[i];
+      if(msg->used && (msg->id == id)) {
+         if(msg->count == count) return msg;
+         frag_drop(msg);
+      }
+      if((old == NULL) || !msg->used || (old->used && (msg->last < old->last))) old = msg;
+   }
+
+   if(!create || ((long)(count - 1) * FRAG_PAYLOAD >= f->max_size)) return NULL;
+   frag_drop(old);
+   old->data = malloc((long)count * FRAG_PAYLOAD);
+   old->map = calloc((count + 7) / 8, 1);
+   if((old->data == NULL) || (old->map == NULL)) {
+      frag_drop(old);
+      return NULL;
+   }
+   old->used = 1;
+   old->id = id;
+   old->count = count;
+   old->size = -1;
+   return old;
+}
+
+/**
+ * Check if a reliable message was already delivered.
+ * Must be called with the mutex held.
+ */
+static int
+frag_recent(frag_t *f, uint16_t id, int count)
+{
+   int i;
+   for(i=0; i<FRAG_RECENT; i++)
+      if((f->recent[i].count == count) && (f->recent[i].id == id)) return 1;
+   return 0;
+}
+
+/**
+ * Schedule an acknowledgement.
+ * Must be called with the mutex held.
+ */
+static void
+frag_queue_ack(frag_t *f, uint16_t id)
+{
+   int i;
+   for(i=0; i<f->ack_count; i++)
+      if(f->acks[i] == id) return;
+   if(f->ack_count < FRAG_MAX_MESSAGES) f->acks[f->ack_count++] = id;
+}
+
+/**
+ * Move a complete message to the delivery queue (dropping the oldest one if full).
+ * Must be called with the mutex held.
+ * @param data Message data, freed by whoever takes it.
+ */
+static void
+frag_deliver(frag_t *f, uint8_t *data, long size)
+{
+   if(f->done_count == FRAG_MAX_DONE) {
+      free(f->done[f->done_first].data);
+      f->done_first = (f->done_first + 1) % FRAG_MAX_DONE;
+      f->done_count--;
+   }
+   int i = (f->done_first + f->done_count++) % FRAG_MAX_DONE;
+   f->done[i].data = data;
+   f->done[i].size = size;
+}
+
+/**
+ * Store a received data fragment.
+ * Must be called with the mutex held.
+ */
+static void
+frag_input_data(frag_t *f, uint8_t *pkt, int size)
+{
+   uint16_t id = (pkt[1] << 8) | pkt[2];
+   int index = (pkt[3] << 4) | (pkt[4] >> 4);
+   int count = (((pkt[4] & 0x0f) << 8) | pkt[5]) + 1;
+   int reliable = pkt[0] & FRAG_FLAG_RELIABLE;
+   int len = size - FRAG_HEADER;
+   if((index >= count) || ((index < count - 1) && (len != FRAG_PAYLOAD))) return;
+
+   /*
+    * Retransmissions of delivered messages are only acknowledged.
+    */
+   if(reliable && frag_recent(f, id, count)) {
+      if(pkt[0] & FRAG_FLAG_POLL) frag_queue_ack(f, id);
+      return;
+   }
+
+   frag_msg_t *msg = frag_find(f, id, count, 1);
+   if(msg == NULL) return;
+   if(pkt[0] & FRAG_FLAG_POLL) frag_queue_ack(f, id);
+   msg->last = frag_now_us();
+   if(msg->map[index / 8] & (1 << (index % 8))) return;
+
+   msg->map[index / 8] |= 1 << (index % 8);
+   msg->received++;
+   memcpy(msg->data + (long)index * FRAG_PAYLOAD, pkt + FRAG_HEADER, len);
+   if(index == count - 1) msg->size = (long)index * FRAG_PAYLOAD + len;
+   if(msg->received < count) return;
+
+   frag_deliver(f, msg->data, msg->size);
+   msg->data = NULL;
+   frag_drop(msg);
+
+   if(reliable) {
+      f->recent[f->recent_next].id = id;
+      f->recent[f->recent_next].count = count;
+      f->recent_next = (f->recent_next + 1) % FRAG_RECENT;
+   }
+}
+
+/**
+ * Split a frame of small messages into the delivery queue.
+ * Must be called with the mutex held.
+ */
+static void
+frag_input_batch(frag_t *f, uint8_t *pkt, int size)
+{
+   int i = 1;
+   while(i < size) {
+      int len = pkt[i++];
+      if(i + len > size) return;
+      uint8_t *data = malloc(len + 1);
+      if(data == NULL) return;
+      memcpy(data, pkt + i, len);
+      frag_deliver(f, data, len);
+      i += len;
+   }
+}
+
+/**
+ * Apply a received acknowledgement to the transfer it belongs to.
+ * Must be called with the mutex held.
+ */
+static void
+frag_input_ack(frag_t *f, uint8_t *pkt, int size, uint64_t timestamp)
+{
+   int i;
+   frag_tx_t *tx;
+   if(size < FRAG_ACK_SIZE) return;
+
+   uint16_t id = (pkt[1] << 8) | pkt[2];
+   int base = (pkt[3] << 8) | pkt[4];
+   for(tx = f->tx; tx != NULL; tx = tx->next)
+      if(tx->id == id) break;
+   if(tx == NULL) return;
+
+   if(base > tx->count) base = tx->count;
+   for(i=tx->base; i<base; i++) tx->acked[i / 8] |= 1 << (i % 8);
+   for(i=0; (i < 64) && (base + i < tx->count); i++)
+      if(pkt[5 + i / 8] & (1 << (i % 8))) tx->acked[(base + i) / 8] |= 1 << ((base + i) % 8);
+   while((tx->base < tx->count) && (tx->acked[tx->base / 8] & (1 << (tx->base % 8)))) tx->base++;
+   tx->ack_seen = 1;
+   tx->ack_at = timestamp;
+}
+
+/**
+ * Queue the acknowledgements scheduled by received polls for transmission
+ * (see lora_send_async()); those that do not fit in the queue are kept
+ * for the next packet.
+ * Must be called with the mutex held.
+ */
+static void
+frag_send_acks(frag_t *f)
+{
+   uint8_t pkt[FRAG_ACK_SIZE];
+   int i;
+
+   while(f->ack_count > 0) {
+      uint16_t id = f->acks[f->ack_count - 1];
+      int base = 0, count = 0;
+      frag_msg_t *msg = NULL;
+
+      for(i=0; i<FRAG_RECENT; i++)
+         if(f->recent[i].count && (f->recent[i].id == id)) base = count = f->recent[i].count;
+      if(count == 0) {
+         for(i=0; i<FRAG_MAX_MESSAGES; i++)
+            if(f->msgs[i].used && (f->msgs[i].id == id)) msg = &f->msgs[i];
+         if(msg == NULL) {
+            f->ack_count--;
+            continue;
+         }
+         count = msg->count;
+         while((base < count) && (msg->map[base / 8] & (1 << (base % 8)))) base++;
+      }
+
+      memset(pkt, 0, sizeof(pkt));
+      pkt[0] = FRAG_TYPE_ACK;
+      pkt[1] = id >> 8;
+      pkt[2] = id & 0xff;
+      pkt[3] = base >> 8;
+      pkt[4] = base & 0xff;
+      for(i=0; (msg != NULL) && (i < 64) && (base + i < count); i++)
+         if(msg->map[(base + i) / 8] & (1 << ((base + i) % 8))) pkt[5 + i / 8] |= 1 << (i % 8);
+
+      if(lora_send_async(f->dev, pkt, sizeof(pkt), LORA_PRIO_HIGH, 0, NULL, NULL) < 0) break;
+      f->ack_count--;
+   }
+}
+
+/**
+ * Check if a packet would be taken by the transport.
+ * @param buf Packet.
+ * @param size Packet size.
+ * @return 1 if its first byte is one of the types.
+ */
+static int
+frag_reserved(uint8_t *buf, int size)
+{
+   if(size <= 0) return 0;
+   return ((buf[0] & ~(FRAG_FLAG_RELIABLE | FRAG_FLAG_POLL)) == FRAG_TYPE_DATA) ||
+      (buf[0] == FRAG_TYPE_ACK) || (buf[0] == FRAG_TYPE_BATCH) || (buf[0] == FRAG_TYPE_ESCAPED);
+}
+
+/**
+ * Escape a packet sent outside the transport, so that radios with a
+ * transport deliver it as it is (see frag_filter()).
+ * @param in Packet.
+ * @param size Packet size (up to 255 bytes).
+ * @param out Buffer for the frame (255 bytes).
+ * @return Frame size, or -1 if the packet needs escaping and does not fit
+ * (255 bytes).
+ */
+int
+frag_escape(uint8_t *in, int size, uint8_t *out)
+{
+   if(!frag_reserved(in, size)) {
+      memcpy(out, in, size);
+      return size;
+   }
+   if(size > 254) return -1;
+   out[0] = FRAG_TYPE_ESCAPED;
+   memcpy(out + 1, in, size);
+   return size + 1;
+}
+
+/**
+ * Take the packets of the transport from the reception thread (see
+ * lora_set_rx_filter()) and acknowledge polls right away, whether or not
+ * a message is being waited for; other packets go on to the reception ring,
+ * without their escape (see frag_escape()).
+ * @return 1 if the packet was taken.
+ */
+static int
+frag_filter(lora_packet_t *pkt, void *arg)
+{
+   frag_t *f = arg;
+   int type = pkt->size > 0 ? pkt->data[0] : -1;
+
+   if(type == FRAG_TYPE_ESCAPED) {
+      memmove(pkt->data, pkt->data + 1, --pkt->size);
+      return 0;
+   }
+   if(type == FRAG_TYPE_BATCH) ;
+   else if((type == FRAG_TYPE_ACK) && (pkt->size >= FRAG_ACK_SIZE)) ;
+   else if(((type & ~(FRAG_FLAG_RELIABLE | FRAG_FLAG_POLL)) == FRAG_TYPE_DATA) && (pkt->size >= FRAG_HEADER)) ;
+   else return 0;
+
+   pthread_mutex_lock(&f->mutex);
+   frag_expire(f, frag_now_us());
+   if(type == FRAG_TYPE_BATCH) frag_input_batch(f, pkt->data, pkt->size);
+   else if(type == FRAG_TYPE_ACK) frag_input_ack(f, pkt->data, pkt->size, pkt->timestamp);
+   else frag_input_data(f, pkt->data, pkt->size);
+   frag_send_acks(f);
+   pthread_cond_broadcast(&f->cond);
+   pthread_mutex_unlock(&f->mutex);
+   return 1;
+}
+
+/**
+ * Wait until a condition holds, as packets are taken by frag_filter().
+ * Must be called with the mutex held.
+ * @param f Transport.
+ * @param ready Condition.
+ * @param arg Parameter for the condition.
+ * @param end Time limit (us, CLOCK_MONOTONIC), 0 for none.
+ * @return 1 if the condition holds, 0 if timed out.
+ */
+static int
+frag_wait(frag_t *f, int (*ready)(frag_t *f, void *arg), void *arg, uint64_t end)
+{
+   struct timespec ts;
+
+   for(;;) {
+      if(ready(f, arg)) return 1;
+
+      uint64_t now = frag_now_us();
+      frag_expire(f, now);
+      if(end && (now >= end)) return 0;
+
+      if(end == 0) {
+         pthread_cond_wait(&f->cond, &f->mutex);
+      } else {
+         ts.tv_sec = end / 1000000;
+         ts.tv_nsec = (end % 1000000) * 1000;
+         pthread_cond_timedwait(&f->cond, &f->mutex, &ts);
+      }
+   }
+}
+
+static int
+frag_has_message(frag_t *f, void *arg)
+{
+   (void)arg;
+   return f->done_count > 0;
+}
+
+static int
+frag_has_ack(frag_t *f, void *arg)
+{
+   (void)f;
+   return ((frag_tx_t *)arg)->ack_seen;
+}
+
+/**
+ * Retransmission timeout: the smoothed round trip time plus four times its
+ * deviation, never below twice the time on air of an acknowledgement.
+ * Must be called with the mutex held.
+ * @return Timeout in us.
+ */
+static uint64_t
+frag_rto(frag_t *f)
+{
+   uint64_t floor = 2 * (uint64_t)lora_time_on_air(f->dev, FRAG_ACK_SIZE);
+   uint64_t rto = f->srtt ? (uint64_t)(f->srtt + 4 * f->rttvar) : 2 * floor + 200000;
+   return rto < floor ? floor : rto;
+}
+
+/**
+ * Send a message and wait until the receiver has all of it.
+ * Fragments are sent in bursts of up to a window, the last one asking for
+ * an acknowledgement; only the fragments reported missing are sent again.
+ * @param f Transport.
+ * @param buf Message data.
+ * @param size Message size, up to FRAG_MAX_COUNT * FRAG_PAYLOAD bytes.
+ * @return 1 if delivered, 0 if too large, rejected by the duty cycle or not acknowledged.
+ */
+int
+frag_send_reliable(frag_t *f, uint8_t *buf, long size)
+{
+   frag_tx_t tx, **p;
+   int i, res = 0, failures = 0, backoff = 1;
+   int count = frag_count(size);
+   if(count == 0) return 0;
+   if(!lora_rx_start(f->dev)) return 0;
+
+   uint8_t *sent = calloc((count + 7) / 8, 1);
+   uint8_t *ever = calloc((count + 7) / 8, 1);
+   memset(&tx, 0, sizeof(tx));
+   tx.acked = calloc((count + 7) / 8, 1);
+   if((sent == NULL) || (ever == NULL) || (tx.acked == NULL)) goto end;
+   tx.id = __atomic_fetch_add(&f->next_id, 1, __ATOMIC_RELAXED);
+   tx.count = count;
+
+   pthread_mutex_lock(&f->mutex);
+   tx.next = f->tx;
+   f->tx = &tx;
+
+   while(tx.base < count) {
+      int burst[FRAG_MAX_WINDOW], n = 0;
+      int limit = tx.base + f->window;
+      if(limit > count) limit = count;
+
+      /*
+       * Fragments of the window never sent or reported missing; after a
+       * timeout with nothing new, just the first one, to get an acknowledgement.
+       */
+      for(i=tx.base; i<limit; i++)
+         if(!(tx.acked[i / 8] & (1 << (i % 8))) && !(sent[i / 8] & (1 << (i % 8)))) burst[n++] = i;
+      if(n == 0) burst[n++] = tx.base;
+
+      tx.ack_seen = 0;
+      pthread_mutex_unlock(&f->mutex);
+      for(i=0; i<n; i++) {
+         int type = FRAG_TYPE_DATA | FRAG_FLAG_RELIABLE | (i == n - 1 ? FRAG_FLAG_POLL : 0);
+         if(!frag_send_one(f, type, tx.id, burst[i], count, buf, size)) break;
+      }
+      uint64_t polled = frag_now_us();
+      pthread_mutex_lock(&f->mutex);
+      if(i < n) break;
+
+      for(i=0; i<n; i++) {
+         if(ever[burst[i] / 8] & (1 << (burst[i] % 8))) f->retransmissions++;
+         ever[burst[i] / 8] |= 1 << (burst[i] % 8);
+         sent[burst[i] / 8] |= 1 << (burst[i] % 8);
+      }
+
+      if(!frag_wait(f, frag_has_ack, &tx, polled + frag_rto(f) * backoff)) {
+         if(++failures > f->retries) break;
+         backoff *= 2;
+         continue;
+      }
+      failures = 0;
+      backoff = 1;
+
+      /*
+       * Round trip time estimation (RFC 6298).
+       */
+      if(tx.ack_at > polled) {
+         long rtt = tx.ack_at - polled;
+         if(f->srtt == 0) {
+            f->srtt = rtt;
+            f->rttvar = rtt / 2;
+         } else {
+            long err = rtt > f->srtt ? rtt - f->srtt : f->srtt - rtt;
+            f->rttvar = (3 * f->rttvar + err) / 4;
+            f->srtt = (7 * f->srtt + rtt) / 8;
+         }
+      }
+
+      /*
+       * Everything sent before the poll and not acknowledged was lost.
+       */
+      for(i=tx.base; i<count; i++)
+         if(!(tx.acked[i / 8] & (1 << (i % 8)))) sent[i / 8] &= ~(1 << (i % 8));
+   }
+   res = tx.base >= count;
+
+   for(p = &f->tx; *p != NULL; p = &(*p)->next) {
+      if(*p != &tx) continue;
+      *p = tx.next;
+      break;
+   }
+   pthread_mutex_unlock(&f->mutex);
+
+end:
+   free(sent);
+   free(ever);
+   free(tx.acked);
+   return res;
+}
+
+/**
+ * Wait for a complete message, or one of the small messages of a frame.
+ * Background reception is started if needed; packets of other protocols
+ * stay in the reception ring.
+ * Reliable messages are acknowledged as they arrive, even between calls.
+ * @param f Transport.
+ * @param buf Receives the message (to be freed by the caller).
+ * @param timeout Maximum time to wait (ms), negative to wait forever.
+ * @return Message size, or -1 if timed out or reception could not start.
+ */
+long
+frag_receive(frag_t *f, uint8_t **buf, int timeout)
+{
+   long res = -1;
+   uint64_t end = timeout < 0 ? 0 : frag_now_us() + (uint64_t)timeout * 1000 + 1;
+
+   if(!lora_rx_start(f->dev)) return -1;
+   pthread_mutex_lock(&f->mutex);
+   if(frag_wait(f, frag_has_message, NULL, end)) {
+      *buf = f->done[f->done_first].data;
+      res = f->done[f->done_first].size;
+      f->done_first = (f->done_first + 1) % FRAG_MAX_DONE;
+      f->done_count--;
+   }
+   pthread_mutex_unlock(&f->mutex);
+   return res;
+}
+
+/**
+ * Configure the aggregation of posted messages.
+ * @param f Transport.
+ * @param frame_size Largest frame built (3-255 bytes); 0 keeps the current one.
+ * @param latency Longest time a posted message waits for others (ms); negative keeps the current one.
+ */
+void
+frag_set_batching(frag_t *f, int frame_size, int latency)
+{
+   pthread_mutex_lock(&f->batch.mutex);
+   if(frame_size > 255) frame_size = 255;
+   if(frame_size > 0) f->batch.max = frame_size < 3 ? 3 : frame_size;
+   if(latency >= 0) f->batch.latency = latency * 1000ULL;
+   pthread_cond_broadcast(&f->batch.cond);
+   pthread_mutex_unlock(&f->batch.mutex);
+}
+
+/**
+ * Send the pending frame of posted messages, if any, after the frame being
+ * sent by another thread (frames leave in order).
+ * Must be called with the batch mutex held (released while transmitting,
+ * so messages can be posted meanwhile).
+ * @return Result of lora_send_packet(), 1 if there was nothing to send.
+ */
+static int
+frag_send_batch(frag_t *f)
+{
+   uint8_t frame[255];
+
+   while(f->batch.sending) pthread_cond_wait(&f->batch.cond, &f->batch.mutex);
+   int size = f->batch.size;
+   if(size == 0) return 1;
+   memcpy(frame, f->batch.frame, size);
+   f->batch.size = 0;
+   f->batch.sending = 1;
+
+   pthread_mutex_unlock(&f->batch.mutex);
+   int res = lora_send_packet(f->dev, frame, size);
+   pthread_mutex_lock(&f->batch.mutex);
+
+   f->batch.sending = 0;
+   if(res) f->batch.sent++;
+   else f->batch.rejected++;
+   pthread_cond_broadcast(&f->batch.cond);
+   return res;
+}
+
+/**
+ * Batch thread entry point: sends each frame when its deadline arrives.
+ */
+static void *
+frag_batch_thread(void *p)
+{
+   frag_t *f = p;
+   struct timespec ts;
+
+   pthread_mutex_lock(&f->batch.mutex);
+   while(f->batch.running) {
+      if(f->batch.size == 0) {
+         pthread_cond_wait(&f->batch.cond, &f->batch.mutex);
+         continue;
+      }
+      if(frag_now_us() < f->batch.deadline) {
+         ts.tv_sec = f->batch.deadline / 1000000;
+         ts.tv_nsec = (f->batch.deadline % 1000000) * 1000;
+         pthread_cond_timedwait(&f->batch.cond, &f->batch.mutex, &ts);
+         continue;
+      }
+      frag_send_batch(f);
+   }
+   frag_send_batch(f);
+   pthread_mutex_unlock(&f->batch.mutex);
+   return NULL;
+}
+
+/**
+ * Queue a small message to share a frame with others, saving the preamble,
+ * header and CRC of a packet for each. The frame is sent when the next
+ * message does not fit or when its first message has waited the latency
+ * set with frag_set_batching(). Messages that do not fit in a frame are
+ * sent at once with frag_send().
+ * @param f Transport.
+ * @param buf Message data.
+ * @param size Message size.
+ * @return 1 if queued or sent, 0 if a frame was rejected by lora_send_packet()
+ * or the batch thread could not start.
+ */
+int
+frag_post(frag_t *f, uint8_t *buf, int size)
+{
+   int res = 1;
+
+   pthread_mutex_lock(&f->batch.mutex);
+   if(!f->batch.running) {
+      f->batch.running = 1;
+      if(pthread_create(&f->batch.thid, NULL, frag_batch_thread, f) != 0) {
+         f->batch.running = 0;
+         pthread_mutex_unlock(&f->batch.mutex);
+         return 0;
+      }
+   }
+
+   if((size < 0) || (size > FRAG_BATCH_MAX) || (size + 2 > f->batch.max)) {
+      res = frag_send_batch(f);
+      pthread_mutex_unlock(&f->batch.mutex);
+      return res && frag_send(f, buf, size);
+   }
+
+   while(f->batch.size + 1 + size > f->batch.max) res = frag_send_batch(f) && res;
+   if(f->batch.size == 0) {
+      f->batch.frame[f->batch.size++] = FRAG_TYPE_BATCH;
+      f->batch.deadline = frag_now_us() + f->batch.latency;
+      pthread_cond_broadcast(&f->batch.cond);
+   }
+   f->batch.frame[f->batch.size++] = size;
+   memcpy(f->batch.frame + f->batch.size, buf, size);
+   f->batch.size += size;
+   if(f->batch.size + 1 >= f->batch.max) res = frag_send_batch(f) && res;
+   pthread_mutex_unlock(&f->batch.mutex);
+   return res;
+}
+
+/**
+ * Send the posted messages without waiting for their deadline.
+ * @param f Transport.
+ * @return 1 if sent (or nothing pending), 0 if rejected by lora_send_packet().
+ */
+int
+frag_flush(frag_t *f)
+{
+   pthread_mutex_lock(&f->batch.mutex);
+   int res = frag_send_batch(f);
+   pthread_mutex_unlock(&f->batch.mutex);
+   return res;
+}
+
+/**
+ * Read the counters of frames of posted messages, including those sent by
+ * the batch thread.
+ * @param f Transport.
+ * @param sent Frames sent.
+ * @param rejected Frames refused by lora_send_packet() (duty cycle, busy
+ * channel or failed transmission); their messages are lost.
+ */
+void
+frag_batch_info(frag_t *f, unsigned long *sent, unsigned long *rejected)
+{
+   pthread_mutex_lock(&f->batch.mutex);
+   *sent = f->batch.sent;
+   *rejected = f->batch.rejected;
+   pthread_mutex_unlock(&f->batch.mutex);
+}
+
+/**
+ * Read the state of the retransmission timer.
+ * @param f Transport.
+ * @param rtt Smoothed round trip time (us, 0 if unknown).
+ * @param rto Current retransmission timeout (us).
+ * @param retransmissions Fragments sent again since the transport was created.
+ */
+void
+frag_arq_info(frag_t *f, long *rtt, long *rto, unsigned long *retransmissions)
+{
+   pthread_mutex_lock(&f->mutex);
+   *rtt = f->srtt;
+   *rto = frag_rto(f);
+   *retransmissions = f->retransmissions;
+   pthread_mutex_unlock(&f->mutex);
+}
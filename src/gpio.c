@@ -1,10 +1,136 @@
 
+#include "gpio.h"
 #include <stdint.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
 #include <poll.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+
+#define DEFAULT_GPIO_CHIP        "/dev/gpiochip0"
+#define GPIO_MAX_FD              1024
+
+/*
+ * GPIO character device used for the lines (empty = sysfs only).
+ */
+static char __chip_name[80] = DEFAULT_GPIO_CHIP;
+
+/*
+ * Marks file handlers that are line requests of the character device.
+ * All other handlers are sysfs value files.
+ */
+static uint8_t __chardev[GPIO_MAX_FD];
+
+static int gpiodev_open(char *device, int pin, int output);
+static int gpiodev_close(int pin, int fd);
+static void gpiodev_output(int fd, int val);
+static int gpiodev_input(int fd);
+static int gpiodev_wait(int pin, int fd, int rising, int timeout);
+static int gpiodev_wait_stamp(int pin, int fd, int rising, int timeout, uint64_t *stamp);
+
+/*
+ * Kernel transport: GPIO character device, with sysfs as fallback (default).
+ */
+static gpio_transport_t __gpiodev = { gpiodev_open, gpiodev_close, gpiodev_output, gpiodev_input, gpiodev_wait, gpiodev_wait_stamp };
+static gpio_transport_t *__transport = &__gpiodev;
+
+/**
+ * Select the default GPIO character device used for new pins.
+ * If the device cannot be used, pins are handled through sysfs.
+ * @param device Device file name, like /dev/gpiochip0, or NULL/empty to use sysfs only.
+ */
+void
+gpio_set_chip(char *device)
+{
+   if(device == NULL) device = "";
+   strncpy(__chip_name, device, sizeof(__chip_name) - 1);
+}
+
+/**
+ * Select the transport used by all GPIO functions.
+ * Must be called before opening any pin.
+ * @param t Transport, or NULL for the kernel drivers.
+ */
+void
+gpio_set_transport(gpio_transport_t *t)
+{
+   __transport = t ? t : &__gpiodev;
+}
+
+/**
+ * Transport currently used by the GPIO functions.
+ */
+gpio_transport_t *
+gpio_get_transport(void)
+{
+   return __transport;
+}
+
+/**
+ * Request a line from the GPIO character device.
+ * Outputs start at high level, inputs report both edges.
+ * @param device Device file name, like /dev/gpiochip0.
+ * @param pin Line offset in the chip.
+ * @param output Control direction: 0 = input, 1 = output.
+ * @return Positive line handler if succesful, negative if failure.
+ */
+static int
+gpio_chip_open(char *device, int pin, int output)
+{
+   struct gpio_v2_line_request req;
+   int chip, res;
+
+   if(device[0] == 0) return -1;
+   chip = open(device, O_RDWR);
+   if(chip < 0) return chip;
+
+   memset(&req, 0, sizeof(req));
+   req.offsets[0] = pin;
+   req.num_lines = 1;
+   strncpy(req.consumer, "PyLora", sizeof(req.consumer) - 1);
+   if(output) {
+      req.config.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+      req.config.num_attrs = 1;
+      req.config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+      req.config.attrs[0].attr.values = 1;
+      req.config.attrs[0].mask = 1;
+   } else {
+      req.config.flags = GPIO_V2_LINE_FLAG_INPUT 
+         | GPIO_V2_LINE_FLAG_EDGE_RISING 
+         | GPIO_V2_LINE_FLAG_EDGE_FALLING;
+   }
+
+   res = ioctl(chip, GPIO_V2_GET_LINE_IOCTL, &req);
+   close(chip);
+   if(res < 0) return -1;
+   if(req.fd >= GPIO_MAX_FD) {
+      close(req.fd);
+      return -1;
+   }
+
+   /*
+    * Several threads may wait on an input: the one losing the race for an
+    * event must not block in read().
+    */
+   if(!output) fcntl(req.fd, F_SETFL, fcntl(req.fd, F_GETFL) | O_NONBLOCK);
+
+   __chardev[req.fd] = 1;
+   return req.fd;
+}
+
+/**
+ * Check if a handler belongs to the GPIO character device.
+ * @param fd Control file handler for the pin.
+ */
+static int
+gpio_is_chardev(int fd)
+{
+   return (fd >= 0) && (fd < GPIO_MAX_FD) && __chardev[fd];
+}
 
 /**
  * Perform retries to open a system file.
@@ -25,17 +151,21 @@ try_open(char *fn, int mode)
    return fd;
 }
 
-/**
- * Open a device file for GPIO control.
- * @param pin Pin number to control.
- * @param output Control direction: 0 = input, 1 = output.
- * @return Positive handler if succesful, negative if failure.
+/*
+ * Open a pin through the character device or sysfs (see gpio_open_chip()).
  */
-int 
-gpio_open(int pin, int output)
+static int 
+gpiodev_open(char *device, int pin, int output)
 {
    char fn[80];
    int fd;
+
+   /*
+    * Prefer the character device, sysfs is the fallback.
+    */
+   fd = gpio_chip_open(device, pin, output);
+   if(fd >= 0) return fd;
+
    sprintf(fn, "/sys/class/gpio/gpio%d/value", pin);
    if(access(fn, F_OK) == -1) {
       /*
@@ -68,17 +198,20 @@ gpio_open(int pin, int output)
    return fd;
 }
 
-/**
- * Finish using a pin from user space.
- * @param pin Pin number to close.
- * @param fd Control file handler for the pin.
- * @return 1 if successful.
+/*
+ * Release a pin (see gpio_close()).
  */
-int 
-gpio_close(int pin, int fd)
+static int 
+gpiodev_close(int pin, int fd)
 {
    char fn[80];
    
+   if(gpio_is_chardev(fd)) {
+      __chardev[fd] = 0;
+      close(fd);
+      return 1;
+   }
+
    close(fd);
    
    fd = open("/sys/class/gpio/unexport", O_WRONLY);
@@ -90,30 +223,36 @@ gpio_close(int pin, int fd)
    return 1;
 }
 
-/**
- * Change the value of an output pin.
- * @param fd Control file handler for the pin.
- * @param val New value (0-1).
+/*
+ * Change an output pin (see gpio_output()).
  */
-void 
-gpio_output(int fd, int val)
+static void 
+gpiodev_output(int fd, int val)
 {
    if(fd < 0) return;
+   if(gpio_is_chardev(fd)) {
+      struct gpio_v2_line_values v = { .bits = val ? 1 : 0, .mask = 1 };
+      ioctl(fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &v);
+      return;
+   }
    lseek(fd, 0, SEEK_SET);
    if(val) write(fd, "1", 1);
    else write(fd, "0", 1);
 }
 
-/**
- * Read the status of an input pin.
- * @param fd Control file handler for the pin.
- * @return 0-1, current pin status, -1 = error.
+/*
+ * Read an input pin (see gpio_input()).
  */
-int
-gpio_input(int fd)
+static int
+gpiodev_input(int fd)
 {
    char v;
    if(fd < 0) return fd;
+   if(gpio_is_chardev(fd)) {
+      struct gpio_v2_line_values lv = { .bits = 0, .mask = 1 };
+      if(ioctl(fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &lv) < 0) return -1;
+      return (lv.bits & 1) ? 1 : 0;
+   }
    lseek(fd, 0, SEEK_SET);
    if(1 != read(fd, &v, 1)) return -1;
    if(v == '1') return 1;
@@ -121,20 +260,94 @@ gpio_input(int fd)
 }
 
 /**
- * Suspends the process/thread until a rising/falling edge is detected
- * in a input pin.
- * @param pin Input pin number.
- * @param fd Control file handler for the pin (as returned by gpio_open).
+ * Current CLOCK_MONOTONIC time in microseconds.
+ */
+static uint64_t
+gpio_now_us(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Wait for an edge event on a line of the character device.
+ * Edge detection is configured once when the line is requested, so
+ * waiting only costs a poll() and a read() of the event.
+ * @param fd Line handler.
  * @param rising Detect falling edge if zero, rising edge if not.
- * @param timeout Timeout for waiting the transition in ms; -1 means no timeout at all.
+ * @param timeout Timeout in ms; -1 means no timeout at all.
+ * @param stamp Receives the time of the edge taken by the kernel (us,
+ * CLOCK_MONOTONIC), or 0 if it is not known; may be NULL.
+ * @return 1 if the edge was detected, 0 if timeout, negative if error.
  */
-int 
-gpio_wait(int pin, int fd, int rising, int timeout)
+static int
+gpio_chip_wait(int fd, int rising, int timeout, uint64_t *stamp)
+{
+   struct gpio_v2_line_event ev;
+   struct pollfd pfd = { .fd = fd, .events = POLLIN };
+   struct timespec now, end;
+   int res, left = timeout;
+   uint32_t id = rising ? GPIO_V2_LINE_EVENT_RISING_EDGE : GPIO_V2_LINE_EVENT_FALLING_EDGE;
+   uint64_t last = 0;
+
+   /*
+    * Discard events from before the call. If the line is already at
+    * the final level, the edge happened before the call (the last one
+    * discarded, if it was not taken by another thread).
+    */
+   while(poll(&pfd, 1, 0) > 0) {
+      if(read(fd, &ev, sizeof(ev)) != sizeof(ev)) break;
+      last = (ev.id == id) ? ev.timestamp_ns / 1000 : 0;
+   }
+   if(gpiodev_input(fd) == (rising ? 1 : 0)) {
+      if(stamp != NULL) *stamp = last;
+      return 1;
+   }
+
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   if(timeout > 0) {
+      end.tv_sec += timeout / 1000;
+      end.tv_nsec += (timeout % 1000) * 1000000L;
+      if(end.tv_nsec >= 1000000000L) {
+         end.tv_sec++;
+         end.tv_nsec -= 1000000000L;
+      }
+   }
+
+   for(;;) {
+      res = poll(&pfd, 1, left);
+      if(res <= 0) return res;
+      if(read(fd, &ev, sizeof(ev)) != sizeof(ev)) {
+         if(errno != EAGAIN) return -1;
+      } else if(ev.id == id) {
+         if(stamp != NULL) *stamp = ev.timestamp_ns / 1000;
+         return 1;
+      }
+
+      /*
+       * Wrong edge, or the event was taken by another thread: keep
+       * waiting for the remaining time.
+       */
+      if(timeout < 0) continue;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      left = (end.tv_sec - now.tv_sec) * 1000 + (end.tv_nsec - now.tv_nsec) / 1000000L;
+      if(left < 0) left = 0;
+   }
+}
+
+/*
+ * Wait for an edge through the character device or sysfs (see gpio_wait()).
+ */
+static int 
+gpiodev_wait(int pin, int fd, int rising, int timeout)
 {
    char fn[80];
    int f;
    struct pollfd pfd;
  
+   if(gpio_is_chardev(fd)) return gpio_chip_wait(fd, rising, timeout, NULL);
+
    sprintf(fn, "/sys/class/gpio/gpio%d/edge", pin);
    f = open(fn, O_WRONLY);
    if(f < 0) return f;
@@ -145,7 +358,12 @@ gpio_wait(int pin, int fd, int rising, int timeout)
    pfd.fd = fd;
    pfd.events = POLLPRI | POLLERR;
    lseek(fd, 0, SEEK_SET);
-   read(fd, fn, sizeof(fn));
+   if(read(fd, fn, sizeof(fn)) > 0) {
+      /*
+       * Level already reached: the edge happened before the call.
+       */
+      if(fn[0] == (rising ? '1' : '0')) return 1;
+   }
 
    f = poll(&pfd, 1, timeout);
    if(f <= 0) return f;
@@ -156,3 +374,112 @@ gpio_wait(int pin, int fd, int rising, int timeout)
    if(pfd.revents & pfd.events) return 1;
    return -1;
 }
+
+/*
+ * Wait for an edge and tell when it happened (see gpio_wait_stamp()).
+ * Only the character device has kernel timestamps.
+ */
+static int
+gpiodev_wait_stamp(int pin, int fd, int rising, int timeout, uint64_t *stamp)
+{
+   if(gpio_is_chardev(fd)) return gpio_chip_wait(fd, rising, timeout, stamp);
+   *stamp = 0;
+   return gpiodev_wait(pin, fd, rising, timeout);
+}
+
+/**
+ * Open a device file for GPIO control, using the default GPIO chip.
+ * @param pin Pin number to control.
+ * @param output Control direction: 0 = input, 1 = output.
+ * @return Positive handler if succesful, negative if failure.
+ */
+int 
+gpio_open(int pin, int output)
+{
+   return gpio_open_chip(NULL, pin, output);
+}
+
+/**
+ * Open a device file for GPIO control.
+ * @param device GPIO character device (like /dev/gpiochip0), NULL for the
+ * default one, or empty to use sysfs.
+ * @param pin Pin number to control.
+ * @param output Control direction: 0 = input, 1 = output.
+ * @return Positive handler if succesful, negative if failure.
+ */
+int 
+gpio_open_chip(char *device, int pin, int output)
+{
+   return __transport->open(device ? device : __chip_name, pin, output);
+}
+
+/**
+ * Finish using a pin from user space.
+ * @param pin Pin number to close.
+ * @param fd Control file handler for the pin.
+ * @return 1 if successful.
+ */
+int 
+gpio_close(int pin, int fd)
+{
+   return __transport->close(pin, fd);
+}
+
+/**
+ * Change the value of an output pin.
+ * @param fd Control file handler for the pin.
+ * @param val New value (0-1).
+ */
+void 
+gpio_output(int fd, int val)
+{
+   __transport->output(fd, val);
+}
+
+/**
+ * Read the status of an input pin.
+ * @param fd Control file handler for the pin.
+ * @return 0-1, current pin status, -1 = error.
+ */
+int
+gpio_input(int fd)
+{
+   return __transport->input(fd);
+}
+
+/**
+ * Suspends the process/thread until a rising/falling edge is detected
+ * in a input pin. Returns immediately if the pin is already at the level
+ * after the edge (level-latched interrupt lines never miss an event).
+ * @param pin Input pin number.
+ * @param fd Control file handler for the pin (as returned by gpio_open).
+ * @param rising Detect falling edge if zero, rising edge if not.
+ * @param timeout Timeout for waiting the transition in ms; -1 means no timeout at all.
+ * @return 1 if the edge was detected, 0 if timeout, negative if error.
+ */
+int 
+gpio_wait(int pin, int fd, int rising, int timeout)
+{
+   return __transport->wait(pin, fd, rising, timeout);
+}
+
+/**
+ * Wait for an edge like gpio_wait() and tell when it happened: the
+ * timestamp of the kernel edge event where available, otherwise the
+ * time this thread woke up.
+ * @param pin Input pin number.
+ * @param fd Control file handler for the pin (as returned by gpio_open).
+ * @param rising Detect falling edge if zero, rising edge if not.
+ * @param timeout Timeout for waiting the transition in ms; -1 means no timeout at all.
+ * @param stamp Receives the time of the edge (us, CLOCK_MONOTONIC) if detected.
+ * @return 1 if the edge was detected, 0 if timeout, negative if error.
+ */
+int
+gpio_wait_stamp(int pin, int fd, int rising, int timeout, uint64_t *stamp)
+{
+   uint64_t t = 0;
+   int res = __transport->wait_stamp ? __transport->wait_stamp(pin, fd, rising, timeout, &t)
+      : __transport->wait(pin, fd, rising, timeout);
+   if(res > 0) *stamp = t ? t : gpio_now_us();
+   return res;
+}
@@ -1,11 +1,18 @@
 
+#include "adr.h"
+#include "dutycycle.h"
 #include "gpio.h"
+#include "lora.h"
+#include "lz.h"
 #include "spi.h"
 #include <stdint.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <assert.h>
+#include <errno.h>
+#include <time.h>
 #include <pthread.h>
 
 /*
@@ -15,6 +22,7 @@
 #define DEFAULT_CS_PIN_NUMBER          25
 #define DEFAULT_RST_PIN_NUMBER         17
 #define DEFAULT_IRQ_PIN_NUMBER         4
+#define DEFAULT_GPIO_CHIP_NAME         "/dev/gpiochip0"
 
 /*
  * Register definitions
@@ -37,6 +45,7 @@
 #define REG_PKT_RSSI_VALUE             0x1a
 #define REG_MODEM_CONFIG_1             0x1d
 #define REG_MODEM_CONFIG_2             0x1e
+#define REG_SYMB_TIMEOUT_LSB           0x1f
 #define REG_PREAMBLE_MSB               0x20
 #define REG_PREAMBLE_LSB               0x21
 #define REG_PAYLOAD_LENGTH             0x22
@@ -57,6 +66,7 @@
 #define MODE_TX                        0x03
 #define MODE_RX_CONTINUOUS             0x05
 #define MODE_RX_SINGLE                 0x06
+#define MODE_CAD                       0x07
 
 /*
  * PA configuration
@@ -67,108 +77,665 @@
  * IRQ masks
  */
 #define IRQ_TX_DONE_MASK               0x08
+#define IRQ_VALID_HEADER_MASK          0x10
 #define IRQ_PAYLOAD_CRC_ERROR_MASK     0x20
 #define IRQ_RX_DONE_MASK               0x40
+#define IRQ_RX_MASK                    (IRQ_RX_DONE_MASK | IRQ_PAYLOAD_CRC_ERROR_MASK | IRQ_VALID_HEADER_MASK)
+#define IRQ_RX_TIMEOUT_MASK            0x80
+#define IRQ_CAD_DETECTED_MASK          0x01
+#define IRQ_CAD_DONE_MASK              0x04
+#define IRQ_CAD_MASK                   (IRQ_CAD_DONE_MASK | IRQ_CAD_DETECTED_MASK)
+
+/*
+ * Enabled interrupts (REG_IRQ_FLAGS_MASK): RxDone, CRC error and TxDone
+ */
+#define IRQ_MASK_DEFAULT               0x97
+#define IRQ_MASK_CAD                   (IRQ_MASK_DEFAULT & ~IRQ_CAD_MASK)
+#define IRQ_MASK_WINDOW                (IRQ_MASK_DEFAULT & ~IRQ_RX_TIMEOUT_MASK)
 
 #define PA_OUTPUT_RFO_PIN              0
 #define PA_OUTPUT_PA_BOOST_PIN         1
 
 /*
- * File descriptors for the gpios and spi channel
+ * DIO0 mapping (REG_DIO_MAPPING_1)
+ */
+#define DIO0_RX_DONE                   0x00
+#define DIO0_TX_DONE                   0x40
+#define DIO0_CAD_DONE                  0x80
+
+/*
+ * Transmission timing
+ */
+#define TX_IRQ_MARGIN_MS               50       // extra wait for TxDone interrupt over time on air
+#define TX_POLL_WINDOW_US              2000     // polling window before the expected end of transmission
+#define WINDOW_POLL_MS                 1        // wait between checks of a reception window
+#define LBT_MAX_EXPONENT               6        // backoff doubles up to 64 slots
+#define TRX_TX_BASE                    0x80     // FIFO region of transmitted packets in transceive mode
+
+/*
+ * Shadow copy of the configuration registers.
+ * Only registers that are never changed by the radio itself are cached;
+ * FIFO, op-mode, IRQ flags, RSSI/SNR and FIFO pointers always go to hardware.
+ */
+#define SHADOW_SIZE                    0x80
+
+/*
+ * Reception ring: single producer (reception thread), single consumer.
+ */
+#define DEFAULT_RX_DEPTH               16
+
+/*
+ * Asynchronous transmission queue
+ */
+#define TXQ_SIZE                       32
+
+typedef struct {
+   uint8_t data[255];
+   int size;
+   int priority;
+   int handle;
+   uint64_t deadline;                  // us (CLOCK_MONOTONIC), 0 = none
+   uint32_t seq;
+   lora_tx_done_t done;
+   void *arg;
+} tx_entry_t;
+
+/*
+ * Entry of the channel plan, with its register values.
+ */
+typedef struct {
+   lora_channel_t ch;
+   uint8_t frf[3];                     // REG_FRF_MSB..REG_FRF_LSB
+   int bw;                             // Bw field of REG_MODEM_CONFIG_1
+   uint64_t airtime;                   // us transmitted
+} channel_t;
+
+/*
+ * State of one radio transceiver.
  */
-static int __spi = -1;
-static int __cs = -1;
-static int __rst = -1;
-static int __irq = -1;
+struct lora_dev {
+   /*
+    * File descriptors for the gpios and spi channel
+    */
+   int spi;
+   int cs;
+   int rst;
+   int irq;
+
+   char spi_device_name[80];
+   char gpio_chip[80];
+   int cs_pin_number;
+   int rst_pin_number;
+   int irq_pin_number;
+   int hw_cs;
+
+   int implicit;
+   long frequency;
+   int tx_wait;
+   int transceive;                     // listen whenever not transmitting, split FIFO
+   int lbt_attempts;                   // channel activity detections before giving up, 0 = off
+   long lbt_slot;                      // backoff unit, us (0 = time on air of the packet)
+   unsigned lbt_seed;
+   uint64_t rx_edge;                   // RxDone edge waited for, not read yet (us, 0 = none)
+   uint64_t rx_timestamp;              // last packet read (us)
+   uint64_t tx_timestamp;              // end of the last transmission (us)
+
+   uint8_t shadow[SHADOW_SIZE];
+   uint8_t shadow_valid[SHADOW_SIZE];
+
+   /*
+    * Asynchronous API
+    */
+   void (*callback)(void *arg);
+   void *callback_arg;
+   pthread_t thid;
+   pthread_mutex_t mutex;
+   pthread_cond_t idle_cond;           // with mutex, signalled when busy changes or busy_irq is set
+   int busy;                           // transmission or CAD in progress, with the lock released
+   unsigned busy_seq;                  // operations marked busy so far
+   int busy_irq;                       // interrupt flags ending it, seen by the reception thread
+   uint64_t busy_stamp;                // their edge time (us, 0 if unknown)
+   int rx_running;
+   pthread_t dispatch_thid;
+   int dispatch_running;
+
+   lora_packet_t *ring;
+   unsigned ring_depth;
+   unsigned ring_head;
+   unsigned ring_tail;
+   unsigned long ring_received;
+   unsigned long ring_overflows;
+   pthread_mutex_t ring_mutex;
+   pthread_cond_t ring_cond;
+
+   lora_rx_filter_t rx_filter;         // protocol taking packets before the ring
+   void *rx_filter_arg;
+   pthread_mutex_t filter_mutex;       // held while the filter runs
+
+   tx_entry_t txq[TXQ_SIZE];
+   int txq_used[TXQ_SIZE];
+   int txq_count;
+   int txq_busy;
+   int txq_running;
+   int txq_handle;
+   uint32_t txq_seq;
+   pthread_t txq_thid;
+   pthread_mutex_t txq_mutex;
+   pthread_cond_t txq_cond;
+
+   /*
+    * Statistics (updated with atomic operations)
+    */
+   lora_stats_t stats;
+   uint64_t lock_since;
+
+   /*
+    * Regulatory duty cycle (NULL = not limited)
+    */
+   dc_t *dc;
 
-static char __spi_device_name[80] = DEFAULT_SPI_DEVICE_NAME;
-static int __cs_pin_number = DEFAULT_CS_PIN_NUMBER;
-static int __rst_pin_number = DEFAULT_RST_PIN_NUMBER;
-static int __irq_pin_number = DEFAULT_IRQ_PIN_NUMBER;
+   /*
+    * Adaptive data rate (created on first use)
+    */
+   adr_t *adr;
+
+   /*
+    * Channel plan (see lora_set_channels())
+    */
+   channel_t channels[LORA_MAX_CHANNELS];
+   int channel_count;
+   int channel_cur;                    // -1 = tuned out of the plan
+   int channel_home;                   // channel for reception, -1 = none
+   int channel_next;                   // round robin position
+
+   /*
+    * Payload compression (NULL = frames sent as they are)
+    */
+   lz_t *lz;
+};
 
-static int __implicit;
-static long __frequency;
+#define lock(d)         lora_lock(d)
+#define lock_idle(d)    lora_lock_idle(d)
+#define unlock(d)       lora_unlock(d)
+
+#define stat_add(d, field, n)    __atomic_add_fetch(&(d)->stats.field, (n), __ATOMIC_RELAXED)
 
 /*
- * Asynchronous API
+ * Instance used by the legacy (single radio) interface.
+ */
+static lora_dev_t *__default = NULL;
+static pthread_mutex_t __default_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Current time for deadlines and timestamps.
+ * @return CLOCK_MONOTONIC time in microseconds.
+ */
+static uint64_t
+lora_now_us(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Time base of packet timestamps and reception windows.
+ * @return CLOCK_MONOTONIC time in microseconds.
+ */
+uint64_t
+lora_clock_us(void)
+{
+   return lora_now_us();
+}
+
+/**
+ * Add a value to a latency histogram.
+ * @param h Histogram.
+ * @param us Value in microseconds.
+ */
+static void
+lora_hist_add(lora_hist_t *h, uint64_t us)
+{
+   int b = us ? 64 - __builtin_clzll(us) : 0;
+   if(b >= LORA_HIST_BUCKETS) b = LORA_HIST_BUCKETS - 1;
+
+   __atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&h->sum, us, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&h->buckets[b], 1, __ATOMIC_RELAXED);
+
+   uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+   while((us > max) && !__atomic_compare_exchange_n(&h->max, &max, us, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/**
+ * Take the radio lock, accounting the time waiting for it.
+ */
+static void
+lora_lock(lora_dev_t *dev)
+{
+   uint64_t t = 0;
+   if(pthread_mutex_trylock(&dev->mutex) != 0) {
+      t = lora_now_us();
+      pthread_mutex_lock(&dev->mutex);
+      dev->lock_since = lora_now_us();
+      t = dev->lock_since - t;
+      stat_add(dev, lock_contended, 1);
+   } else dev->lock_since = lora_now_us();
+
+   stat_add(dev, lock_count, 1);
+   lora_hist_add(&dev->stats.lock_wait, t);
+}
+
+/**
+ * Take the radio lock once no transmission or channel activity detection
+ * is in progress (see lora_wait_irq()), for operations that change the
+ * state of the radio.
+ */
+static void
+lora_lock_idle(lora_dev_t *dev)
+{
+   lora_lock(dev);
+   if(!dev->busy) return;
+   while(dev->busy) pthread_cond_wait(&dev->idle_cond, &dev->mutex);
+   dev->lock_since = lora_now_us();
+}
+
+/**
+ * Release the radio lock, accounting the time it was held.
+ */
+static void
+lora_unlock(lora_dev_t *dev)
+{
+   lora_hist_add(&dev->stats.lock_hold, lora_now_us() - dev->lock_since);
+   pthread_mutex_unlock(&dev->mutex);
+}
+
+/**
+ * Create a new radio instance, with default pins.
+ * @return Radio handle, or NULL if out of memory.
+ */
+lora_dev_t *
+lora_create(void)
+{
+   lora_dev_t *dev = calloc(1, sizeof(lora_dev_t));
+   if(dev == NULL) return NULL;
+
+   dev->spi = -1;
+   dev->cs = -1;
+   dev->rst = -1;
+   dev->irq = -1;
+   strcpy(dev->spi_device_name, DEFAULT_SPI_DEVICE_NAME);
+   strcpy(dev->gpio_chip, DEFAULT_GPIO_CHIP_NAME);
+   dev->cs_pin_number = DEFAULT_CS_PIN_NUMBER;
+   dev->rst_pin_number = DEFAULT_RST_PIN_NUMBER;
+   dev->irq_pin_number = DEFAULT_IRQ_PIN_NUMBER;
+   dev->tx_wait = LORA_TX_WAIT_IRQ;
+   dev->channel_cur = -1;
+   dev->channel_home = -1;
+   dev->ring_depth = DEFAULT_RX_DEPTH;
+   dev->lbt_seed = (unsigned)(lora_now_us() ^ (uintptr_t)dev);
+
+   pthread_condattr_t attr;
+   pthread_condattr_init(&attr);
+   pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+   pthread_mutex_init(&dev->mutex, NULL);
+   pthread_cond_init(&dev->idle_cond, &attr);
+   pthread_condattr_destroy(&attr);
+   pthread_mutex_init(&dev->ring_mutex, NULL);
+   pthread_mutex_init(&dev->filter_mutex, NULL);
+   pthread_cond_init(&dev->ring_cond, NULL);
+   pthread_mutex_init(&dev->txq_mutex, NULL);
+   pthread_cond_init(&dev->txq_cond, NULL);
+   return dev;
+}
+
+/**
+ * Release a radio instance (closing it if needed).
+ * @param dev Radio handle.
  */
-static void (*__callback)(void) = NULL;
-static pthread_t __thid;
-static pthread_mutex_t __mutex;
+void
+lora_destroy(lora_dev_t *dev)
+{
+   if(dev == NULL) return;
+   if(lora_initialized(dev)) lora_close(dev);
+
+   pthread_mutex_destroy(&dev->mutex);
+   pthread_cond_destroy(&dev->idle_cond);
+   pthread_mutex_destroy(&dev->ring_mutex);
+   pthread_mutex_destroy(&dev->filter_mutex);
+   pthread_cond_destroy(&dev->ring_cond);
+   pthread_mutex_destroy(&dev->txq_mutex);
+   pthread_cond_destroy(&dev->txq_cond);
+   free(dev->ring);
+   dc_destroy(dev->dc);
+   adr_destroy(dev->adr);
+   lz_destroy(dev->lz);
+   free(dev);
+}
 
-#define lock()          pthread_mutex_lock(&__mutex)
-#define unlock()        pthread_mutex_unlock(&__mutex)
+/**
+ * Return the radio instance used by the legacy single radio interface.
+ * It is created on first use.
+ */
+lora_dev_t *
+lora_default(void)
+{
+   pthread_mutex_lock(&__default_mutex);
+   if(__default == NULL) __default = lora_create();
+   pthread_mutex_unlock(&__default_mutex);
+   return __default;
+}
 
 /**
  * Returns non-zero value if the hardware had been initialized
  */
 int
-lora_initialized(void)
+lora_initialized(lora_dev_t *dev)
 {
-   if(__spi <= 0) return 0;
-   if(__cs <= 0) return 0;
-   if(__rst <= 0) return 0;
-   if(__irq <= 0) return 0;
+   if(dev->spi <= 0) return 0;
+   if(!dev->hw_cs && (dev->cs <= 0)) return 0;
+   if(dev->rst <= 0) return 0;
+   if(dev->irq <= 0) return 0;
    return 1;
 }
 
 /**
  * Define pins and spi channel for interfacing with the transceiver.
+ * @param dev Radio handle.
  * @param spidev SPI device name (like /dev/spidev0.0) or NULL
  * @param cs Chip-select pin number if not negative.
  * @param rst Negative Reset pin number if not negative.
  */
 void
-lora_set_pins(char *spidev, int cs, int rst, int irq)
+lora_set_pins(lora_dev_t *dev, char *spidev, int cs, int rst, int irq)
+{
+   if(spidev != NULL) strncpy(dev->spi_device_name, spidev, sizeof(dev->spi_device_name) - 1);
+   if(cs >= 0) dev->cs_pin_number = cs;
+   if(rst >= 0) dev->rst_pin_number = rst;
+   if(irq >= 0) dev->irq_pin_number = irq;
+}
+
+/**
+ * Select the GPIO character device for the control pins.
+ * Must be called before lora_init().
+ * @param device Device file name (like /dev/gpiochip0), or NULL/empty to use sysfs.
+ */
+void
+lora_set_gpio_chip(lora_dev_t *dev, char *device)
+{
+   if(device == NULL) device = "";
+   strncpy(dev->gpio_chip, device, sizeof(dev->gpio_chip) - 1);
+}
+
+/**
+ * Select how the chip select line is driven.
+ * Must be called before lora_init().
+ * @param dev Radio handle.
+ * @param enable Non-zero to let spidev drive the hardware chip select of the
+ * SPI channel (several register accesses per ioctl), zero to toggle the
+ * chip select pin through a GPIO (any pin can be used).
+ */
+void
+lora_set_hw_cs(lora_dev_t *dev, int enable)
+{
+   dev->hw_cs = enable;
+}
+
+/**
+ * Start a new register transaction with the radio.
+ * Accesses queued with lora_queue_write(), lora_queue_read() and
+ * lora_queue_fifo() are executed together by lora_commit().
+ * @param dev Radio handle.
+ * @param m Transaction to initialize.
+ */
+void
+lora_begin(lora_dev_t *dev, spi_msg_t *m)
+{
+   spi_msg_init(m, dev->spi, dev->hw_cs ? -1 : dev->cs);
+}
+
+/**
+ * Check if a register can be kept in the shadow copy.
+ * REG_LNA is not: with the AGC on (REG_MODEM_CONFIG_3) the radio changes
+ * its LnaGain bits.
+ * @param reg Register index.
+ * @return Non-zero if the register only changes when written by the driver.
+ */
+static int
+lora_cacheable(int reg)
+{
+   switch(reg) {
+      case REG_FRF_MSB:
+      case REG_FRF_MID:
+      case REG_FRF_LSB:
+      case REG_PA_CONFIG:
+      case REG_FIFO_TX_BASE_ADDR:
+      case REG_FIFO_RX_BASE_ADDR:
+      case REG_IRQ_FLAGS_MASK:
+      case REG_MODEM_CONFIG_1:
+      case REG_MODEM_CONFIG_2:
+      case REG_SYMB_TIMEOUT_LSB:
+      case REG_PREAMBLE_MSB:
+      case REG_PREAMBLE_LSB:
+      case REG_PAYLOAD_LENGTH:
+      case REG_MODEM_CONFIG_3:
+      case REG_DETECTION_OPTIMIZE:
+      case REG_DETECTION_THRESHOLD:
+      case REG_SYNC_WORD:
+      case REG_DIO_MAPPING_1:
+         return 1;
+   }
+   return 0;
+}
+
+/**
+ * Forget all cached register values.
+ * Must be called whenever the radio may have lost its configuration.
+ */
+void
+lora_invalidate_shadow(lora_dev_t *dev)
+{
+   memset(dev->shadow_valid, 0, sizeof(dev->shadow_valid));
+}
+
+/**
+ * Queue a register write.
+ * Writes to cached registers are skipped if the value is already there.
+ * @param dev Radio handle.
+ * @param m Transaction.
+ * @param reg Register index.
+ * @param val Value to write.
+ */
+void
+lora_queue_write(lora_dev_t *dev, spi_msg_t *m, int reg, int val)
 {
-   if(spidev != NULL) strncpy(__spi_device_name, spidev, sizeof(__spi_device_name));
-   if(cs >= 0) __cs_pin_number = cs;
-   if(rst >= 0) __rst_pin_number = rst;
-   if(irq >= 0) __irq_pin_number = irq;
+   uint8_t v = val;
+   int cacheable = lora_cacheable(reg);
+   if(cacheable && dev->shadow_valid[reg] && (dev->shadow[reg] == v)) return;
+   if(spi_msg_add(m, 0x80 | reg, &v, 1) == NULL) return;
+   if(cacheable) {
+      dev->shadow[reg] = v;
+      dev->shadow_valid[reg] = 1;
+   }
+}
+
+/**
+ * Queue a register read.
+ * The value always comes from the hardware (shadow copy is bypassed).
+ * @param m Transaction.
+ * @param reg Register index.
+ * @return Where the value will be available after lora_commit(), NULL if
+ * the transaction is full (lora_commit() then fails).
+ */
+uint8_t *
+lora_queue_read(spi_msg_t *m, int reg)
+{
+   return spi_msg_add(m, reg, NULL, 1);
+}
+
+/**
+ * Queue a burst access to the FIFO.
+ * The address byte is sent once and the radio auto-increments
+ * the FIFO pointer for every following byte.
+ * @param m Transaction.
+ * @param buf Data to write, or NULL to read from the FIFO.
+ * @param size Number of bytes (up to 255).
+ * @return Where the data read will be available after lora_commit(), NULL
+ * if the transaction is full (lora_commit() then fails).
+ */
+uint8_t *
+lora_queue_fifo(spi_msg_t *m, uint8_t *buf, int size)
+{
+   if(size > 255) size = 255;
+   if(buf != NULL) return spi_msg_add(m, 0x80 | REG_FIFO, buf, size);
+   return spi_msg_add(m, REG_FIFO, NULL, size);
+}
+
+/**
+ * Execute all accesses queued in a transaction.
+ * A transaction that overflowed (see spi_msg_add()) is a driver bug: the
+ * results of its reads cannot be used, so the process is aborted instead.
+ * @param dev Radio handle.
+ * @param m Transaction.
+ */
+void
+lora_commit(lora_dev_t *dev, spi_msg_t *m)
+{
+   if(m->overflow) {
+      fprintf(stderr, "lora: SPI transaction overflow (%d transfers, %d bytes)\n", m->count, m->used);
+      abort();
+   }
+   if(m->count == 0) return;
+   stat_add(dev, spi_transactions, 1);
+   stat_add(dev, spi_transfers, m->count);
+   stat_add(dev, spi_bytes, m->used);
+   spi_msg_submit(m);
 }
 
 /**
  * Write a value to a register.
+ * @param dev Radio handle.
  * @param reg Register index.
  * @param val Value to write.
  */
 void 
-lora_write_reg(int reg, int val)
+lora_write_reg(lora_dev_t *dev, int reg, int val)
+{
+   spi_msg_t m;
+   lora_begin(dev, &m);
+   lora_queue_write(dev, &m, reg, val);
+   lora_commit(dev, &m);
+}
+
+/**
+ * Read the value of a register directly from the hardware.
+ * @param dev Radio handle.
+ * @param reg Register index.
+ * @return Value of the register.
+ */
+static int
+lora_read_hw(lora_dev_t *dev, int reg)
 {
-   uint8_t out[2] = { 0x80 | reg, val };
-   uint8_t in[2];
-   gpio_output(__cs, 0);
-   spi_transfer(__spi, out, in, sizeof(out));
-   gpio_output(__cs, 1);
+   spi_msg_t m;
+   lora_begin(dev, &m);
+   uint8_t *v = lora_queue_read(&m, reg);
+   lora_commit(dev, &m);
+   return *v;
 }
 
 /**
  * Read the current value of a register.
+ * Configuration registers are served from the shadow copy when possible.
+ * @param dev Radio handle.
  * @param reg Register index.
  * @return Value of the register.
  */
 int
-lora_read_reg(int reg)
+lora_read_reg(lora_dev_t *dev, int reg)
 {
-   uint8_t out[2] = { reg, 0xff };
-   uint8_t in[2];
-   gpio_output(__cs, 0);
-   spi_transfer(__spi, out, in, sizeof(out));
-   gpio_output(__cs, 1);
-   
-   return in[1];
+   if(!lora_cacheable(reg)) return lora_read_hw(dev, reg);
+
+   if(dev->shadow_valid[reg]) {
+#ifdef LORA_SHADOW_DEBUG
+      int v = lora_read_hw(dev, reg);
+      if(v != dev->shadow[reg])
+         fprintf(stderr, "lora: shadow mismatch at %02x (%02x, hw %02x)\n", reg, dev->shadow[reg], v);
+#endif
+      return dev->shadow[reg];
+   }
+
+   dev->shadow[reg] = lora_read_hw(dev, reg);
+   dev->shadow_valid[reg] = 1;
+   return dev->shadow[reg];
+}
+
+/**
+ * Compare the shadow copy against the registers in the hardware.
+ * Mismatches are reported on stderr and the shadow copy is corrected.
+ * @return Number of registers found different.
+ */
+int
+lora_verify_shadow(lora_dev_t *dev)
+{
+   int i, v, errors = 0;
+   lock_idle(dev);
+   for(i=0; i<SHADOW_SIZE; i++) {
+      if(!dev->shadow_valid[i]) continue;
+      v = lora_read_hw(dev, i);
+      if(v == dev->shadow[i]) continue;
+      fprintf(stderr, "lora: shadow mismatch at %02x (%02x, hw %02x)\n", i, dev->shadow[i], v);
+      dev->shadow[i] = v;
+      errors++;
+   }
+   unlock(dev);
+   return errors;
+}
+
+/**
+ * Write a block of data to the FIFO in a single SPI burst.
+ * @param dev Radio handle.
+ * @param buf Data to write.
+ * @param size Number of bytes (up to 255).
+ */
+void
+lora_write_fifo(lora_dev_t *dev, uint8_t *buf, int size)
+{
+   spi_msg_t m;
+   if(size <= 0) return;
+   lora_begin(dev, &m);
+   lora_queue_fifo(&m, buf, size);
+   lora_commit(dev, &m);
+}
+
+/**
+ * Read a block of data from the FIFO in a single SPI burst.
+ * @param dev Radio handle.
+ * @param buf Buffer to store the data.
+ * @param size Number of bytes to read (up to 255).
+ */
+void
+lora_read_fifo(lora_dev_t *dev, uint8_t *buf, int size)
+{
+   spi_msg_t m;
+   if(size <= 0) return;
+   if(size > 255) size = 255;
+   lora_begin(dev, &m);
+   uint8_t *in = lora_queue_fifo(&m, NULL, size);
+   lora_commit(dev, &m);
+   memcpy(buf, in, size);
 }
 
 /**
  * Perform physical reset on the Lora chip
  */
 void 
-lora_reset(void)
+lora_reset(lora_dev_t *dev)
 {
-   gpio_output(__cs, 1);
-   gpio_output(__rst, 0);
+   lora_invalidate_shadow(dev);
+   gpio_output(dev->cs, 1);
+   gpio_output(dev->rst, 0);
    usleep(300);
-   gpio_output(__rst, 1);
+   gpio_output(dev->rst, 1);
    usleep(10000);
 }
 
@@ -177,27 +744,28 @@ lora_reset(void)
  * Packet size will be included in the frame.
  */
 void 
-lora_explicit_header_mode(void)
+lora_explicit_header_mode(lora_dev_t *dev)
 {
-   __implicit = 0;
-   lock();
-   lora_write_reg(REG_MODEM_CONFIG_1, lora_read_reg(REG_MODEM_CONFIG_1) & 0xfe);
-   unlock();
+   dev->implicit = 0;
+   lock_idle(dev);
+   lora_write_reg(dev, REG_MODEM_CONFIG_1, lora_read_reg(dev, REG_MODEM_CONFIG_1) & 0xfe);
+   unlock(dev);
 }
 
 /**
  * Configure implicit header mode.
  * All packets will have a predefined size.
+ * @param dev Radio handle.
  * @param size Size of the packets.
  */
 void 
-lora_implicit_header_mode(int size)
+lora_implicit_header_mode(lora_dev_t *dev, int size)
 {
-   __implicit = 1;
-   lock();
-   lora_write_reg(REG_MODEM_CONFIG_1, lora_read_reg(REG_MODEM_CONFIG_1) | 0x01);
-   lora_write_reg(REG_PAYLOAD_LENGTH, size);
-   unlock();
+   dev->implicit = 1;
+   lock_idle(dev);
+   lora_write_reg(dev, REG_MODEM_CONFIG_1, lora_read_reg(dev, REG_MODEM_CONFIG_1) | 0x01);
+   lora_write_reg(dev, REG_PAYLOAD_LENGTH, size);
+   unlock(dev);
 }
 
 /**
@@ -205,11 +773,11 @@ lora_implicit_header_mode(int size)
  * Must be used to change registers and access the FIFO.
  */
 void 
-lora_idle(void)
+lora_idle(lora_dev_t *dev)
 {
-   lock();
-   lora_write_reg(REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_STDBY);
-   unlock();
+   lock_idle(dev);
+   lora_write_reg(dev, REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_STDBY);
+   unlock(dev);
 }
 
 /**
@@ -217,11 +785,11 @@ lora_idle(void)
  * Low power consumption and FIFO is lost.
  */
 void 
-lora_sleep(void)
+lora_sleep(lora_dev_t *dev)
 {
-   lock(); 
-   lora_write_reg(REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_SLEEP);
-   unlock();
+   lock_idle(dev); 
+   lora_write_reg(dev, REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_SLEEP);
+   unlock(dev);
 }
 
 /**
@@ -229,91 +797,148 @@ lora_sleep(void)
  * Incoming packets will be received.
  */
 void 
-lora_receive(void)
+lora_receive(lora_dev_t *dev)
 {
-   lock();
-   lora_write_reg(REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_RX_CONTINUOUS);
-   unlock();
+   lock_idle(dev);
+   lora_write_reg(dev, REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_RX_CONTINUOUS);
+   unlock(dev);
 }
 
 /**
  * Configure power level for transmission
+ * @param dev Radio handle.
  * @param level 2-17, from least to most power
  */
 void 
-lora_set_tx_power(int level)
+lora_set_tx_power(lora_dev_t *dev, int level)
 {
    // RF9x module uses PA_BOOST pin
    if (level < 2) level = 2;
    else if (level > 17) level = 17;
-   lock();
-   lora_write_reg(REG_PA_CONFIG, PA_BOOST | (level - 2));
-   unlock();
+   lock_idle(dev);
+   lora_write_reg(dev, REG_PA_CONFIG, PA_BOOST | (level - 2));
+   unlock(dev);
+}
+
+/**
+ * Queue a burst write over a range of consecutive configuration registers.
+ * Only the span between the first and last register that differ from the
+ * shadow copy is actually transferred.
+ * @param dev Radio handle.
+ * @param m Transaction.
+ * @param reg First register of the range.
+ * @param val New values for the range.
+ * @param count Number of registers.
+ */
+static void
+lora_queue_burst(lora_dev_t *dev, spi_msg_t *m, int reg, uint8_t *val, int count)
+{
+   int i, first = -1, last = -1;
+   for(i=0; i<count; i++) {
+      if(dev->shadow_valid[reg + i] && (dev->shadow[reg + i] == val[i])) continue;
+      if(first < 0) first = i;
+      last = i;
+   }
+   if(first < 0) return;
+   if(spi_msg_add(m, 0x80 | (reg + first), val + first, last - first + 1) == NULL) return;
+
+   for(i=first; i<=last; i++) {
+      dev->shadow[reg + i] = val[i];
+      dev->shadow_valid[reg + i] = 1;
+   }
+}
+
+/**
+ * Compute the FRF register value for a carrier frequency.
+ * @param frequency Frequency in Hz
+ * @return 24-bit value for REG_FRF_MSB..REG_FRF_LSB.
+ */
+static uint32_t
+lora_frf(long frequency)
+{
+   return ((uint64_t)frequency << 19) / 32000000;
 }
 
 /**
  * Set carrier frequency.
+ * @param dev Radio handle.
  * @param frequency Frequency in Hz
  */
 void 
-lora_set_frequency(long frequency)
+lora_set_frequency(lora_dev_t *dev, long frequency)
 {
-   __frequency = frequency;
-
-   uint64_t frf = ((uint64_t)frequency << 19) / 32000000;
-
-   lock();
-   lora_write_reg(REG_FRF_MSB, (uint8_t)(frf >> 16));
-   lora_write_reg(REG_FRF_MID, (uint8_t)(frf >> 8));
-   lora_write_reg(REG_FRF_LSB, (uint8_t)(frf >> 0));
-   unlock();
+   uint32_t frf = lora_frf(frequency);
+   uint8_t val[3] = { (uint8_t)(frf >> 16), (uint8_t)(frf >> 8), (uint8_t)(frf >> 0) };
+
+   spi_msg_t m;
+   lock_idle(dev);
+   dev->frequency = frequency;
+   dev->channel_cur = -1;
+   lora_begin(dev, &m);
+   lora_queue_burst(dev, &m, REG_FRF_MSB, val, sizeof(val));
+   lora_commit(dev, &m);
+   unlock(dev);
 }
 
 /**
  * Set spreading factor.
+ * @param dev Radio handle.
  * @param sf 6-12, Spreading factor to use.
  */
 void 
-lora_set_spreading_factor(int sf)
+lora_set_spreading_factor(lora_dev_t *dev, int sf)
 {
    if (sf < 6) sf = 6;
    else if (sf > 12) sf = 12;
 
-   lock();
+   spi_msg_t m;
+   lock_idle(dev);
+   lora_begin(dev, &m);
    if (sf == 6) {
-      lora_write_reg(REG_DETECTION_OPTIMIZE, 0xc5);
-      lora_write_reg(REG_DETECTION_THRESHOLD, 0x0c);
+      lora_queue_write(dev, &m, REG_DETECTION_OPTIMIZE, 0xc5);
+      lora_queue_write(dev, &m, REG_DETECTION_THRESHOLD, 0x0c);
    } else {
-      lora_write_reg(REG_DETECTION_OPTIMIZE, 0xc3);
-      lora_write_reg(REG_DETECTION_THRESHOLD, 0x0a);
+      lora_queue_write(dev, &m, REG_DETECTION_OPTIMIZE, 0xc3);
+      lora_queue_write(dev, &m, REG_DETECTION_THRESHOLD, 0x0a);
    }
+   lora_queue_write(dev, &m, REG_MODEM_CONFIG_2, (lora_read_reg(dev, REG_MODEM_CONFIG_2) & 0x0f) | ((sf << 4) & 0xf0));
+   lora_commit(dev, &m);
+   unlock(dev);
+}
+
+/*
+ * Signal bandwidths (Hz) for each value of the Bw field in REG_MODEM_CONFIG_1.
+ */
+static const long __bandwidths[10] = {
+   7800, 10400, 15600, 20800, 31250, 41700, 62500, 125000, 250000, 500000
+};
 
-   lora_write_reg(REG_MODEM_CONFIG_2, (lora_read_reg(REG_MODEM_CONFIG_2) & 0x0f) | ((sf << 4) & 0xf0));
-   unlock();
+/**
+ * Find the register code for a bandwidth.
+ * @param sbw Bandwidth in Hz.
+ * @return 0-9, smallest bandwidth not below sbw.
+ */
+static int
+lora_bw_code(long sbw)
+{
+   int bw;
+   for(bw=0; bw<9; bw++)
+      if(sbw <= __bandwidths[bw]) break;
+   return bw;
 }
 
 /**
  * Set bandwidth (bit rate)
+ * @param dev Radio handle.
  * @param sbw Bandwidth in Hz (up to 500000)
  */
 void 
-lora_set_bandwidth(long sbw)
+lora_set_bandwidth(lora_dev_t *dev, long sbw)
 {
-   int bw;
-
-   if (sbw <= 7.8E3) bw = 0;
-   else if (sbw <= 10.4E3) bw = 1;
-   else if (sbw <= 15.6E3) bw = 2;
-   else if (sbw <= 20.8E3) bw = 3;
-   else if (sbw <= 31.25E3) bw = 4;
-   else if (sbw <= 41.7E3) bw = 5;
-   else if (sbw <= 62.5E3) bw = 6;
-   else if (sbw <= 125E3) bw = 7;
-   else if (sbw <= 250E3) bw = 8;
-   else bw = 9;
-   lock();
-   lora_write_reg(REG_MODEM_CONFIG_1, (lora_read_reg(REG_MODEM_CONFIG_1) & 0x0f) | (bw << 4));
-   unlock();
+   int bw = lora_bw_code(sbw);
+   lock_idle(dev);
+   lora_write_reg(dev, REG_MODEM_CONFIG_1, (lora_read_reg(dev, REG_MODEM_CONFIG_1) & 0x0f) | (bw << 4));
+   unlock(dev);
 }
 
 /**
@@ -321,294 +946,1810 @@ lora_set_bandwidth(long sbw)
  * @param denominator 5-8, Denominator for the coding rate 4/x
  */ 
 void 
-lora_set_coding_rate(int denominator)
+lora_set_coding_rate(lora_dev_t *dev, int denominator)
 {
    if (denominator < 5) denominator = 5;
    else if (denominator > 8) denominator = 8;
 
    int cr = denominator - 4;
-   lock();
-   lora_write_reg(REG_MODEM_CONFIG_1, (lora_read_reg(REG_MODEM_CONFIG_1) & 0xf1) | (cr << 1));
-   unlock();
+   lock_idle(dev);
+   lora_write_reg(dev, REG_MODEM_CONFIG_1, (lora_read_reg(dev, REG_MODEM_CONFIG_1) & 0xf1) | (cr << 1));
+   unlock(dev);
 }
 
 /**
  * Set the size of preamble.
+ * @param dev Radio handle.
  * @param length Preamble length in symbols.
  */
 void 
-lora_set_preamble_length(long length)
+lora_set_preamble_length(lora_dev_t *dev, long length)
 {
-   lock();
-   lora_write_reg(REG_PREAMBLE_MSB, (uint8_t)(length >> 8));
-   lora_write_reg(REG_PREAMBLE_LSB, (uint8_t)(length >> 0));
-   unlock();
+   spi_msg_t m;
+   lock_idle(dev);
+   lora_begin(dev, &m);
+   lora_queue_write(dev, &m, REG_PREAMBLE_MSB, (uint8_t)(length >> 8));
+   lora_queue_write(dev, &m, REG_PREAMBLE_LSB, (uint8_t)(length >> 0));
+   lora_commit(dev, &m);
+   unlock(dev);
 }
 
 /**
  * Change radio sync word.
+ * @param dev Radio handle.
  * @param sw New sync word to use.
  */
 void 
-lora_set_sync_word(int sw)
+lora_set_sync_word(lora_dev_t *dev, int sw)
 {
-   lock();
-   lora_write_reg(REG_SYNC_WORD, sw);
-   unlock();
+   lock_idle(dev);
+   lora_write_reg(dev, REG_SYNC_WORD, sw);
+   unlock(dev);
 }
 
 /**
  * Enable appending/verifying packet CRC.
  */
 void 
-lora_enable_crc(void)
+lora_enable_crc(lora_dev_t *dev)
 {
-   lock();
-   lora_write_reg(REG_MODEM_CONFIG_2, lora_read_reg(REG_MODEM_CONFIG_2) | 0x04);
-   unlock();
+   lock_idle(dev);
+   lora_write_reg(dev, REG_MODEM_CONFIG_2, lora_read_reg(dev, REG_MODEM_CONFIG_2) | 0x04);
+   unlock(dev);
 }
 
 /**
  * Disable appending/verifying packet CRC.
  */
 void 
-lora_disable_crc(void)
+lora_disable_crc(lora_dev_t *dev)
 {
-   lock();
-   lora_write_reg(REG_MODEM_CONFIG_2, lora_read_reg(REG_MODEM_CONFIG_2) & 0xfb);
-   unlock();
+   lock_idle(dev);
+   lora_write_reg(dev, REG_MODEM_CONFIG_2, lora_read_reg(dev, REG_MODEM_CONFIG_2) & 0xfb);
+   unlock(dev);
 }
 
 /**
- * Perform hardware initialization.
+ * Read the current radio configuration.
+ * Must be called with the lock held.
  */
-int 
-lora_init(void)
+static void
+lora_read_config(lora_dev_t *dev, lora_config_t *cfg)
 {
-   /*
-    * Configure CPU hardware to communicate with the radio chip
-    */
-   __spi = spi_init(__spi_device_name);
-   if(__spi < 0) return __spi;
-
-   __cs = gpio_open(__cs_pin_number, 1);
-   if(__cs < 0) {
-      close(__spi);
-      return __cs;
+   int mc1 = lora_read_reg(dev, REG_MODEM_CONFIG_1);
+   int mc2 = lora_read_reg(dev, REG_MODEM_CONFIG_2);
+   int bw = mc1 >> 4;
+
+   cfg->frequency = dev->frequency;
+   if(cfg->frequency == 0) {
+      uint64_t frf = ((uint32_t)lora_read_reg(dev, REG_FRF_MSB) << 16)
+         | ((uint32_t)lora_read_reg(dev, REG_FRF_MID) << 8)
+         | lora_read_reg(dev, REG_FRF_LSB);
+      cfg->frequency = (frf * 32000000) >> 19;
    }
+   cfg->spreading_factor = mc2 >> 4;
+   cfg->bandwidth = __bandwidths[bw > 9 ? 9 : bw];
+   cfg->coding_rate = ((mc1 >> 1) & 0x07) + 4;
+   cfg->preamble_length = (lora_read_reg(dev, REG_PREAMBLE_MSB) << 8) | lora_read_reg(dev, REG_PREAMBLE_LSB);
+   cfg->sync_word = lora_read_reg(dev, REG_SYNC_WORD);
+   cfg->crc = (mc2 & 0x04) ? 1 : 0;
+   cfg->tx_power = (lora_read_reg(dev, REG_PA_CONFIG) & 0x0f) + 2;
+   cfg->implicit_size = (mc1 & 0x01) ? lora_read_reg(dev, REG_PAYLOAD_LENGTH) : 0;
+}
 
-   __rst = gpio_open(__rst_pin_number, 1);
-   if(__rst < 0) {
-      close(__spi);
-      close(__cs);
-      return __rst;
-   }
-
-   __irq = gpio_open(__irq_pin_number, 0);
-   if(__irq < 0) {
-      close(__spi);
-      close(__cs);
-      close(__rst);
-      return __irq;
-   }
-
-   /*
-    * Init mutex and callback
-    */
-   __callback = NULL;
-   pthread_mutex_init(&__mutex, NULL);
-
-   /*
-    * Perform hardware reset.
-    */
-   lora_reset();
+/**
+ * Read the current radio configuration.
+ * @param dev Radio handle.
+ * @param cfg Structure to fill.
+ */
+void
+lora_get_config(lora_dev_t *dev, lora_config_t *cfg)
+{
+   lock(dev);
+   lora_read_config(dev, cfg);
+   unlock(dev);
+}
 
-   /*
-    * Check version.
-    */
-   uint8_t version = lora_read_reg(REG_VERSION);
-   assert(version == 0x12);
+/**
+ * Apply a complete radio configuration at once.
+ * The register image is compared with the current state and only the
+ * registers that change are written, using burst writes over the
+ * contiguous ranges, in a single transaction.
+ * @param dev Radio handle.
+ * @param cfg New configuration (values are limited as in the individual setters).
+ */
+void
+lora_apply_config(lora_dev_t *dev, lora_config_t *cfg)
+{
+   uint8_t rf[4], modem[6];
+   int sf = cfg->spreading_factor;
+   int cr = cfg->coding_rate;
+   int level = cfg->tx_power;
+   spi_msg_t m;
 
-   /*
-    * Default configuration.
-    */
-   lora_sleep();
- 
-   lock();
-   lora_write_reg(REG_FIFO_RX_BASE_ADDR, 0);
-   lora_write_reg(REG_FIFO_TX_BASE_ADDR, 0);
-   lora_write_reg(REG_LNA, lora_read_reg(REG_LNA) | 0x03);
-   lora_write_reg(REG_MODEM_CONFIG_3, 0x04);
-   unlock();
- 
-   lora_set_tx_power(17);
+   if (sf < 6) sf = 6;
+   else if (sf > 12) sf = 12;
+   if (cr < 5) cr = 5;
+   else if (cr > 8) cr = 8;
+   if (level < 2) level = 2;
+   else if (level > 17) level = 17;
 
-   lora_idle();
-   return 1;
+   uint32_t frf = lora_frf(cfg->frequency);
+   rf[0] = (uint8_t)(frf >> 16);
+   rf[1] = (uint8_t)(frf >> 8);
+   rf[2] = (uint8_t)(frf >> 0);
+   rf[3] = PA_BOOST | (level - 2);
+
+   lock_idle(dev);
+   modem[0] = (lora_bw_code(cfg->bandwidth) << 4) | ((cr - 4) << 1) | (cfg->implicit_size > 0 ? 0x01 : 0x00);
+   modem[1] = (sf << 4) | (cfg->crc ? 0x04 : 0x00) | (lora_read_reg(dev, REG_MODEM_CONFIG_2) & 0x0b);
+   modem[2] = lora_read_reg(dev, REG_SYMB_TIMEOUT_LSB);
+   modem[3] = (uint8_t)(cfg->preamble_length >> 8);
+   modem[4] = (uint8_t)(cfg->preamble_length >> 0);
+   modem[5] = cfg->implicit_size > 0 ? cfg->implicit_size : lora_read_reg(dev, REG_PAYLOAD_LENGTH);
+
+   lora_begin(dev, &m);
+   lora_queue_burst(dev, &m, REG_FRF_MSB, rf, sizeof(rf));
+   lora_queue_burst(dev, &m, REG_MODEM_CONFIG_1, modem, sizeof(modem));
+   lora_queue_write(dev, &m, REG_DETECTION_OPTIMIZE, sf == 6 ? 0xc5 : 0xc3);
+   lora_queue_write(dev, &m, REG_DETECTION_THRESHOLD, sf == 6 ? 0x0c : 0x0a);
+   lora_queue_write(dev, &m, REG_SYNC_WORD, cfg->sync_word);
+   lora_commit(dev, &m);
+
+   dev->frequency = cfg->frequency;
+   dev->channel_cur = -1;
+   dev->implicit = cfg->implicit_size > 0;
+   unlock(dev);
 }
 
 /**
- * Send a packet.
- * @param buf Data to be sent
- * @param size Size of data.
+ * Compute the time on air of a packet (SX1276 datasheet, section 4.1.1.7).
+ * @param cfg Modem configuration.
+ * @param de Non-zero if the low data rate optimization is enabled.
+ * @param size Payload size in bytes.
+ * @return Time on air in microseconds.
  */
-void 
-lora_send_packet(uint8_t *buf, int size)
+static long
+lora_calc_airtime(lora_config_t *cfg, int de, int size)
 {
-   int i;
+   int bw = lora_bw_code(cfg->bandwidth);
+   int sf = cfg->spreading_factor;
+   int cr = cfg->coding_rate - 4;
+   int ih = cfg->implicit_size > 0;
+   int crc = cfg->crc ? 1 : 0;
 
-   /*
-    * Transfer data to radio.
-    */
-   lock();
-   lora_write_reg(REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_STDBY);
-   lora_write_reg(REG_FIFO_ADDR_PTR, 0);
+   if(sf < 6) sf = 6;
+   else if(sf > 12) sf = 12;
+   if(cr < 1) cr = 1;
+   else if(cr > 4) cr = 4;
 
-   for(i=0; i<size; i++) 
-      lora_write_reg(REG_FIFO, *buf++);
-   
-   lora_write_reg(REG_PAYLOAD_LENGTH, size);
-   
    /*
-    * Start transmission and wait for conclusion.
+    * Symbol time in ns, symbols in quarters to keep the preamble's 4.25.
     */
-   lora_write_reg(REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_TX);
-   while((lora_read_reg(REG_IRQ_FLAGS) & IRQ_TX_DONE_MASK) == 0)
-      usleep(100);
-
-   lora_write_reg(REG_IRQ_FLAGS, IRQ_TX_DONE_MASK);
-   unlock();
+   int64_t tsym = ((int64_t)1000000000 << sf) / __bandwidths[bw];
+   int64_t num = 8 * size - 4 * sf + 28 + 16 * crc - 20 * ih;
+   int64_t den = 4 * (sf - 2 * de);
+   int64_t nsym = 0;
+   if(num > 0) nsym = ((num + den - 1) / den) * (cr + 4);
+   nsym = 4 * (cfg->preamble_length + 8 + nsym) + 17;
+
+   return (long)((nsym * tsym / 4 + 999) / 1000);
 }
 
 /**
- * Read a received packet.
+ * Compute the time on air of a packet with the current modem configuration.
+ * Must be called with the lock held.
+ * @param dev Radio handle.
+ * @param size Payload size in bytes.
+ * @return Time on air in microseconds.
+ */
+static long
+lora_airtime_us(lora_dev_t *dev, int size)
+{
+   lora_config_t cfg;
+   lora_read_config(dev, &cfg);
+   return lora_calc_airtime(&cfg, (lora_read_reg(dev, REG_MODEM_CONFIG_3) >> 3) & 0x01, size);
+}
+
+/**
+ * Compute the time on air of a packet with any configuration, with the low
+ * data rate optimization disabled (as set by lora_init()).
+ * @param cfg Modem configuration.
+ * @param size Payload size in bytes.
+ * @return Time on air in microseconds.
+ */
+long
+lora_config_airtime(lora_config_t *cfg, int size)
+{
+   return lora_calc_airtime(cfg, 0, size);
+}
+
+/**
+ * Compute the time on air of a packet with the current modem configuration
+ * (spreading factor, bandwidth, coding rate, preamble, header mode, CRC and
+ * low data rate optimization).
+ * @param dev Radio handle.
+ * @param size Payload size in bytes.
+ * @return Time on air in microseconds.
+ */
+long
+lora_time_on_air(lora_dev_t *dev, int size)
+{
+   lock(dev);
+   long res = lora_airtime_us(dev, size);
+   unlock(dev);
+   return res;
+}
+
+/**
+ * Limit transmissions to the duty cycle of a regional plan.
+ * Each frame is then sent at the earliest instant that keeps its sub-band
+ * within the budget, over a sliding window of one hour.
+ * @param dev Radio handle.
+ * @param region Region name ("EU868"), or NULL to remove every limit.
+ * @return 1 if successful, 0 if the region is unknown or out of memory.
+ */
+int
+lora_set_duty_cycle(lora_dev_t *dev, char *region)
+{
+   int res = 1;
+   lock(dev);
+   if(region == NULL) {
+      dc_destroy(dev->dc);
+      dev->dc = NULL;
+   } else {
+      if(dev->dc == NULL) dev->dc = dc_create();
+      res = (dev->dc != NULL) && dc_load_region(dev->dc, region);
+   }
+   unlock(dev);
+   return res;
+}
+
+/**
+ * Add a sub-band with its own duty cycle limit.
+ * @param dev Radio handle.
+ * @param low Lowest frequency of the sub-band (Hz).
+ * @param high Frequency just above the sub-band (Hz).
+ * @param duty Fraction of the time the sub-band may be used (0.01 = 1%).
+ * @return 1 if successful, 0 if error.
+ */
+int
+lora_add_subband(lora_dev_t *dev, long low, long high, float duty)
+{
+   int res = 0;
+   lock(dev);
+   if(dev->dc == NULL) dev->dc = dc_create();
+   if(dev->dc != NULL) res = dc_add_band(dev->dc, low, high, duty);
+   unlock(dev);
+   return res;
+}
+
+/**
+ * Time a packet would have to wait for the duty cycle, if sent now.
+ * Must be called with the lock held.
+ * @return Delay in us, or DC_NEVER.
+ */
+static uint64_t
+lora_dc_delay(lora_dev_t *dev, long airtime)
+{
+   if(dev->dc == NULL) return 0;
+   return dc_delay(dev->dc, dev->frequency, lora_now_us(), airtime);
+}
+
+/**
+ * Time a packet would have to wait for the duty cycle, if sent now.
+ * @param dev Radio handle.
+ * @param size Payload size in bytes.
+ * @return Delay in microseconds, or negative if the packet can never be sent
+ * in the current sub-band (its time on air exceeds the budget).
+ */
+long
+lora_tx_delay(lora_dev_t *dev, int size)
+{
+   lock(dev);
+   uint64_t d = lora_dc_delay(dev, lora_airtime_us(dev, size));
+   unlock(dev);
+   if(d == DC_NEVER) return -1;
+   return (long)d;
+}
+
+/**
+ * Adaptive data rate engine of a radio.
+ * Must be called with the lock held.
+ * @return Engine, or NULL if out of memory.
+ */
+static adr_t *
+lora_adr(lora_dev_t *dev)
+{
+   if(dev->adr == NULL) dev->adr = adr_create();
+   return dev->adr;
+}
+
+/**
+ * Add a packet to the link history of a peer, for the adaptive data rate.
+ * The current configuration is taken as the one the packet was sent with.
+ * @param dev Radio handle.
+ * @param peer Application address of the peer.
+ * @param snr SNR of the packet at the receiver (dB), as reported by the peer
+ * or, for symmetric links, measured here (lora_packet_snr()).
+ * @param delivered Zero if the packet was lost (not acknowledged).
+ * @return 1 if successful, 0 if out of memory.
+ */
+int
+lora_adr_report(lora_dev_t *dev, int peer, float snr, int delivered)
+{
+   lora_config_t cfg;
+   int res = 0;
+   lock(dev);
+   if(lora_adr(dev) != NULL) {
+      lora_read_config(dev, &cfg);
+      adr_report(dev->adr, peer, &cfg, snr, delivered);
+      res = 1;
+   }
+   unlock(dev);
+   return res;
+}
+
+/**
+ * Discard the link history of a peer.
+ */
+void
+lora_adr_forget(lora_dev_t *dev, int peer)
+{
+   lock(dev);
+   if(dev->adr != NULL) adr_forget(dev->adr, peer);
+   unlock(dev);
+}
+
+/**
+ * Set the delivery goal of the adaptive data rate.
+ * @param dev Radio handle.
+ * @param delivery Probability of delivery to aim at (0-1, default 0.9).
+ * @param margin Extra SNR above the demodulation floor (dB, default 3).
+ * @return 1 if successful, 0 if out of memory.
+ */
+int
+lora_adr_set_target(lora_dev_t *dev, float delivery, float margin)
+{
+   int res = 0;
+   lock(dev);
+   if(lora_adr(dev) != NULL) {
+      adr_set_target(dev->adr, delivery, margin);
+      res = 1;
+   }
+   unlock(dev);
+   return res;
+}
+
+/**
+ * Limit the configurations the adaptive data rate may choose
+ * (default SF7-12, 125 kHz, 2-17 dBm).
+ * @return 1 if successful, 0 if out of memory.
+ */
+int
+lora_adr_set_range(lora_dev_t *dev, int min_sf, int max_sf, long min_bw, long max_bw, int min_power, int max_power)
+{
+   int res = 0;
+   lock(dev);
+   if(lora_adr(dev) != NULL) {
+      adr_set_range(dev->adr, min_sf, max_sf, min_bw, max_bw, min_power, max_power);
+      res = 1;
+   }
+   unlock(dev);
+   return res;
+}
+
+/**
+ * Recommend the fastest spreading factor, bandwidth and power that keeps the
+ * target delivery probability to a peer, from its link history.
+ * @param dev Radio handle.
+ * @param peer Application address of the peer.
+ * @param cfg Filled with the current configuration, changed as recommended.
+ * @return 1 if successful, 0 if there is not enough history for the peer.
+ */
+int
+lora_adr_recommend(lora_dev_t *dev, int peer, lora_config_t *cfg)
+{
+   int res = 0;
+   lock(dev);
+   lora_read_config(dev, cfg);
+   if(dev->adr != NULL) res = adr_recommend(dev->adr, peer, cfg);
+   unlock(dev);
+   return res;
+}
+
+/**
+ * Apply the configuration recommended for a peer (see lora_adr_recommend()).
+ * Only the registers that change are written.
+ * @return 1 if applied, 0 if there is not enough history for the peer.
+ */
+int
+lora_adr_apply(lora_dev_t *dev, int peer)
+{
+   lora_config_t cfg;
+   if(!lora_adr_recommend(dev, peer, &cfg)) return 0;
+   lora_apply_config(dev, &cfg);
+   return 1;
+}
+
+/**
+ * Define the channel plan. Register values are computed once here, and each
+ * packet is then sent on the channel chosen by lora_send_packet(): the first,
+ * in round robin order, that can transmit without waiting for the duty cycle,
+ * preferring the channels with less airtime used.
+ * @param dev Radio handle.
+ * @param list Channels. Spreading factor and bandwidth may be zero for the ones
+ * configured when the plan is set.
+ * @param count Number of channels (up to LORA_MAX_CHANNELS), 0 to send on the current frequency.
+ * @return 1 if successful, 0 if a channel is invalid.
+ */
+int
+lora_set_channels(lora_dev_t *dev, lora_channel_t *list, int count)
+{
+   int i;
+   lora_config_t cfg;
+
+   if((count < 0) || (count > LORA_MAX_CHANNELS)) return 0;
+   for(i=0; i<count; i++) {
+      lora_channel_t *ch = &list[i];
+      if((ch->frequency <= 0) || (ch->bandwidth < 0)) return 0;
+      if(ch->spreading_factor && ((ch->spreading_factor < 6) || (ch->spreading_factor > 12))) return 0;
+   }
+
+   lock_idle(dev);
+   lora_read_config(dev, &cfg);
+   for(i=0; i<count; i++) {
+      channel_t *c = &dev->channels[i];
+      uint32_t frf = lora_frf(list[i].frequency);
+      c->ch = list[i];
+      if(c->ch.spreading_factor == 0) c->ch.spreading_factor = cfg.spreading_factor;
+      if(c->ch.bandwidth == 0) c->ch.bandwidth = cfg.bandwidth;
+      c->frf[0] = (uint8_t)(frf >> 16);
+      c->frf[1] = (uint8_t)(frf >> 8);
+      c->frf[2] = (uint8_t)(frf >> 0);
+      c->bw = lora_bw_code(c->ch.bandwidth);
+      c->airtime = 0;
+   }
+   dev->channel_count = count;
+   dev->channel_cur = -1;
+   dev->channel_home = -1;
+   dev->channel_next = 0;
+   unlock(dev);
+   return 1;
+}
+
+/**
+ * Queue the register writes that tune the radio to a channel of the plan.
+ * Must be called with the lock held, with the radio in standby or sleep.
+ */
+static void
+lora_queue_channel(lora_dev_t *dev, spi_msg_t *m, int i)
+{
+   channel_t *c = &dev->channels[i];
+   int sf = c->ch.spreading_factor;
+   uint8_t modem[2];
+
+   lora_queue_burst(dev, m, REG_FRF_MSB, c->frf, sizeof(c->frf));
+   modem[0] = (lora_read_reg(dev, REG_MODEM_CONFIG_1) & 0x0f) | (c->bw << 4);
+   modem[1] = (lora_read_reg(dev, REG_MODEM_CONFIG_2) & 0x0f) | (sf << 4);
+   lora_queue_burst(dev, m, REG_MODEM_CONFIG_1, modem, sizeof(modem));
+   lora_queue_write(dev, m, REG_DETECTION_OPTIMIZE, sf == 6 ? 0xc5 : 0xc3);
+   lora_queue_write(dev, m, REG_DETECTION_THRESHOLD, sf == 6 ? 0x0c : 0x0a);
+
+   dev->frequency = c->ch.frequency;
+   dev->channel_cur = i;
+}
+
+/**
+ * Tune the radio to a channel of the plan, in a single transaction.
+ * Reception happens on this channel, and the radio returns to it after
+ * each transmission.
+ * @param dev Radio handle.
+ * @param index Channel index in the plan.
+ * @return 1 if successful, 0 if there is no such channel.
+ */
+int
+lora_select_channel(lora_dev_t *dev, int index)
+{
+   spi_msg_t m;
+   lock_idle(dev);
+   if((index < 0) || (index >= dev->channel_count)) {
+      unlock(dev);
+      return 0;
+   }
+   int mode = lora_read_reg(dev, REG_OP_MODE);
+   lora_begin(dev, &m);
+   if((mode & 0x07) > MODE_STDBY) lora_queue_write(dev, &m, REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_STDBY);
+   lora_queue_channel(dev, &m, index);
+   if((mode & 0x07) > MODE_STDBY) lora_queue_write(dev, &m, REG_OP_MODE, mode);
+   lora_commit(dev, &m);
+   dev->channel_home = index;
+   unlock(dev);
+   return 1;
+}
+
+/**
+ * Channel the radio is tuned to.
+ * @return Index in the plan, or -1 if out of the plan.
+ */
+int
+lora_current_channel(lora_dev_t *dev)
+{
+   return dev->channel_cur;
+}
+
+/**
+ * Read a channel of the plan.
+ * @param dev Radio handle.
+ * @param index Channel index.
+ * @param ch Filled with the channel definition (may be NULL).
+ * @param airtime Filled with the time transmitted on the channel, us (may be NULL).
+ * @return 1 if successful, 0 if there is no such channel.
+ */
+int
+lora_get_channel(lora_dev_t *dev, int index, lora_channel_t *ch, uint64_t *airtime)
+{
+   int res = 0;
+   lock(dev);
+   if((index >= 0) && (index < dev->channel_count)) {
+      if(ch != NULL) *ch = dev->channels[index].ch;
+      if(airtime != NULL) *airtime = dev->channels[index].airtime;
+      res = 1;
+   }
+   unlock(dev);
+   return res;
+}
+
+/**
+ * Choose the channel for the next packet: the shortest wait for the duty
+ * cycle, then the least airtime used, then the round robin order.
+ * Must be called with the lock held.
+ * @param dev Radio handle.
+ * @param size Payload size in bytes.
+ * @param airtime Filled with the time on air on the chosen channel (us).
+ * @param delay Filled with the wait for the duty cycle (us, DC_NEVER if never).
+ * @return Channel index.
+ */
+static int
+lora_hop(lora_dev_t *dev, int size, long *airtime, uint64_t *delay)
+{
+   lora_config_t base, cfg;
+   int i, k, best = -1;
+   int de = (lora_read_reg(dev, REG_MODEM_CONFIG_3) >> 3) & 0x01;
+   uint64_t now = lora_now_us();
+
+   *airtime = 0;
+   *delay = DC_NEVER;
+   lora_read_config(dev, &base);
+   for(k=0; k<dev->channel_count; k++) {
+      i = (dev->channel_next + k) % dev->channel_count;
+      channel_t *c = &dev->channels[i];
+      cfg = base;
+      cfg.spreading_factor = c->ch.spreading_factor;
+      cfg.bandwidth = c->ch.bandwidth;
+
+      long t = lora_calc_airtime(&cfg, de, size);
+      uint64_t d = dev->dc != NULL ? dc_delay(dev->dc, c->ch.frequency, now, t) : 0;
+      if((best < 0) || (d < *delay) || ((d == *delay) && (c->airtime < dev->channels[best].airtime))) {
+         best = i;
+         *airtime = t;
+         *delay = d;
+      }
+   }
+   return best;
+}
+
+/**
+ * Compress the payloads against a shared dictionary.
+ * Frames are sent compressed when that makes them shorter, marked by their
+ * first byte; other frames are sent as they are, so radios with and without
+ * compression can share the channel (payloads starting with 0xfc or 0xfd
+ * take one more byte).
+ * @param dev Radio handle.
+ * @param dict Dictionary, the same at both ends (NULL to disable compression).
+ * @param size Dictionary size (up to LZ_MAX_DICT bytes).
+ * @return 1 if successful, 0 if the dictionary is too large or out of memory.
+ */
+int
+lora_set_compression(lora_dev_t *dev, uint8_t *dict, int size)
+{
+   lz_t *lz = NULL;
+   if((dict != NULL) && ((lz = lz_create(dict, size)) == NULL)) return 0;
+
+   lock(dev);
+   lz_t *old = dev->lz;
+   dev->lz = lz;
+   unlock(dev);
+   lz_destroy(old);
+   return 1;
+}
+
+/**
+ * Select how the end of a transmission is detected.
+ * @param dev Radio handle.
+ * @param mode LORA_TX_WAIT_IRQ to block on the TxDone interrupt (DIO0),
+ * LORA_TX_WAIT_TIMED to sleep for the time on air and poll only near the end
+ * (for boards without the interrupt pin).
+ */
+void
+lora_set_tx_wait(lora_dev_t *dev, int mode)
+{
+   dev->tx_wait = mode;
+}
+
+/**
+ * Enable or disable transceive mode.
+ * The radio listens (continuous receive mode) whenever it is not
+ * transmitting: it returns to reception in the same SPI transaction that
+ * acknowledges TxDone, so replies sent right after a packet are not missed,
+ * with or without background reception. The FIFO is split so transmitted
+ * packets do not overwrite a received one not read yet (received packets
+ * from 0x00, transmitted ones from 0x80; packets over 128 bytes still overlap).
+ * @param dev Radio handle.
+ * @param enable Non-zero to enable.
+ */
+void
+lora_set_transceive(lora_dev_t *dev, int enable)
+{
+   spi_msg_t m;
+   lock_idle(dev);
+   dev->transceive = enable ? 1 : 0;
+   lora_begin(dev, &m);
+   lora_queue_write(dev, &m, REG_FIFO_RX_BASE_ADDR, 0);
+   lora_queue_write(dev, &m, REG_FIFO_TX_BASE_ADDR, enable ? TRX_TX_BASE : 0);
+   if(enable) {
+      lora_queue_write(dev, &m, REG_IRQ_FLAGS_MASK, IRQ_MASK_DEFAULT);
+      lora_queue_write(dev, &m, REG_DIO_MAPPING_1, DIO0_RX_DONE);
+      lora_queue_write(dev, &m, REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_RX_CONTINUOUS);
+   }
+   lora_commit(dev, &m);
+   unlock(dev);
+}
+
+/**
+ * Wait for the interrupt ending a transmission or a channel activity
+ * detection just started. Meanwhile the radio is marked busy and the lock
+ * is released: the radio can be read, but lora_lock_idle() waits. With
+ * background reception, the reception thread owns DIO0 and reports the
+ * flags (see lora_rx_service()), so no other thread waits on the line.
+ * Must be called with the lock held (released while waiting).
+ * @param dev Radio handle.
+ * @param mask Interrupt flags ending the operation.
+ * @param duration Expected duration in microseconds.
+ * @param stamp Receives the time of the interrupt (us, 0 if unknown).
+ * @return Interrupt flags, 0 if none in mask came within the duration
+ * plus a margin.
+ */
+static int
+lora_wait_irq(lora_dev_t *dev, int mask, long duration, uint64_t *stamp)
+{
+   struct timespec ts;
+   uint64_t end = lora_now_us() + duration + TX_IRQ_MARGIN_MS * 1000;
+   int irq = 0;
+
+   *stamp = 0;
+   dev->busy = 1;
+   dev->busy_seq++;
+   dev->busy_irq = 0;
+   if(dev->rx_running) {
+      ts.tv_sec = end / 1000000;
+      ts.tv_nsec = (end % 1000000) * 1000;
+      while(!(dev->busy_irq & mask) && (pthread_cond_timedwait(&dev->idle_cond, &dev->mutex, &ts) != ETIMEDOUT));
+      irq = dev->busy_irq;
+      *stamp = dev->busy_stamp;
+   } else {
+      unlock(dev);
+      if((dev->tx_wait == LORA_TX_WAIT_IRQ) && (dev->irq >= 0)) {
+         gpio_wait_stamp(dev->irq_pin_number, dev->irq, 1, duration / 1000 + TX_IRQ_MARGIN_MS, stamp);
+      } else if(duration > TX_POLL_WINDOW_US) {
+         usleep(duration - TX_POLL_WINDOW_US);
+      }
+      lock(dev);
+   }
+
+   /*
+    * The interrupt flags are the final word (the edge may have been missed).
+    */
+   while(!(irq & mask)) {
+      irq = lora_read_reg(dev, REG_IRQ_FLAGS);
+      if((irq & mask) || (lora_now_us() >= end)) break;
+      unlock(dev);
+      usleep(100);
+      lock(dev);
+   }
+
+   dev->busy = 0;
+   pthread_cond_broadcast(&dev->idle_cond);
+   return (irq & mask) ? irq : 0;
+}
+
+/**
+ * Wait for the end of the current transmission.
+ * Must be called with the lock held (released while waiting).
+ * @param dev Radio handle.
+ * @param airtime Expected time on air in microseconds.
+ * @return 1 if the transmission ended, 0 if TxDone did not come within
+ * the time on air plus a margin.
+ */
+static int
+lora_wait_tx_done(lora_dev_t *dev, long airtime)
+{
+   uint64_t stamp;
+   if(!lora_wait_irq(dev, IRQ_TX_DONE_MASK, airtime, &stamp)) return 0;
+   dev->tx_timestamp = stamp ? stamp : lora_now_us();
+   return 1;
+}
+
+/**
+ * Configure listen-before-talk: before each transmission, a channel
+ * activity detection (CAD) checks for LoRa preambles on the channel; while
+ * it is busy, the transmission is put off for a random backoff, doubling
+ * the range after each detection.
+ * @param dev Radio handle.
+ * @param attempts Detections before the packet is given up (0 disables listen-before-talk).
+ * @param slot Backoff unit in ms, 0 for the time on air of the packet.
+ */
+void
+lora_set_lbt(lora_dev_t *dev, int attempts, int slot)
+{
+   lock(dev);
+   dev->lbt_attempts = attempts > 0 ? attempts : 0;
+   dev->lbt_slot = slot > 0 ? slot * 1000L : 0;
+   unlock(dev);
+}
+
+/**
+ * Run a channel activity detection on the channel of the next transmission.
+ * If the channel is busy, the radio goes back to reception (with background
+ * reception or in transceive mode), as the activity may be for us.
+ * Must be called with the lock held (released while waiting).
+ * @param dev Radio handle.
+ * @param ch Channel of the plan to check, -1 for the current frequency.
+ * @return Non-zero if activity was detected, or if CadDone did not come
+ * within the detection time plus a margin (the detection is then aborted).
+ */
+static int
+lora_cad(lora_dev_t *dev, int ch)
+{
+   spi_msg_t m;
+   lora_config_t cfg;
+   lora_read_config(dev, &cfg);
+   if(ch >= 0) {
+      cfg.spreading_factor = dev->channels[ch].ch.spreading_factor;
+      cfg.bandwidth = dev->channels[ch].ch.bandwidth;
+   }
+   long duration = 2 * (((1L << cfg.spreading_factor) * 1000000L) / cfg.bandwidth);
+
+   lora_begin(dev, &m);
+   lora_queue_write(dev, &m, REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_STDBY);
+   if(ch >= 0) lora_queue_channel(dev, &m, ch);
+   lora_queue_write(dev, &m, REG_IRQ_FLAGS_MASK, IRQ_MASK_CAD);
+   lora_queue_write(dev, &m, REG_DIO_MAPPING_1, DIO0_CAD_DONE);
+   lora_queue_write(dev, &m, REG_IRQ_FLAGS, IRQ_CAD_MASK);
+   lora_queue_write(dev, &m, REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_CAD);
+   lora_commit(dev, &m);
+
+   uint64_t stamp;
+   int irq = lora_wait_irq(dev, IRQ_CAD_DONE_MASK, duration, &stamp);
+   int timeout = (irq == 0);
+   int busy = timeout || (irq & IRQ_CAD_DETECTED_MASK);
+
+   lora_begin(dev, &m);
+   if(timeout) lora_queue_write(dev, &m, REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_STDBY);
+   lora_queue_write(dev, &m, REG_IRQ_FLAGS, IRQ_CAD_MASK);
+   lora_queue_write(dev, &m, REG_IRQ_FLAGS_MASK, IRQ_MASK_DEFAULT);
+   if(busy && (dev->rx_running || dev->transceive)) {
+      if((ch >= 0) && (dev->channel_home >= 0)) lora_queue_channel(dev, &m, dev->channel_home);
+      lora_queue_write(dev, &m, REG_DIO_MAPPING_1, DIO0_RX_DONE);
+      lora_queue_write(dev, &m, REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_RX_CONTINUOUS);
+   }
+   lora_commit(dev, &m);
+   if(busy) stat_add(dev, cad_busy, 1);
+   return busy;
+}
+
+/**
+ * Perform hardware initialization.
+ */
+int 
+lora_init(lora_dev_t *dev)
+{
+   /*
+    * Configure CPU hardware to communicate with the radio chip
+    */
+   dev->spi = spi_open(dev->spi_device_name, dev->hw_cs);
+   if(dev->spi < 0) return dev->spi;
+
+   if(!dev->hw_cs) {
+      dev->cs = gpio_open_chip(dev->gpio_chip, dev->cs_pin_number, 1);
+      if(dev->cs < 0) {
+         spi_close(dev->spi);
+         return dev->cs;
+      }
+   }
+
+   dev->rst = gpio_open_chip(dev->gpio_chip, dev->rst_pin_number, 1);
+   if(dev->rst < 0) {
+      spi_close(dev->spi);
+      if(dev->cs >= 0) gpio_close(dev->cs_pin_number, dev->cs);
+      return dev->rst;
+   }
+
+   dev->irq = gpio_open_chip(dev->gpio_chip, dev->irq_pin_number, 0);
+   if(dev->irq < 0) {
+      spi_close(dev->spi);
+      if(dev->cs >= 0) gpio_close(dev->cs_pin_number, dev->cs);
+      gpio_close(dev->rst_pin_number, dev->rst);
+      return dev->irq;
+   }
+
+   /*
+    * Init callback
+    */
+   dev->callback = NULL;
+
+   /*
+    * Perform hardware reset.
+    */
+   lora_reset(dev);
+
+   /*
+    * Check version.
+    */
+   uint8_t version = lora_read_reg(dev, REG_VERSION);
+   assert(version == 0x12);
+
+   /*
+    * Default configuration.
+    */
+   lora_sleep(dev);
+ 
+   spi_msg_t m;
+   lock_idle(dev);
+   lora_begin(dev, &m);
+   lora_queue_write(dev, &m, REG_FIFO_RX_BASE_ADDR, 0);
+   lora_queue_write(dev, &m, REG_FIFO_TX_BASE_ADDR, dev->transceive ? TRX_TX_BASE : 0);
+   lora_queue_write(dev, &m, REG_MODEM_CONFIG_3, 0x04);
+   lora_queue_write(dev, &m, REG_LNA, lora_read_reg(dev, REG_LNA) | 0x03);
+   lora_commit(dev, &m);
+   unlock(dev);
+ 
+   lora_set_tx_power(dev, 17);
+
+   lora_idle(dev);
+   return 1;
+}
+
+/**
+ * Send a packet.
+ * With a duty cycle limit (see lora_set_duty_cycle()), waits until the
+ * packet can be sent; with listen-before-talk (see lora_set_lbt()), until
+ * the channel is free. The radio lock is released while the packet is on
+ * air: reads go on, calls changing the radio wait for the end of the
+ * transmission. With a message transport on the radio (see frag.h), a packet
+ * starting with one of its reserved bytes must be escaped with frag_escape().
+ * @param dev Radio handle.
+ * @param buf Data to be sent
+ * @param size Size of data.
+ * @return 1 if sent, 0 if the packet can never comply with the duty cycle,
+ * the channel stayed busy, the radio never signalled the end of the
+ * transmission or, with compression, the packet does not fit.
+ */
+int 
+lora_send_packet(lora_dev_t *dev, uint8_t *buf, int size)
+{
+   uint64_t delay;
+   long airtime;
+   int ch = -1, busy = 0;
+   uint8_t frame[255];
+   if(size > 255) size = 255;
+
+   lock_idle(dev);
+   if(dev->lz != NULL) {
+      size = lz_encode_frame(dev->lz, buf, size, frame);
+      if(size < 0) {
+         unlock(dev);
+         return 0;
+      }
+      buf = frame;
+   }
+   for(;;) {
+      if(dev->channel_count > 0) {
+         ch = lora_hop(dev, size, &airtime, &delay);
+      } else {
+         airtime = lora_airtime_us(dev, size);
+         delay = lora_dc_delay(dev, airtime);
+      }
+      if(delay == 0) {
+         if(!dev->lbt_attempts || !lora_cad(dev, ch)) break;
+         if(++busy >= dev->lbt_attempts) delay = DC_NEVER;
+         else {
+            int range = 1 << (busy < LBT_MAX_EXPONENT ? busy : LBT_MAX_EXPONENT);
+            delay = (uint64_t)(dev->lbt_slot ? dev->lbt_slot : airtime) * (1 + rand_r(&dev->lbt_seed) % range);
+         }
+      }
+      unlock(dev);
+      if(delay == DC_NEVER) return 0;
+
+      /*
+       * The radio stays available while waiting; the configuration may
+       * change, so everything is checked again.
+       */
+      usleep(delay < 1000000 ? delay : 1000000);
+      lock_idle(dev);
+   }
+
+   /*
+    * Transfer data to radio.
+    */
+   spi_msg_t m;
+   lora_begin(dev, &m);
+   lora_queue_write(dev, &m, REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_STDBY);
+   if(ch >= 0) lora_queue_channel(dev, &m, ch);
+   if(dev->dc != NULL) dc_record(dev->dc, dev->frequency, lora_now_us(), airtime);
+   lora_queue_write(dev, &m, REG_IRQ_FLAGS_MASK, IRQ_MASK_DEFAULT);
+   lora_queue_write(dev, &m, REG_DIO_MAPPING_1, DIO0_TX_DONE);
+   lora_queue_write(dev, &m, REG_IRQ_FLAGS, IRQ_TX_DONE_MASK);
+   lora_queue_write(dev, &m, REG_FIFO_ADDR_PTR, dev->transceive ? TRX_TX_BASE : 0);
+   lora_queue_fifo(&m, buf, size);
+   lora_queue_write(dev, &m, REG_PAYLOAD_LENGTH, size);
+   
+   /*
+    * Start transmission and wait for conclusion.
+    */
+   lora_queue_write(dev, &m, REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_TX);
+   lora_commit(dev, &m);
+   int sent = lora_wait_tx_done(dev, airtime);
+   if(sent) {
+      stat_add(dev, tx_packets, 1);
+      stat_add(dev, tx_airtime, airtime);
+   }
+
+   /*
+    * Back to the reception channel, if any, and listening again with
+    * background reception (the reception thread may never see this edge)
+    * or in transceive mode. A transmission that never ended is aborted
+    * first.
+    */
+   lora_begin(dev, &m);
+   if(!sent) lora_queue_write(dev, &m, REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_STDBY);
+   lora_queue_write(dev, &m, REG_IRQ_FLAGS, IRQ_TX_DONE_MASK);
+   if(ch >= 0) {
+      dev->channels[ch].airtime += airtime;
+      dev->channel_next = (ch + 1) % dev->channel_count;
+      if(dev->channel_home >= 0) lora_queue_channel(dev, &m, dev->channel_home);
+   }
+   if(dev->rx_running || dev->transceive) {
+      lora_queue_write(dev, &m, REG_DIO_MAPPING_1, DIO0_RX_DONE);
+      lora_queue_write(dev, &m, REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_RX_CONTINUOUS);
+   }
+   lora_commit(dev, &m);
+   unlock(dev);
+   return sent;
+}
+
+/**
+ * Read a received packet directly from the radio.
+ * Must be called with the lock held.
+ * @param dev Radio handle.
  * @param buf Buffer for the data.
  * @param size Available size in buffer (bytes).
  * @return Number of bytes received (zero if no packet available).
  */
-int 
-lora_receive_packet(uint8_t *buf, int size)
+static int
+lora_read_packet(lora_dev_t *dev, uint8_t *buf, int size)
 {
-   int i, len = 0;
+   int len = 0;
+   uint8_t payload[255];
  
    /*
     * Check interrupts.
     */
-   lock();
-   int irq = lora_read_reg(REG_IRQ_FLAGS);
-   lora_write_reg(REG_IRQ_FLAGS, irq);
-   unlock();
+   int irq = lora_read_reg(dev, REG_IRQ_FLAGS);
+   lora_write_reg(dev, REG_IRQ_FLAGS, irq);
    if((irq & IRQ_RX_DONE_MASK) == 0) return 0;
-   if(irq & IRQ_PAYLOAD_CRC_ERROR_MASK) return 0;
+   uint64_t stamp = dev->rx_edge ? dev->rx_edge : lora_now_us();
+   dev->rx_edge = 0;
+   if(irq & IRQ_PAYLOAD_CRC_ERROR_MASK) {
+      stat_add(dev, crc_errors, 1);
+      return 0;
+   }
+   stat_add(dev, rx_packets, 1);
 
    /*
     * Find packet size.
     */
-   lock();
-   lora_write_reg(REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_STDBY);
-   if (__implicit) len = lora_read_reg(REG_PAYLOAD_LENGTH);
-   else len = lora_read_reg(REG_RX_NB_BYTES);
+   spi_msg_t m;
+   lora_begin(dev, &m);
+   if(!dev->transceive) lora_queue_write(dev, &m, REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_STDBY);
+   uint8_t *nb = lora_queue_read(&m, dev->implicit ? REG_PAYLOAD_LENGTH : REG_RX_NB_BYTES);
+   uint8_t *cur = lora_queue_read(&m, REG_FIFO_RX_CURRENT_ADDR);
+   lora_commit(dev, &m);
+   len = *nb;
 
    /*
     * Transfer data from radio.
     */
-   lora_write_reg(REG_FIFO_ADDR_PTR, lora_read_reg(REG_FIFO_RX_CURRENT_ADDR));
-   if(len > size) len = size;
-   for(i=0; i<len; i++) 
-      *buf++ = lora_read_reg(REG_FIFO);
-   unlock();
+   if((len > size) && (dev->lz == NULL)) len = size;
+   lora_queue_write(dev, &m, REG_FIFO_ADDR_PTR, *cur);
+   uint8_t *data = lora_queue_fifo(&m, NULL, len);
+   lora_commit(dev, &m);
+   if(dev->lz != NULL) {
+      len = lz_decode_frame(dev->lz, data, len, payload);
+      if(len < 0) return 0;
+      if(len > size) len = size;
+      data = payload;
+   }
+   memcpy(buf, data, len);
+   dev->rx_timestamp = stamp;
+   return len;
+}
+
+/**
+ * Take the oldest packet from the reception ring.
+ * Only one thread may consume from the ring.
+ * @param dev Radio handle.
+ * @param pkt Where to store the packet.
+ * @return 1 if a packet was taken, 0 if the ring is empty.
+ */
+int
+lora_rx_pop(lora_dev_t *dev, lora_packet_t *pkt)
+{
+   unsigned tail = dev->ring_tail;
+   unsigned head = __atomic_load_n(&dev->ring_head, __ATOMIC_ACQUIRE);
+   if((dev->ring == NULL) || (head == tail)) return 0;
+
+   *pkt = dev->ring[tail % dev->ring_depth];
+   __atomic_store_n(&dev->ring_tail, tail + 1, __ATOMIC_RELEASE);
+   return 1;
+}
+
+/**
+ * Read a received packet.
+ * If background reception is active, the packet comes from the reception
+ * ring; packets with CRC errors are discarded.
+ * @param dev Radio handle.
+ * @param buf Buffer for the data.
+ * @param size Available size in buffer (bytes).
+ * @return Number of bytes received (zero if no packet available).
+ */
+int 
+lora_receive_packet(lora_dev_t *dev, uint8_t *buf, int size)
+{
+   lora_packet_t pkt;
+
+   if(dev->rx_running) {
+      while(lora_rx_pop(dev, &pkt)) {
+         if(pkt.crc_error) continue;
+         if(pkt.size < size) size = pkt.size;
+         memcpy(buf, pkt.data, size);
+         dev->rx_timestamp = pkt.timestamp;
+         return size;
+      }
+      return 0;
+   }
+
+   /*
+    * Nothing can be received during a transmission (and its flags must
+    * not be cleared).
+    */
+   lock(dev);
+   int len = dev->busy ? 0 : lora_read_packet(dev, buf, size);
+   unlock(dev);
+   return len;
+}
+
+/**
+ * Open a single reception window at a given time: the radio looks for a
+ * preamble for a number of symbols, receives the packet if one starts and
+ * stops (RX single mode, RxTimeout), staying in standby afterwards (or
+ * listening again in transceive mode).
+ * Not available with background reception.
+ * @param dev Radio handle.
+ * @param open_at Opening time (us, see lora_clock_us()); a past time opens at once.
+ * @param symbols Length of the window in symbols (4-1023).
+ * @param buf Buffer for the data.
+ * @param size Available size in buffer (bytes).
+ * @return Number of bytes received, 0 if no packet (or a corrupted one)
+ * arrived, -1 with background reception.
+ */
+int
+lora_receive_window(lora_dev_t *dev, uint64_t open_at, int symbols, uint8_t *buf, int size)
+{
+   struct timespec ts;
+   lora_config_t cfg;
+   spi_msg_t m;
+   int irq, len = 0;
+   uint64_t edge = 0;
+
+   if(dev->rx_running) return -1;
+   if(symbols < 4) symbols = 4;
+   else if(symbols > 1023) symbols = 1023;
+
+   if(open_at > lora_now_us()) {
+      ts.tv_sec = open_at / 1000000;
+      ts.tv_nsec = (open_at % 1000000) * 1000;
+      while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+   }
+
+   lock_idle(dev);
+   lora_read_config(dev, &cfg);
+   long window = symbols * (((1L << cfg.spreading_factor) * 1000000L) / cfg.bandwidth);
+   lora_begin(dev, &m);
+   lora_queue_write(dev, &m, REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_STDBY);
+   lora_queue_write(dev, &m, REG_MODEM_CONFIG_2, (lora_read_reg(dev, REG_MODEM_CONFIG_2) & 0xfc) | (symbols >> 8));
+   lora_queue_write(dev, &m, REG_SYMB_TIMEOUT_LSB, symbols & 0xff);
+   lora_queue_write(dev, &m, REG_IRQ_FLAGS_MASK, IRQ_MASK_WINDOW);
+   lora_queue_write(dev, &m, REG_DIO_MAPPING_1, DIO0_RX_DONE);
+   lora_queue_write(dev, &m, REG_IRQ_FLAGS, IRQ_RX_MASK | IRQ_RX_TIMEOUT_MASK);
+   lora_queue_write(dev, &m, REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_RX_SINGLE);
+   lora_commit(dev, &m);
+   uint64_t end = lora_now_us() + window + lora_airtime_us(dev, 255) + TX_IRQ_MARGIN_MS * 1000;
+
+   /*
+    * RxTimeout is not on DIO0: the flags are checked when the window
+    * should be over, and then often while a packet is being received.
+    */
+   if((dev->tx_wait == LORA_TX_WAIT_IRQ) && (dev->irq >= 0)) gpio_wait_stamp(dev->irq_pin_number, dev->irq, 1, window / 1000 + 1, &edge);
+   else usleep(window);
+   for(;;) {
+      irq = lora_read_reg(dev, REG_IRQ_FLAGS);
+      if((irq & (IRQ_RX_DONE_MASK | IRQ_RX_TIMEOUT_MASK)) || (lora_now_us() >= end)) break;
+      if((dev->tx_wait == LORA_TX_WAIT_IRQ) && (dev->irq >= 0)) gpio_wait_stamp(dev->irq_pin_number, dev->irq, 1, WINDOW_POLL_MS, &edge);
+      else usleep(WINDOW_POLL_MS * 1000);
+   }
+
+   if(irq & IRQ_RX_DONE_MASK) {
+      dev->rx_edge = edge;
+      len = lora_read_packet(dev, buf, size);
+   }
+   lora_begin(dev, &m);
+   lora_queue_write(dev, &m, REG_IRQ_FLAGS, IRQ_RX_TIMEOUT_MASK);
+   lora_queue_write(dev, &m, REG_IRQ_FLAGS_MASK, IRQ_MASK_DEFAULT);
+   lora_queue_write(dev, &m, REG_OP_MODE, MODE_LONG_RANGE_MODE | (dev->transceive ? MODE_RX_CONTINUOUS : MODE_STDBY));
+   lora_commit(dev, &m);
+   unlock(dev);
    return len;
 }
 
+/**
+ * Arrival time of the last packet read with lora_receive_packet() or
+ * lora_receive_window(): the RxDone interrupt, stamped by the kernel where
+ * the GPIO character device is used, or when the interrupt was seen
+ * (when the packet was read if no interrupt was waited for).
+ * @return Time in us (see lora_clock_us()), 0 if no packet was read.
+ */
+uint64_t
+lora_packet_timestamp(lora_dev_t *dev)
+{
+   return dev->rx_timestamp;
+}
+
+/**
+ * End of the last transmission (TxDone interrupt), stamped like
+ * lora_packet_timestamp().
+ * @return Time in us (see lora_clock_us()), 0 if nothing was sent.
+ */
+uint64_t
+lora_tx_timestamp(lora_dev_t *dev)
+{
+   lock(dev);
+   uint64_t t = dev->tx_timestamp;
+   unlock(dev);
+   return t;
+}
+
 /**
  * Returns non-zero if there is data to read (packet received).
  */
 int
-lora_received(void)
+lora_received(lora_dev_t *dev)
 {
-   lock();
-   int m = lora_read_reg(REG_IRQ_FLAGS) & IRQ_RX_DONE_MASK;
-   unlock();
+   if(dev->rx_running)
+      return __atomic_load_n(&dev->ring_head, __ATOMIC_ACQUIRE) != dev->ring_tail;
+
+   lock(dev);
+   int m = lora_read_reg(dev, REG_IRQ_FLAGS) & IRQ_RX_DONE_MASK;
+   unlock(dev);
    if(m) return 1;
    return 0;
 }
 
 /**
  * Suspend the current thread until a packet arrives or a timeout occurs.
+ * @param dev Radio handle.
  * @param timeout Timeout in ms.
  */
 void
-lora_wait_for_packet(int timeout)
+lora_wait_for_packet(lora_dev_t *dev, int timeout)
 {
-   lock();
-   lora_write_reg(REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_STDBY);
-   lora_write_reg(REG_IRQ_FLAGS_MASK, 0x9f);
-   lora_write_reg(REG_DIO_MAPPING_1, 0x00);
-   unlock();
-   lora_receive();
-   gpio_wait(__irq_pin_number, __irq, 1, timeout);
+   struct timespec end;
+
+   /*
+    * With background reception, wait for the reception ring.
+    */
+   if(dev->rx_running) {
+      clock_gettime(CLOCK_REALTIME, &end);
+      end.tv_sec += timeout / 1000;
+      end.tv_nsec += (timeout % 1000) * 1000000L;
+      if(end.tv_nsec >= 1000000000L) {
+         end.tv_sec++;
+         end.tv_nsec -= 1000000000L;
+      }
+      pthread_mutex_lock(&dev->ring_mutex);
+      while(dev->rx_running && !lora_received(dev)) {
+         if(timeout < 0) pthread_cond_wait(&dev->ring_cond, &dev->ring_mutex);
+         else if(pthread_cond_timedwait(&dev->ring_cond, &dev->ring_mutex, &end) == ETIMEDOUT) break;
+      }
+      pthread_mutex_unlock(&dev->ring_mutex);
+      return;
+   }
+
+   spi_msg_t m;
+   lock_idle(dev);
+   lora_begin(dev, &m);
+   lora_queue_write(dev, &m, REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_STDBY);
+   lora_queue_write(dev, &m, REG_IRQ_FLAGS_MASK, IRQ_MASK_DEFAULT);
+   lora_queue_write(dev, &m, REG_DIO_MAPPING_1, DIO0_RX_DONE);
+   lora_queue_write(dev, &m, REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_RX_CONTINUOUS);
+   lora_commit(dev, &m);
+   unlock(dev);
+
+   /*
+    * The edge time is kept for the packet read next.
+    */
+   uint64_t stamp;
+   if(gpio_wait_stamp(dev->irq_pin_number, dev->irq, 1, timeout, &stamp) > 0) {
+      lock(dev);
+      dev->rx_edge = stamp;
+      unlock(dev);
+   }
+}
+
+/**
+ * Service the radio from the reception thread: move a received packet
+ * (if any) into the reception ring, unless the reception filter takes it,
+ * and keep the radio in continuous receive mode.
+ * @param dev Radio handle.
+ * @param irq_at Time the interrupt was detected (us), 0 if unknown.
+ * @return Number of packets stored in the ring (0-1).
+ */
+static int
+lora_rx_service(lora_dev_t *dev, uint64_t irq_at)
+{
+   spi_msg_t m;
+   lora_packet_t pkt;
+   int received = 0;
+
+   lock(dev);
+   uint64_t now = lora_now_us();
+   lora_begin(dev, &m);
+   uint8_t *p_irq = lora_queue_read(&m, REG_IRQ_FLAGS);
+   uint8_t *p_mode = lora_queue_read(&m, REG_OP_MODE);
+   uint8_t *p_nb = lora_queue_read(&m, dev->implicit ? REG_PAYLOAD_LENGTH : REG_RX_NB_BYTES);
+   uint8_t *p_cur = lora_queue_read(&m, REG_FIFO_RX_CURRENT_ADDR);
+   uint8_t *p_snr = lora_queue_read(&m, REG_PKT_SNR_VALUE);
+   uint8_t *p_rssi = lora_queue_read(&m, REG_PKT_RSSI_VALUE);
+   lora_commit(dev, &m);
+   int irq = *p_irq;
+   int mode = *p_mode;
+   int len = *p_nb;
+   int cur = *p_cur;
+   int snr = *p_snr;
+   int rssi = *p_rssi;
+
+   /*
+    * During a transmission or a detection, only report its end to the
+    * thread waiting for it (see lora_wait_irq()), which restores the radio
+    * (another operation may start right after).
+    */
+   if(dev->busy) {
+      if(irq & (IRQ_TX_DONE_MASK | IRQ_CAD_DONE_MASK)) {
+         unsigned seq = dev->busy_seq;
+         dev->busy_irq = irq;
+         dev->busy_stamp = irq_at;
+         pthread_cond_broadcast(&dev->idle_cond);
+         while(dev->busy && (dev->busy_seq == seq)) pthread_cond_wait(&dev->idle_cond, &dev->mutex);
+      }
+      unlock(dev);
+      return 0;
+   }
+
+   uint8_t *data = NULL;
+   if(irq & IRQ_RX_DONE_MASK) {
+      received = 1;
+      lora_queue_write(dev, &m, REG_FIFO_ADDR_PTR, cur);
+      data = lora_queue_fifo(&m, NULL, len);
+      if(irq & IRQ_PAYLOAD_CRC_ERROR_MASK) stat_add(dev, crc_errors, 1);
+      else stat_add(dev, rx_packets, 1);
+   }
+
+   /*
+    * Acknowledge reception interrupts and make sure the radio is listening
+    * (it may have been used for transmission in between).
+    */
+   if(irq & IRQ_RX_MASK) lora_queue_write(dev, &m, REG_IRQ_FLAGS, irq & IRQ_RX_MASK);
+   lora_queue_write(dev, &m, REG_IRQ_FLAGS_MASK, IRQ_MASK_DEFAULT);
+   lora_queue_write(dev, &m, REG_DIO_MAPPING_1, DIO0_RX_DONE);
+   if(mode != (MODE_LONG_RANGE_MODE | MODE_RX_CONTINUOUS))
+      lora_queue_write(dev, &m, REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_RX_CONTINUOUS);
+   lora_commit(dev, &m);
+
+   if(received) {
+      if(dev->lz != NULL) len = lz_decode_frame(dev->lz, data, len, pkt.data);
+      else memcpy(pkt.data, data, len);
+      pkt.size = len < 0 ? 0 : len;
+      pkt.rssi = rssi - (dev->frequency < 868E6 ? 164 : 157);
+      pkt.snr = ((int8_t)snr) * 0.25;
+      pkt.crc_error = (irq & IRQ_PAYLOAD_CRC_ERROR_MASK) || (len < 0) ? 1 : 0;
+      pkt.timestamp = irq_at ? irq_at : now;
+   }
+   unlock(dev);
+   if(!received) return 0;
+
+   /*
+    * The filter runs without the radio lock, so it may queue packets.
+    */
+   pthread_mutex_lock(&dev->filter_mutex);
+   int taken = (dev->rx_filter != NULL) && !pkt.crc_error && dev->rx_filter(&pkt, dev->rx_filter_arg);
+   pthread_mutex_unlock(&dev->filter_mutex);
+   if(taken) return 0;
+
+   /*
+    * This thread is the only producer of the ring.
+    */
+   unsigned head = dev->ring_head;
+   if(head - __atomic_load_n(&dev->ring_tail, __ATOMIC_ACQUIRE) >= dev->ring_depth) {
+      dev->ring_overflows++;
+      stat_add(dev, rx_overruns, 1);
+      return 0;
+   }
+   dev->ring[head % dev->ring_depth] = pkt;
+   __atomic_store_n(&dev->ring_head, head + 1, __ATOMIC_RELEASE);
+
+   pthread_mutex_lock(&dev->ring_mutex);
+   dev->ring_received++;
+   pthread_cond_broadcast(&dev->ring_cond);
+   pthread_mutex_unlock(&dev->ring_mutex);
+   return 1;
+}
+
+/**
+ * Hand received packets of a protocol to its implementation before the
+ * reception ring (see lora_rx_pop()), so the application keeps being the
+ * only consumer of the ring. The filter runs in the reception thread for
+ * every packet without CRC errors; it should not block, as packets are
+ * not received meanwhile.
+ * @param dev Radio handle.
+ * @param filter Function returning non-zero if it took the packet (NULL to remove it).
+ * @param arg Parameter for the filter.
+ */
+void
+lora_set_rx_filter(lora_dev_t *dev, lora_rx_filter_t filter, void *arg)
+{
+   pthread_mutex_lock(&dev->filter_mutex);
+   dev->rx_filter = filter;
+   dev->rx_filter_arg = arg;
+   pthread_mutex_unlock(&dev->filter_mutex);
 }
 
 /**
  * Secondary thread entry point.
+ * Every packet is moved from the radio FIFO to the reception ring as soon
+ * as it arrives.
  */
 void *__thread_wait(void *p)
 {
-   p = p;
-   pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+   lora_dev_t *dev = p;
+   uint64_t irq_at = 0;
    pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
 
    while(1) {
-      lora_wait_for_packet(-1);
-      if(__callback != NULL)
-         __callback();
+      /*
+       * Cancellation is only allowed while waiting for the interrupt,
+       * never with the radio lock held.
+       */
+      pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+      lora_rx_service(dev, irq_at);
+      pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+      irq_at = 0;
+      gpio_wait_stamp(dev->irq_pin_number, dev->irq, 1, -1, &irq_at);
    }
    return NULL;
 }
 
+/**
+ * Define the size of the reception ring.
+ * Only possible while background reception is stopped.
+ * @param dev Radio handle.
+ * @param depth Number of packets the ring can hold.
+ * @return 1 if successful, 0 if not possible.
+ */
+int
+lora_set_rx_depth(lora_dev_t *dev, int depth)
+{
+   if(dev->rx_running || (depth <= 0)) return 0;
+   free(dev->ring);
+   dev->ring = NULL;
+   dev->ring_depth = depth;
+   return 1;
+}
+
+/**
+ * Read counters of the reception ring.
+ * @param dev Radio handle.
+ * @param depth Capacity of the ring (may be NULL).
+ * @param queued Packets waiting to be read (may be NULL).
+ * @param received Packets stored in the ring since initialization (may be NULL).
+ * @param overflows Packets lost because the ring was full (may be NULL).
+ */
+void
+lora_rx_ring_info(lora_dev_t *dev, int *depth, int *queued, unsigned long *received, unsigned long *overflows)
+{
+   if(depth != NULL) *depth = dev->ring_depth;
+   if(queued != NULL) *queued = __atomic_load_n(&dev->ring_head, __ATOMIC_ACQUIRE) - dev->ring_tail;
+   if(received != NULL) *received = dev->ring_received;
+   if(overflows != NULL) *overflows = dev->ring_overflows;
+}
+
+/**
+ * Read the runtime statistics of a radio.
+ * Counters are updated without locking, so a copy taken while the radio is
+ * busy may be slightly inconsistent between fields.
+ * @param dev Radio handle.
+ * @param stats Where to store the statistics.
+ */
+void
+lora_get_stats(lora_dev_t *dev, lora_stats_t *stats)
+{
+   memcpy(stats, &dev->stats, sizeof(*stats));
+}
+
+/**
+ * Clear the runtime statistics of a radio.
+ * @param dev Radio handle.
+ */
+void
+lora_reset_stats(lora_dev_t *dev)
+{
+   memset(&dev->stats, 0, sizeof(dev->stats));
+}
+
+/**
+ * Callback thread entry point.
+ * Runs the callback whenever new packets were stored in the reception ring,
+ * so a slow callback never delays the reception thread.
+ */
+static void *
+__thread_dispatch(void *p)
+{
+   lora_dev_t *dev = p;
+   unsigned long seen = 0;
+
+   pthread_mutex_lock(&dev->ring_mutex);
+   seen = dev->ring_received;
+   for(;;) {
+      while(dev->dispatch_running && (seen == dev->ring_received))
+         pthread_cond_wait(&dev->ring_cond, &dev->ring_mutex);
+      if(!dev->dispatch_running) break;
+      seen = dev->ring_received;
+      pthread_mutex_unlock(&dev->ring_mutex);
+
+      if(dev->callback != NULL) {
+         /*
+          * Latency of the oldest packet waiting in the ring.
+          */
+         unsigned tail = __atomic_load_n(&dev->ring_tail, __ATOMIC_ACQUIRE);
+         if(tail != __atomic_load_n(&dev->ring_head, __ATOMIC_ACQUIRE))
+            lora_hist_add(&dev->stats.irq_latency, lora_now_us() - dev->ring[tail % dev->ring_depth].timestamp);
+         dev->callback(dev->callback_arg);
+      }
+
+      pthread_mutex_lock(&dev->ring_mutex);
+   }
+   pthread_mutex_unlock(&dev->ring_mutex);
+   return NULL;
+}
+
+/**
+ * Start background reception.
+ * A thread keeps the radio in receive mode and moves every packet to the
+ * reception ring as soon as it arrives. If a callback is defined, another
+ * thread calls it when new packets are available.
+ * @return 1 if successful, 0 if error.
+ */
+int
+lora_rx_start(lora_dev_t *dev)
+{
+   if(!dev->rx_running) {
+      if(dev->ring == NULL) {
+         dev->ring = malloc(dev->ring_depth * sizeof(lora_packet_t));
+         if(dev->ring == NULL) return 0;
+      }
+      dev->ring_head = dev->ring_tail = 0;
+
+      dev->rx_running = 1;
+      if(pthread_create(&dev->thid, NULL, __thread_wait, dev) != 0) {
+         dev->rx_running = 0;
+         return 0;
+      }
+   }
+
+   if((dev->callback != NULL) && !dev->dispatch_running) {
+      dev->dispatch_running = 1;
+      if(pthread_create(&dev->dispatch_thid, NULL, __thread_dispatch, dev) != 0) {
+         dev->dispatch_running = 0;
+         return 0;
+      }
+   }
+   return 1;
+}
+
+/**
+ * Stop background reception.
+ */
+void
+lora_rx_stop(lora_dev_t *dev)
+{
+   if(dev->rx_running) {
+      pthread_cancel(dev->thid);
+      pthread_join(dev->thid, NULL);
+   }
+
+   pthread_mutex_lock(&dev->ring_mutex);
+   int dispatch = dev->dispatch_running;
+   dev->rx_running = 0;
+   dev->dispatch_running = 0;
+   pthread_cond_broadcast(&dev->ring_cond);
+   pthread_mutex_unlock(&dev->ring_mutex);
+   if(dispatch) pthread_join(dev->dispatch_thid, NULL);
+}
+
 /**
  * Define a callback function for packet reception.
- * @param cb Callback function to use (NULL to cancel callbacks).
+ * Starts background reception if needed. The callback runs in its own
+ * thread after one or more packets are stored in the reception ring,
+ * and should consume them with lora_rx_pop() or lora_receive_packet().
+ * @param dev Radio handle.
+ * @param cb Callback function to use (NULL to cancel callbacks and stop background reception).
+ * @param arg Parameter for the callback function.
  */
-void lora_on_receive(void (*cb)(void))
+void
+lora_on_receive(lora_dev_t *dev, void (*cb)(void *arg), void *arg)
 {
-   if((cb == NULL) && (__callback != NULL)) {
-      pthread_cancel(__thid);
-      pthread_join(__thid, NULL);
-      __callback = NULL;
-      return;
+   dev->callback_arg = arg;
+   dev->callback = cb;
+   if(cb == NULL) lora_rx_stop(dev);
+   else lora_rx_start(dev);
+}
+
+/**
+ * Pick the next frame to transmit: highest priority, oldest first.
+ * Must be called with the queue mutex held.
+ * @return Index in the queue, or -1 if empty.
+ */
+static int
+lora_txq_next(lora_dev_t *dev)
+{
+   int i, best = -1;
+   for(i=0; i<TXQ_SIZE; i++) {
+      if(!dev->txq_used[i]) continue;
+      if((best < 0) 
+         || (dev->txq[i].priority > dev->txq[best].priority)
+         || ((dev->txq[i].priority == dev->txq[best].priority) && ((int32_t)(dev->txq[i].seq - dev->txq[best].seq) < 0)))
+         best = i;
    }
+   return best;
+}
 
-   if(__callback == NULL) {
-      __callback = cb;
-      pthread_create(&__thid, NULL, __thread_wait, NULL);
-      return;
+/**
+ * Transmission queue thread entry point.
+ */
+static void *
+__thread_tx(void *p)
+{
+   lora_dev_t *dev = p;
+   tx_entry_t e;
+   int i;
+
+   pthread_mutex_lock(&dev->txq_mutex);
+   for(;;) {
+      while(dev->txq_running && (dev->txq_count == 0))
+         pthread_cond_wait(&dev->txq_cond, &dev->txq_mutex);
+      if(!dev->txq_running) break;
+
+      i = lora_txq_next(dev);
+      e = dev->txq[i];
+      dev->txq_used[i] = 0;
+      dev->txq_count--;
+      dev->txq_busy = 1;
+      pthread_mutex_unlock(&dev->txq_mutex);
+
+      /*
+       * Frames that missed their deadline never reach the radio.
+       */
+      if(e.deadline && (lora_now_us() > e.deadline)) {
+         if(e.done != NULL) e.done(e.handle, LORA_TX_EXPIRED, e.arg);
+      } else {
+         int sent = lora_send_packet(dev, e.data, e.size);
+         if(e.done != NULL) e.done(e.handle, sent ? LORA_TX_SENT : LORA_TX_REJECTED, e.arg);
+      }
+
+      pthread_mutex_lock(&dev->txq_mutex);
+      dev->txq_busy = 0;
+      pthread_cond_broadcast(&dev->txq_cond);
+   }
+   pthread_mutex_unlock(&dev->txq_mutex);
+   return NULL;
+}
+
+/**
+ * Queue a packet for transmission and return immediately.
+ * Packets are sent by a dedicated thread, highest priority first.
+ * @param dev Radio handle.
+ * @param buf Data to be sent.
+ * @param size Size of data (up to 255 bytes).
+ * @param priority LORA_PRIO_LOW to LORA_PRIO_URGENT.
+ * @param deadline Maximum time in ms to wait in the queue before the packet 
+ * is dropped, or zero for no deadline.
+ * @param done Function called when the packet is sent or dropped (may be NULL).
+ * It runs in the transmission thread.
+ * @param arg Parameter for the done function.
+ * @return Positive handle identifying the packet, or negative if the queue is full.
+ */
+int
+lora_send_async(lora_dev_t *dev, uint8_t *buf, int size, int priority, long deadline, lora_tx_done_t done, void *arg)
+{
+   struct { int handle; lora_tx_done_t done; void *arg; } expired[TXQ_SIZE];
+   int i, handle, nexpired = 0;
+   uint64_t now = lora_now_us();
+
+   if(size > 255) size = 255;
+   if(size < 0) size = 0;
+
+   pthread_mutex_lock(&dev->txq_mutex);
+   if(!dev->txq_running) {
+      dev->txq_running = 1;
+      if(pthread_create(&dev->txq_thid, NULL, __thread_tx, dev) != 0) {
+         dev->txq_running = 0;
+         pthread_mutex_unlock(&dev->txq_mutex);
+         return -1;
+      }
+   }
+
+   /*
+    * When full, make room by dropping frames already past their deadline.
+    * Their done functions are called after releasing the queue.
+    */
+   if(dev->txq_count >= TXQ_SIZE) {
+      for(i=0; i<TXQ_SIZE; i++) {
+         if(!dev->txq_used[i] || !dev->txq[i].deadline || (dev->txq[i].deadline >= now)) continue;
+         dev->txq_used[i] = 0;
+         dev->txq_count--;
+         expired[nexpired].handle = dev->txq[i].handle;
+         expired[nexpired].done = dev->txq[i].done;
+         expired[nexpired++].arg = dev->txq[i].arg;
+      }
+   }
+   if(dev->txq_count >= TXQ_SIZE) {
+      pthread_mutex_unlock(&dev->txq_mutex);
+      return -1;
+   }
+
+   for(i=0; dev->txq_used[i]; i++);
+   handle = ++dev->txq_handle;
+   if(handle <= 0) handle = dev->txq_handle = 1;
+
+   memcpy(dev->txq[i].data, buf, size);
+   dev->txq[i].size = size;
+   dev->txq[i].priority = priority;
+   dev->txq[i].handle = handle;
+   dev->txq[i].deadline = (deadline > 0) ? now + (uint64_t)deadline * 1000 : 0;
+   dev->txq[i].seq = dev->txq_seq++;
+   dev->txq[i].done = done;
+   dev->txq[i].arg = arg;
+   dev->txq_used[i] = 1;
+   dev->txq_count++;
+
+   pthread_cond_broadcast(&dev->txq_cond);
+   pthread_mutex_unlock(&dev->txq_mutex);
+
+   for(i=0; i<nexpired; i++)
+      if(expired[i].done != NULL) expired[i].done(expired[i].handle, LORA_TX_EXPIRED, expired[i].arg);
+   return handle;
+}
+
+/**
+ * Return the number of packets waiting in the transmission queue
+ * (including the one being sent).
+ */
+int
+lora_tx_pending(lora_dev_t *dev)
+{
+   pthread_mutex_lock(&dev->txq_mutex);
+   int n = dev->txq_count + dev->txq_busy;
+   pthread_mutex_unlock(&dev->txq_mutex);
+   return n;
+}
+
+/**
+ * Suspend the current thread until the transmission queue is empty.
+ * @param dev Radio handle.
+ * @param timeout Timeout in ms; -1 means no timeout at all.
+ * @return 1 if the queue is empty, 0 if timeout.
+ */
+int
+lora_tx_flush(lora_dev_t *dev, int timeout)
+{
+   struct timespec end;
+   int res = 0;
+
+   clock_gettime(CLOCK_REALTIME, &end);
+   end.tv_sec += timeout / 1000;
+   end.tv_nsec += (timeout % 1000) * 1000000L;
+   if(end.tv_nsec >= 1000000000L) {
+      end.tv_sec++;
+      end.tv_nsec -= 1000000000L;
    }
 
-   __callback = cb;
+   pthread_mutex_lock(&dev->txq_mutex);
+   while(dev->txq_running && (dev->txq_count + dev->txq_busy > 0) && (res != ETIMEDOUT)) {
+      if(timeout < 0) pthread_cond_wait(&dev->txq_cond, &dev->txq_mutex);
+      else res = pthread_cond_timedwait(&dev->txq_cond, &dev->txq_mutex, &end);
+   }
+   res = (dev->txq_count + dev->txq_busy) == 0;
+   pthread_mutex_unlock(&dev->txq_mutex);
+   return res;
+}
+
+/**
+ * Stop the transmission thread.
+ * Packets still queued are dropped with LORA_TX_CANCELLED.
+ */
+static void
+lora_txq_stop(lora_dev_t *dev)
+{
+   int i;
+
+   pthread_mutex_lock(&dev->txq_mutex);
+   if(!dev->txq_running) {
+      pthread_mutex_unlock(&dev->txq_mutex);
+      return;
+   }
+   dev->txq_running = 0;
+   pthread_cond_broadcast(&dev->txq_cond);
+   pthread_mutex_unlock(&dev->txq_mutex);
+   pthread_join(dev->txq_thid, NULL);
+
+   for(i=0; i<TXQ_SIZE; i++) {
+      if(!dev->txq_used[i]) continue;
+      dev->txq_used[i] = 0;
+      if(dev->txq[i].done != NULL) dev->txq[i].done(dev->txq[i].handle, LORA_TX_CANCELLED, dev->txq[i].arg);
+   }
+   dev->txq_count = 0;
 }
 
 /**
  * Return last packet's RSSI.
  */
 int 
-lora_packet_rssi(void)
+lora_packet_rssi(lora_dev_t *dev)
 {
-   lock();
-   int v = lora_read_reg(REG_PKT_RSSI_VALUE);
-   unlock();
-   return v - (__frequency < 868E6 ? 164 : 157);
+   lock(dev);
+   int v = lora_read_reg(dev, REG_PKT_RSSI_VALUE);
+   unlock(dev);
+   return v - (dev->frequency < 868E6 ? 164 : 157);
 }
 
 /**
  * Return last packet's SNR (signal to noise ratio).
  */
 float 
-lora_packet_snr(void)
+lora_packet_snr(lora_dev_t *dev)
 {
-   lock();
-   int v = lora_read_reg(REG_PKT_SNR_VALUE);
-   unlock();
+   lock(dev);
+   int v = lora_read_reg(dev, REG_PKT_SNR_VALUE);
+   unlock(dev);
    return ((int8_t)v) * 0.25;
 }
 
@@ -616,32 +2757,29 @@ lora_packet_snr(void)
  * Shutdown hardware.
  */
 void 
-lora_close(void)
+lora_close(lora_dev_t *dev)
 {
-   lora_sleep();
-   
-   if(__callback != NULL) {
-      pthread_cancel(__thid);
-      pthread_join(__thid, NULL);
-      __callback = NULL;
-   }
-
-   close(__spi);
-   gpio_close(__cs_pin_number, __cs);
-   gpio_close(__rst_pin_number, __rst);
-   gpio_close(__irq_pin_number, __irq);
-   __spi = -1;
-   __cs = -1;
-   __rst = -1;
-   __irq = -1;
+   lora_txq_stop(dev);
+   lora_rx_stop(dev);
+   dev->callback = NULL;
+   lora_sleep(dev);
+
+   spi_close(dev->spi);
+   if(dev->cs >= 0) gpio_close(dev->cs_pin_number, dev->cs);
+   gpio_close(dev->rst_pin_number, dev->rst);
+   gpio_close(dev->irq_pin_number, dev->irq);
+   dev->spi = -1;
+   dev->cs = -1;
+   dev->rst = -1;
+   dev->irq = -1;
 }
 
 void 
-lora_dump_registers(void)
+lora_dump_registers(lora_dev_t *dev)
 {
    int i;
    for(i=0; i<0x26; i++) {
-      printf("%02x -> %02x\n", i, lora_read_reg(i));
+      printf("%02x -> %02x\n", i, lora_read_hw(dev, i));
    }
 }
 
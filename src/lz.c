@@ -0,0 +1,238 @@
+#include "lz.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Compressed data is a sequence of tokens:
+ *    0lllllll                   l + 1 literal bytes follow (1-128)
+ *    1lllllll oooooooo oooooooo copy l + LZ_MIN_MATCH bytes from o bytes back (1-65535)
+ * Distances reach into the dictionary, which precedes the data as if it
+ * had just been sent.
+ */
+#define LZ_MIN_MATCH             4
+#define LZ_MAX_MATCH             (127 + LZ_MIN_MATCH)
+#define LZ_MAX_LITERALS          128
+#define LZ_HASH_BITS             12
+#define LZ_NONE                  0xffff
+
+struct lz {
+   uint8_t *dict;
+   int size;
+   uint16_t head[1 << LZ_HASH_BITS];   // last dictionary position of each hash
+};
+
+static inline unsigned
+lz_hash(uint32_t v)
+{
+   return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/**
+ * Prepare a dictionary.
+ * Content expected in most frames should come last, where distances are shortest.
+ * @param dict Dictionary data (copied).
+ * @param size Dictionary size (up to LZ_MAX_DICT bytes).
+ * @return Codec, or NULL if too large or out of memory.
+ */
+lz_t *
+lz_create(uint8_t *dict, int size)
+{
+   int i;
+   if((size < 0) || (size > LZ_MAX_DICT)) return NULL;
+
+   lz_t *lz = calloc(1, sizeof(lz_t));
+   if(lz == NULL) return NULL;
+   lz->dict = malloc(size + 1);
+   if(lz->dict == NULL) {
+      free(lz);
+      return NULL;
+   }
+   memcpy(lz->dict, dict, size);
+   lz->size = size;
+
+   memset(lz->head, 0xff, sizeof(lz->head));
+   for(i=0; i+LZ_MIN_MATCH<=size; i++) {
+      uint32_t v;
+      memcpy(&v, dict + i, 4);
+      lz->head[lz_hash(v)] = i;
+   }
+   return lz;
+}
+
+void
+lz_destroy(lz_t *lz)
+{
+   if(lz == NULL) return;
+   free(lz->dict);
+   free(lz);
+}
+
+/**
+ * Byte at a position of the dictionary followed by the data.
+ */
+static inline uint8_t
+lz_at(lz_t *lz, uint8_t *in, int pos)
+{
+   return pos < lz->size ? lz->dict[pos] : in[pos - lz->size];
+}
+
+/**
+ * Flush pending literals.
+ * @return New output size, or -1 if it does not fit.
+ */
+static int
+lz_literals(uint8_t *in, int from, int to, uint8_t *out, int n, int max)
+{
+   while(from < to) {
+      int len = to - from;
+      if(len > LZ_MAX_LITERALS) len = LZ_MAX_LITERALS;
+      if(n + 1 + len > max) return -1;
+      out[n++] = len - 1;
+      memcpy(out + n, in + from, len);
+      n += len;
+      from += len;
+   }
+   return n;
+}
+
+/**
+ * Compress data (greedy, one candidate per position).
+ * Memory use is fixed: the dictionary hash table is copied on the stack.
+ * @param lz Codec.
+ * @param in Data.
+ * @param size Data size (up to 65535 - dictionary size).
+ * @param out Buffer for compressed data.
+ * @param max Buffer size.
+ * @return Compressed size, or -1 if it does not fit in the buffer.
+ */
+int
+lz_compress(lz_t *lz, uint8_t *in, int size, uint8_t *out, int max)
+{
+   uint16_t head[1 << LZ_HASH_BITS];
+   int i = 0, lit = 0, n = 0;
+
+   if(lz->size + size > 0xffff) return -1;
+   memcpy(head, lz->head, sizeof(head));
+
+   while(i + LZ_MIN_MATCH <= size) {
+      uint32_t v;
+      memcpy(&v, in + i, 4);
+      unsigned h = lz_hash(v);
+      int pos = lz->size + i;
+      int cand = head[h];
+      head[h] = pos;
+
+      int len = 0;
+      if(cand != LZ_NONE) {
+         while((len < LZ_MAX_MATCH) && (i + len < size) && (lz_at(lz, in, cand + len) == in[i + len])) len++;
+      }
+      if(len < LZ_MIN_MATCH) {
+         i++;
+         continue;
+      }
+
+      n = lz_literals(in, lit, i, out, n, max);
+      if((n < 0) || (n + 3 > max)) return -1;
+      int dist = pos - cand;
+      out[n++] = 0x80 | (len - LZ_MIN_MATCH);
+      out[n++] = dist >> 8;
+      out[n++] = dist & 0xff;
+
+      /*
+       * Positions inside the match are hashed too, for later matches.
+       */
+      for(i++; --len > 0; i++) {
+         if(i + LZ_MIN_MATCH > size) continue;
+         memcpy(&v, in + i, 4);
+         head[lz_hash(v)] = lz->size + i;
+      }
+      lit = i;
+   }
+   return lz_literals(in, lit, size, out, n, max);
+}
+
+/**
+ * Decompress data.
+ * @param lz Codec, with the dictionary used for compression.
+ * @param in Compressed data.
+ * @param size Compressed size.
+ * @param out Buffer for the data.
+ * @param max Buffer size.
+ * @return Data size, or -1 if invalid or larger than the buffer.
+ */
+int
+lz_decompress(lz_t *lz, uint8_t *in, int size, uint8_t *out, int max)
+{
+   int i = 0, n = 0;
+
+   while(i < size) {
+      int t = in[i++];
+      if((t & 0x80) == 0) {
+         int len = t + 1;
+         if((i + len > size) || (n + len > max)) return -1;
+         memcpy(out + n, in + i, len);
+         i += len;
+         n += len;
+         continue;
+      }
+
+      int len = (t & 0x7f) + LZ_MIN_MATCH;
+      if((i + 2 > size) || (n + len > max)) return -1;
+      int dist = (in[i] << 8) | in[i + 1];
+      i += 2;
+      int from = lz->size + n - dist;
+      if((dist == 0) || (from < 0)) return -1;
+      for(; len > 0; len--, from++)
+         out[n++] = from < lz->size ? lz->dict[from] : out[from - lz->size];
+   }
+   return n;
+}
+
+/**
+ * Build the frame for a payload: compressed if shorter, raw otherwise.
+ * @param lz Codec.
+ * @param in Payload.
+ * @param size Payload size (up to 255 bytes).
+ * @param out Buffer for the frame (255 bytes).
+ * @return Frame size, or -1 if the payload does not fit (255 bytes, not
+ * compressible and starting with a mark, so it needs one more byte).
+ */
+int
+lz_encode_frame(lz_t *lz, uint8_t *in, int size, uint8_t *out)
+{
+   int n = size > 2 ? lz_compress(lz, in, size, out + 1, size - 2) : -1;
+   if(n >= 0) {
+      out[0] = LZ_MARK_COMPRESSED;
+      return n + 1;
+   }
+
+   if((size > 0) && ((in[0] == LZ_MARK_COMPRESSED) || (in[0] == LZ_MARK_ESCAPED))) {
+      if(size > 254) return -1;
+      out[0] = LZ_MARK_ESCAPED;
+      memcpy(out + 1, in, size);
+      return size + 1;
+   }
+   memcpy(out, in, size);
+   return size;
+}
+
+/**
+ * Recover the payload of a frame.
+ * @param lz Codec.
+ * @param in Frame.
+ * @param size Frame size.
+ * @param out Buffer for the payload (255 bytes).
+ * @return Payload size, or -1 if the frame is invalid.
+ */
+int
+lz_decode_frame(lz_t *lz, uint8_t *in, int size, uint8_t *out)
+{
+   if((size > 0) && (in[0] == LZ_MARK_COMPRESSED)) return lz_decompress(lz, in + 1, size - 1, out, 255);
+   if((size > 0) && (in[0] == LZ_MARK_ESCAPED)) {
+      memcpy(out, in + 1, size - 1);
+      return size - 1;
+   }
+   memcpy(out, in, size);
+   return size;
+}
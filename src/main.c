@@ -1,8 +1,12 @@
 
+#include "frag.h"
 #include "gpio.h"
 #include "spi.h"
 #include "lora.h"
+#include "lz.h"
+#include "sim.h"
 #include <stdint.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdio.h>
@@ -42,20 +46,216 @@ void teste2(void)
 
 void teste3(void)
 {
-   lora_init();
-   lora_dump_registers();
+   lora_dev_t *dev = lora_create();
+   assert(dev != NULL);
+   lora_init(dev);
+   lora_dump_registers(dev);
 
    for(;;) {
       usleep(2000000);
       printf("Enviando pacote...");
-      lora_send_packet("Hello", 5);
+      lora_send_packet(dev, (uint8_t *)"Hello", 5);
       printf("ok\n");
    }
 }
 
+/*
+ * Compression round trip of one payload.
+ * @return Frame size, -1 if the payload does not fit.
+ */
+static int
+lz_round_trip(lz_t *lz, uint8_t *data, int size)
+{
+   uint8_t frame[255], out[255];
+   int n = lz_encode_frame(lz, data, size, frame);
+   if(n < 0) return n;
+   assert(n <= 255);
+   assert(lz_decode_frame(lz, frame, n, out) == size);
+   assert(memcmp(out, data, size) == 0);
+   return n;
+}
+
+/*
+ * Compression: frames compressed, raw and escaped.
+ */
+void teste_lz(void)
+{
+   char *dict = "{\"device\":\"node-\",\"temperature\":,\"humidity\":,\"status\":\"ok\"}";
+   char *json = "{\"device\":\"node-17\",\"temperature\":21.5,\"humidity\":48,\"status\":\"ok\"}";
+   uint8_t data[255];
+   int i;
+
+   lz_t *lz = lz_create((uint8_t *)dict, strlen(dict));
+   assert(lz != NULL);
+   assert(lz_round_trip(lz, (uint8_t *)json, strlen(json)) < (int)strlen(json));
+   assert(lz_round_trip(lz, data, 0) == 0);
+
+   /*
+    * Incompressible payloads, with and without a mark in the first byte.
+    */
+   for(i=0; i<255; i++) data[i] = (i * 167 + 13) ^ (i >> 3);
+   data[0] = 0x55;
+   assert(lz_round_trip(lz, data, 255) == 255);
+   data[0] = LZ_MARK_COMPRESSED;
+   assert(lz_round_trip(lz, data, 1) == 2);
+   assert(lz_round_trip(lz, data, 254) == 255);
+   assert(lz_round_trip(lz, data, 255) == -1);
+   data[0] = LZ_MARK_ESCAPED;
+   assert(lz_round_trip(lz, data, 100) == 101);
+   assert(lz_round_trip(lz, data, 255) == -1);
+
+   /*
+    * A payload of 255 bytes starting with a mark still goes if it compresses.
+    */
+   memset(data + 1, 'a', 254);
+   assert(lz_round_trip(lz, data, 255) < 255);
+   lz_destroy(lz);
+   printf("compressao ok\n");
+}
+
+/*
+ * Messages between two simulated radios: fragmented, acknowledged (with the
+ * receiver not waiting for them) and posted to share a packet. Packets of
+ * other protocols still reach the reception ring.
+ */
+static void
+teste_frag(lora_dev_t *tx, lora_dev_t *rx)
+{
+   static uint8_t msg[1000];
+   lora_packet_t pkt;
+   unsigned long sent, rejected;
+   uint8_t *buf;
+   char text[32];
+   int i;
+
+   frag_t *ft = frag_create(tx);
+   frag_t *fr = frag_create(rx);
+   assert((ft != NULL) && (fr != NULL));
+   assert(lora_rx_start(tx));
+   for(i=0; i<(int)sizeof(msg); i++) msg[i] = i * 7;
+
+   assert(frag_send(ft, msg, sizeof(msg)));
+   assert(frag_receive(fr, &buf, 5000) == sizeof(msg));
+   assert(memcmp(buf, msg, sizeof(msg)) == 0);
+   free(buf);
+
+   assert(lora_send_packet(tx, (uint8_t *)"Hello", 5));
+   lora_wait_for_packet(rx, 1000);
+   assert(lora_rx_pop(rx, &pkt) && (pkt.size == 5) && !memcmp(pkt.data, "Hello", 5));
+
+   uint8_t raw[2] = { FRAG_TYPE_DATA, 1 }, frame[255];
+   assert(frag_escape(raw, 2, frame) == 3);
+   assert(lora_send_packet(tx, frame, 3));
+   lora_wait_for_packet(rx, 1000);
+   assert(lora_rx_pop(rx, &pkt) && (pkt.size == 2) && !memcmp(pkt.data, raw, 2));
+
+   assert(frag_send_reliable(ft, msg, sizeof(msg)));
+   assert(frag_receive(fr, &buf, 0) == sizeof(msg));
+   assert(memcmp(buf, msg, sizeof(msg)) == 0);
+   free(buf);
+
+   frag_set_batching(ft, 0, 100);
+   for(i=0; i<10; i++) {
+      sprintf(text, "leitura %d", i);
+      assert(frag_post(ft, (uint8_t *)text, strlen(text)));
+   }
+   for(i=0; i<10; i++) {
+      sprintf(text, "leitura %d", i);
+      assert(frag_receive(fr, &buf, 2000) == (long)strlen(text));
+      assert(memcmp(buf, text, strlen(text)) == 0);
+      free(buf);
+   }
+   assert(frag_flush(ft));
+   frag_batch_info(ft, &sent, &rejected);
+   assert((sent == 1) && (rejected == 0));
+
+   frag_destroy(ft);
+   frag_destroy(fr);
+   printf("fragmentacao ok\n");
+}
+
+/*
+ * Duty cycle: a sub-band with a budget of 36 ms per hour takes one short
+ * packet, then holds the next one; a packet longer than the budget is
+ * refused at once.
+ */
+static void
+teste_duty_cycle(lora_dev_t *tx)
+{
+   uint8_t big[255];
+   memset(big, 0x5a, sizeof(big));
+
+   lora_set_frequency(tx, 869525000);
+   assert(lora_add_subband(tx, 869400000, 869650000, 0.00001));
+   assert(lora_time_on_air(tx, 5) < 36000);
+   assert(lora_time_on_air(tx, 255) > 36000);
+
+   assert(lora_tx_delay(tx, 5) == 0);
+   assert(lora_send_packet(tx, (uint8_t *)"Hello", 5));
+   assert(lora_tx_delay(tx, 5) > 3000000000L);
+   assert(lora_tx_delay(tx, 255) < 0);
+   assert(lora_send_packet(tx, big, sizeof(big)) == 0);
+   assert(lora_set_duty_cycle(tx, NULL));
+   printf("ciclo de trabalho ok\n");
+}
+
+/*
+ * Two simulated radios (no hardware needed).
+ */
+void teste4(void)
+{
+   lora_packet_t pkt;
+   int i;
+
+   sim_install();
+   assert(sim_add_radio("sim0", 17, 4) != NULL);
+   assert(sim_add_radio("sim1", 27, 22) != NULL);
+
+   lora_dev_t *tx = lora_create();
+   lora_dev_t *rx = lora_create();
+   assert((tx != NULL) && (rx != NULL));
+   lora_set_pins(tx, "sim0", 25, 17, 4);
+   lora_set_pins(rx, "sim1", 24, 27, 22);
+   assert(lora_init(tx) == 1);
+   assert(lora_init(rx) == 1);
+   assert(lora_rx_start(rx));
+   usleep(10000);
+
+   for(i=0; i<5; i++) {
+      printf("Enviando pacote...");
+      lora_send_packet(tx, (uint8_t *)"Hello", 5);
+      lora_wait_for_packet(rx, 1000);
+      if(lora_rx_pop(rx, &pkt)) printf("recebido: %.*s (%d dBm)\n", pkt.size, pkt.data, pkt.rssi);
+      else printf("perdido\n");
+   }
+
+   /*
+    * With compression, a payload that does not fit is refused.
+    */
+   uint8_t big[255];
+   memset(big, 0x5a, sizeof(big));
+   big[0] = LZ_MARK_COMPRESSED;
+   for(i=1; i<255; i++) big[i] = (i * 167 + 13) ^ (i >> 3);
+   assert(lora_set_compression(tx, (uint8_t *)"dictionary", 10));
+   assert(lora_send_packet(tx, big, 255) == 0);
+   assert(lora_send_packet(tx, big, 254) == 1);
+   lora_wait_for_packet(rx, 1000);
+   assert(lora_rx_pop(rx, &pkt) && (pkt.size == 255) && (pkt.data[0] == LZ_MARK_ESCAPED));
+   assert(lora_set_compression(tx, NULL, 0));
+
+   teste_frag(tx, rx);
+   teste_duty_cycle(tx);
+
+   lora_destroy(tx);
+   lora_destroy(rx);
+   sim_uninstall();
+   teste_lz();
+}
+
 int 
 main(int argc, char **argv)
 {
-   teste3();
+   if((argc > 1) && !strcmp(argv[1], "sim")) teste4();
+   else teste3();
    return 0;
 }
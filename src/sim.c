@@ -0,0 +1,950 @@
+#include "sim.h"
+#include "spi.h"
+#include "gpio.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+/*
+ * Simulator limits
+ */
+#define SIM_MAX_RADIOS                 8
+#define SIM_MAX_FDS                    64
+#define SIM_AIR_MAX                    32
+#define SIM_FD_BASE                    0x4000   // handlers given by the simulator
+#define SIM_LOCK_SYMBOLS               4        // preamble symbols a receiver needs to lock
+
+/*
+ * Register definitions
+ */
+#define REG_FIFO                       0x00
+#define REG_OP_MODE                    0x01
+#define REG_FRF_MSB                    0x06
+#define REG_FRF_MID                    0x07
+#define REG_FRF_LSB                    0x08
+#define REG_FIFO_ADDR_PTR              0x0d
+#define REG_FIFO_TX_BASE_ADDR          0x0e
+#define REG_FIFO_RX_BASE_ADDR          0x0f
+#define REG_FIFO_RX_CURRENT_ADDR       0x10
+#define REG_IRQ_FLAGS_MASK             0x11
+#define REG_IRQ_FLAGS                  0x12
+#define REG_RX_NB_BYTES                0x13
+#define REG_PKT_SNR_VALUE              0x19
+#define REG_PKT_RSSI_VALUE             0x1a
+#define REG_RSSI_VALUE                 0x1b
+#define REG_MODEM_CONFIG_1             0x1d
+#define REG_MODEM_CONFIG_2             0x1e
+#define REG_SYMB_TIMEOUT_LSB           0x1f
+#define REG_PREAMBLE_MSB               0x20
+#define REG_PREAMBLE_LSB               0x21
+#define REG_PAYLOAD_LENGTH             0x22
+#define REG_MODEM_CONFIG_3             0x26
+#define REG_RSSI_WIDEBAND              0x2c
+#define REG_SYNC_WORD                  0x39
+#define REG_DIO_MAPPING_1              0x40
+#define REG_VERSION                    0x42
+
+#define SIM_REGS                       0x80
+
+/*
+ * Transceiver modes (REG_OP_MODE, bits 2-0)
+ */
+#define MODE_MASK                      0x07
+#define MODE_SLEEP                     0x00
+#define MODE_STDBY                     0x01
+#define MODE_TX                        0x03
+#define MODE_RX_CONTINUOUS             0x05
+#define MODE_RX_SINGLE                 0x06
+#define MODE_CAD                       0x07
+
+/*
+ * IRQ flags
+ */
+#define IRQ_RX_TIMEOUT                 0x80
+#define IRQ_RX_DONE                    0x40
+#define IRQ_PAYLOAD_CRC_ERROR          0x20
+#define IRQ_VALID_HEADER               0x10
+#define IRQ_TX_DONE                    0x08
+#define IRQ_CAD_DONE                   0x04
+#define IRQ_CAD_DETECTED               0x01
+
+/*
+ * Defaults for new radios
+ */
+#define DEFAULT_LINK_RSSI              -60
+#define DEFAULT_LINK_SNR               9.5
+
+/*
+ * Use of a simulated handler.
+ */
+enum { SIM_FD_FREE = 0, SIM_FD_SPI, SIM_FD_RST, SIM_FD_IRQ, SIM_FD_PIN };
+
+/*
+ * State of one simulated transceiver.
+ */
+struct sim_radio {
+   char spi_device[80];
+   int rst_pin;
+   int irq_pin;
+
+   uint8_t regs[SIM_REGS];
+   uint8_t fifo[256];
+   int in_reset;
+
+   uint64_t tx_end;                    // end of the current transmission, 0 = none
+   uint64_t rx_since;                  // start of the current reception
+   uint64_t rx_timeout;                // end of the RX single window, 0 = none
+   uint8_t rx_addr;                    // FIFO position for the next received packet
+   uint64_t cad_start;
+   uint64_t cad_end;                   // end of channel activity detection, 0 = none
+
+   int rssi;                           // link quality for the packets received
+   float snr;
+};
+
+/*
+ * A packet on the air.
+ */
+typedef struct {
+   sim_radio_t *from;                  // NULL = injected
+   sim_radio_t *to;                    // NULL = heard by every radio
+   uint64_t channel;                   // see sim_channel()
+   uint64_t start;
+   uint64_t end;
+   uint8_t data[255];
+   int size;
+   int crc_error;
+} sim_air_t;
+
+typedef struct {
+   int use;
+   sim_radio_t *radio;
+   int value;
+} sim_fd_t;
+
+static sim_radio_t *__radios[SIM_MAX_RADIOS];
+static int __nradios = 0;
+static sim_fd_t __fds[SIM_MAX_FDS];
+static sim_air_t __air[SIM_AIR_MAX];
+static int __nair = 0;
+static int __speed = 1;
+
+static pthread_mutex_t __mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t __cond;
+static pthread_once_t __once = PTHREAD_ONCE_INIT;
+
+static const long __bandwidths[10] = { 7800, 10400, 15600, 20800, 31250, 41700, 62500, 125000, 250000, 500000 };
+
+static int sim_spi_open(char *device, int hw_cs);
+static int sim_spi_message(int fd, struct spi_ioc_transfer *xfer, int count);
+static void sim_spi_close(int fd);
+static int sim_gpio_open(char *device, int pin, int output);
+static int sim_gpio_close(int pin, int fd);
+static void sim_gpio_output(int fd, int val);
+static int sim_gpio_input(int fd);
+static int sim_gpio_wait(int pin, int fd, int rising, int timeout);
+
+static spi_transport_t __sim_spi = { sim_spi_open, sim_spi_message, sim_spi_close };
+static gpio_transport_t __sim_gpio = { sim_gpio_open, sim_gpio_close, sim_gpio_output, sim_gpio_input, sim_gpio_wait, NULL };   // edges not stamped
+
+/**
+ * Simulation time.
+ * @return CLOCK_MONOTONIC time in microseconds.
+ */
+static uint64_t
+sim_now(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+sim_init_once(void)
+{
+   pthread_condattr_t attr;
+   pthread_condattr_init(&attr);
+   pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+   pthread_cond_init(&__cond, &attr);
+   pthread_condattr_destroy(&attr);
+}
+
+/**
+ * Route the SPI and GPIO functions to the simulator.
+ * Radios must be created with sim_add_radio() before lora_init().
+ */
+void
+sim_install(void)
+{
+   pthread_once(&__once, sim_init_once);
+   spi_set_transport(&__sim_spi);
+   gpio_set_transport(&__sim_gpio);
+}
+
+/**
+ * Go back to the kernel drivers.
+ */
+void
+sim_uninstall(void)
+{
+   spi_set_transport(NULL);
+   gpio_set_transport(NULL);
+}
+
+/**
+ * Run the simulated time faster than real time.
+ * @param factor Times on air and reception windows are divided by this value.
+ */
+void
+sim_set_speed(int factor)
+{
+   pthread_mutex_lock(&__mutex);
+   __speed = (factor > 0) ? factor : 1;
+   pthread_mutex_unlock(&__mutex);
+}
+
+/**
+ * Power-on values of the registers.
+ */
+static void
+sim_reset_registers(sim_radio_t *r)
+{
+   memset(r->regs, 0, sizeof(r->regs));
+   memset(r->fifo, 0, sizeof(r->fifo));
+   r->regs[REG_OP_MODE] = 0x09;
+   r->regs[REG_FRF_MSB] = 0x6c;
+   r->regs[REG_FRF_MID] = 0x80;
+   r->regs[0x09] = 0x4f;
+   r->regs[0x0a] = 0x09;
+   r->regs[0x0b] = 0x2b;
+   r->regs[0x0c] = 0x20;
+   r->regs[REG_FIFO_TX_BASE_ADDR] = 0x80;
+   r->regs[REG_MODEM_CONFIG_1] = 0x72;
+   r->regs[REG_MODEM_CONFIG_2] = 0x70;
+   r->regs[REG_SYMB_TIMEOUT_LSB] = 0x64;
+   r->regs[REG_PREAMBLE_LSB] = 0x08;
+   r->regs[REG_PAYLOAD_LENGTH] = 0x01;
+   r->regs[0x23] = 0xff;
+   r->regs[0x31] = 0xc3;
+   r->regs[0x33] = 0x27;
+   r->regs[0x37] = 0x0a;
+   r->regs[REG_SYNC_WORD] = 0x12;
+   r->regs[REG_VERSION] = 0x12;
+   r->tx_end = 0;
+   r->rx_timeout = 0;
+   r->cad_end = 0;
+}
+
+/**
+ * Create a simulated transceiver.
+ * @param spi_device SPI device name used to reach the radio (as given to lora_set_pins()).
+ * @param rst_pin Pin number connected to the reset line.
+ * @param irq_pin Pin number connected to DIO0.
+ * @return Radio, or NULL if error.
+ */
+sim_radio_t *
+sim_add_radio(char *spi_device, int rst_pin, int irq_pin)
+{
+   sim_radio_t *r = NULL;
+
+   pthread_mutex_lock(&__mutex);
+   if(__nradios < SIM_MAX_RADIOS) r = calloc(1, sizeof(*r));
+   if(r != NULL) {
+      strncpy(r->spi_device, spi_device, sizeof(r->spi_device) - 1);
+      r->rst_pin = rst_pin;
+      r->irq_pin = irq_pin;
+      r->rssi = DEFAULT_LINK_RSSI;
+      r->snr = DEFAULT_LINK_SNR;
+      sim_reset_registers(r);
+      __radios[__nradios++] = r;
+   }
+   pthread_mutex_unlock(&__mutex);
+   return r;
+}
+
+/**
+ * Define the quality of the packets received by a radio.
+ * @param r Radio.
+ * @param rssi Signal strength in dBm.
+ * @param snr Signal to noise ratio in dB.
+ */
+void
+sim_set_link(sim_radio_t *r, int rssi, float snr)
+{
+   pthread_mutex_lock(&__mutex);
+   r->rssi = rssi;
+   r->snr = snr;
+   pthread_mutex_unlock(&__mutex);
+}
+
+/**
+ * Radio channel of a transceiver, as a single value: packets are only
+ * heard with the same frequency, bandwidth, spreading factor, header mode
+ * and sync word.
+ */
+static uint64_t
+sim_channel(sim_radio_t *r)
+{
+   uint64_t frf = (r->regs[REG_FRF_MSB] << 16) | (r->regs[REG_FRF_MID] << 8) | r->regs[REG_FRF_LSB];
+   return frf
+      | ((uint64_t)(r->regs[REG_MODEM_CONFIG_2] >> 4) << 24)
+      | ((uint64_t)(r->regs[REG_MODEM_CONFIG_1] >> 4) << 28)
+      | ((uint64_t)(r->regs[REG_MODEM_CONFIG_1] & 0x01) << 32)
+      | ((uint64_t)r->regs[REG_SYNC_WORD] << 40);
+}
+
+/*
+ * Channel activity detection only looks at the modulation, not the sync word.
+ */
+#define SIM_CAD_CHANNEL(c)             ((c) & 0xffffffffULL)
+
+/**
+ * Symbol time with the current configuration.
+ * @return Symbol time in ns (simulation time).
+ */
+static int64_t
+sim_tsym_ns(sim_radio_t *r)
+{
+   int bw = r->regs[REG_MODEM_CONFIG_1] >> 4;
+   int sf = r->regs[REG_MODEM_CONFIG_2] >> 4;
+   if(bw > 9) bw = 9;
+   if(sf < 6) sf = 6;
+   return ((int64_t)1000000000 << sf) / __bandwidths[bw] / __speed;
+}
+
+/**
+ * Time on air of a packet with the current configuration of the radio.
+ * (SX1276 datasheet, section 4.1.1.7)
+ * Must be called with the simulator lock held.
+ */
+static long
+sim_airtime(sim_radio_t *r, int size)
+{
+   int mc1 = r->regs[REG_MODEM_CONFIG_1];
+   int mc2 = r->regs[REG_MODEM_CONFIG_2];
+   int mc3 = r->regs[REG_MODEM_CONFIG_3];
+   long preamble = (r->regs[REG_PREAMBLE_MSB] << 8) | r->regs[REG_PREAMBLE_LSB];
+   int sf = mc2 >> 4;
+   int cr = (mc1 >> 1) & 0x07;
+   int ih = mc1 & 0x01;
+   int crc = (mc2 >> 2) & 0x01;
+   int de = (mc3 >> 3) & 0x01;
+
+   if(sf < 6) sf = 6;
+   if(cr < 1) cr = 1;
+
+   int64_t tsym = sim_tsym_ns(r);
+   int64_t num = 8 * size - 4 * sf + 28 + 16 * crc - 20 * ih;
+   int64_t den = 4 * (sf - 2 * de);
+   int64_t nsym = 0;
+   if(num > 0) nsym = ((num + den - 1) / den) * (cr + 4);
+   nsym = 4 * (preamble + 8 + nsym) + 17;
+
+   return (long)((nsym * tsym / 4 + 999) / 1000);
+}
+
+/**
+ * Time on air of a packet with the current configuration of a radio.
+ * @param r Radio.
+ * @param size Payload size in bytes.
+ * @return Time on air in microseconds (simulation time).
+ */
+long
+sim_airtime_us(sim_radio_t *r, int size)
+{
+   pthread_mutex_lock(&__mutex);
+   long res = sim_airtime(r, size);
+   pthread_mutex_unlock(&__mutex);
+   return res;
+}
+
+/**
+ * Raise interrupt flags, except the masked ones.
+ */
+static void
+sim_set_flags(sim_radio_t *r, int flags)
+{
+   r->regs[REG_IRQ_FLAGS] |= flags & ~r->regs[REG_IRQ_FLAGS_MASK];
+}
+
+static int
+sim_mode(sim_radio_t *r)
+{
+   return r->regs[REG_OP_MODE] & MODE_MASK;
+}
+
+/**
+ * Mode change made by the radio itself.
+ */
+static void
+sim_set_mode(sim_radio_t *r, int mode)
+{
+   r->regs[REG_OP_MODE] = (r->regs[REG_OP_MODE] & ~MODE_MASK) | mode;
+}
+
+/**
+ * Remove a packet from the air.
+ */
+static void
+sim_air_remove(int i)
+{
+   __nair--;
+   if(i < __nair) memmove(&__air[i], &__air[i + 1], (__nair - i) * sizeof(__air[0]));
+}
+
+/**
+ * Abort the transmission of a radio.
+ */
+static void
+sim_abort_tx(sim_radio_t *r, uint64_t now)
+{
+   int i;
+   for(i=__nair-1; i>=0; i--)
+      if((__air[i].from == r) && (__air[i].end > now)) sim_air_remove(i);
+   r->tx_end = 0;
+}
+
+/**
+ * Mode change requested through REG_OP_MODE.
+ */
+static void
+sim_write_mode(sim_radio_t *r, int val, uint64_t now)
+{
+   int old = sim_mode(r);
+   int mode = val & MODE_MASK;
+   int i;
+
+   r->regs[REG_OP_MODE] = val;
+   if(mode == old) return;
+
+   if(old == MODE_TX) sim_abort_tx(r, now);
+   r->rx_timeout = 0;
+   r->cad_end = 0;
+
+   switch(mode) {
+      case MODE_TX:
+         if(__nair >= SIM_AIR_MAX) {
+            r->tx_end = now + sim_airtime(r, r->regs[REG_PAYLOAD_LENGTH]);
+            break;
+         }
+         sim_air_t *a = &__air[__nair++];
+         a->from = r;
+         a->to = NULL;
+         a->channel = sim_channel(r);
+         a->start = now;
+         a->end = now + sim_airtime(r, r->regs[REG_PAYLOAD_LENGTH]);
+         a->size = r->regs[REG_PAYLOAD_LENGTH];
+         a->crc_error = 0;
+         for(i=0; i<a->size; i++)
+            a->data[i] = r->fifo[(uint8_t)(r->regs[REG_FIFO_TX_BASE_ADDR] + i)];
+         r->tx_end = a->end;
+         break;
+
+      case MODE_RX_SINGLE:
+         r->rx_timeout = now +
+            ((((r->regs[REG_MODEM_CONFIG_2] & 0x03) << 8) | r->regs[REG_SYMB_TIMEOUT_LSB]) * sim_tsym_ns(r)) / 1000;
+         if(r->rx_timeout == now) r->rx_timeout++;
+         /* fall through */
+
+      case MODE_RX_CONTINUOUS:
+         r->rx_since = now;
+         r->rx_addr = r->regs[REG_FIFO_RX_BASE_ADDR];
+         break;
+
+      case MODE_CAD:
+         r->cad_start = now;
+         r->cad_end = now + 2 * sim_tsym_ns(r) / 1000 + 1;
+         break;
+   }
+}
+
+/**
+ * Write access to a register.
+ */
+static void
+sim_write(sim_radio_t *r, int reg, int val, uint64_t now)
+{
+   switch(reg) {
+      case REG_FIFO:
+         r->fifo[r->regs[REG_FIFO_ADDR_PTR]++] = val;
+         break;
+      case REG_OP_MODE:
+         sim_write_mode(r, val, now);
+         break;
+      case REG_IRQ_FLAGS:
+         r->regs[REG_IRQ_FLAGS] &= ~val;
+         break;
+      case REG_FIFO_RX_CURRENT_ADDR:
+      case REG_RX_NB_BYTES:
+      case 0x14 ... REG_RSSI_VALUE:
+      case REG_VERSION:
+         break;                        // read only
+      default:
+         r->regs[reg] = val;
+   }
+}
+
+/**
+ * Read access to a register.
+ */
+static int
+sim_read(sim_radio_t *r, int reg)
+{
+   switch(reg) {
+      case REG_FIFO:
+         return r->fifo[r->regs[REG_FIFO_ADDR_PTR]++];
+      case REG_RSSI_WIDEBAND:
+         return rand() & 0xff;
+   }
+   return r->regs[reg];
+}
+
+/**
+ * Store a packet heard by a radio.
+ */
+static void
+sim_deliver(sim_radio_t *r, sim_air_t *a)
+{
+   long frf = (r->regs[REG_FRF_MSB] << 16) | (r->regs[REG_FRF_MID] << 8) | r->regs[REG_FRF_LSB];
+   long frequency = (long)(((int64_t)frf * 32000000) >> 19);
+   int i;
+
+   for(i=0; i<a->size; i++)
+      r->fifo[(uint8_t)(r->rx_addr + i)] = a->data[i];
+   r->regs[REG_FIFO_RX_CURRENT_ADDR] = r->rx_addr;
+   r->regs[REG_RX_NB_BYTES] = a->size;
+   r->rx_addr += a->size;
+
+   int rssi = r->rssi + (frequency < 868E6 ? 164 : 157);
+   if(rssi < 0) rssi = 0;
+   if(rssi > 255) rssi = 255;
+   r->regs[REG_PKT_RSSI_VALUE] = rssi;
+   r->regs[REG_PKT_SNR_VALUE] = (uint8_t)(int8_t)(r->snr * 4);
+
+   sim_set_flags(r, IRQ_VALID_HEADER | IRQ_RX_DONE | (a->crc_error ? IRQ_PAYLOAD_CRC_ERROR : 0));
+   if(sim_mode(r) == MODE_RX_SINGLE) {
+      r->rx_timeout = 0;
+      sim_set_mode(r, MODE_STDBY);
+   }
+}
+
+/**
+ * Check if a radio is listening to a packet: it must have been receiving
+ * before the last SIM_LOCK_SYMBOLS symbols of the preamble.
+ */
+static int
+sim_hears(sim_radio_t *r, sim_air_t *a)
+{
+   if((r == a->from) || ((a->to != NULL) && (a->to != r))) return 0;
+   if((sim_mode(r) != MODE_RX_CONTINUOUS) && (sim_mode(r) != MODE_RX_SINGLE)) return 0;
+   long preamble = (r->regs[REG_PREAMBLE_MSB] << 8) | r->regs[REG_PREAMBLE_LSB];
+   uint64_t late = (preamble > SIM_LOCK_SYMBOLS) ? (preamble - SIM_LOCK_SYMBOLS) * sim_tsym_ns(r) / 1000 : 0;
+   if(r->in_reset || (r->rx_since > a->start + late)) return 0;
+   return sim_channel(r) == a->channel;
+}
+
+/**
+ * Next pending event of the simulation.
+ * @param radio Radio of the event (NULL if it is the end of a packet on the air).
+ * @param air Packet on the air that ends, if radio is NULL.
+ * @return Time of the event (0 = nothing pending).
+ */
+static uint64_t
+sim_next_event(sim_radio_t **radio, int *air)
+{
+   uint64_t t = 0;
+   int i;
+
+   *radio = NULL;
+   *air = -1;
+   for(i=0; i<__nradios; i++) {
+      sim_radio_t *r = __radios[i];
+      uint64_t e = r->tx_end;
+      if(r->rx_timeout && (!e || (r->rx_timeout < e))) e = r->rx_timeout;
+      if(r->cad_end && (!e || (r->cad_end < e))) e = r->cad_end;
+      if(e && (!t || (e < t))) {
+         t = e;
+         *radio = r;
+      }
+   }
+   for(i=0; i<__nair; i++) {
+      if(!t || (__air[i].end < t)) {
+         t = __air[i].end;
+         *radio = NULL;
+         *air = i;
+      }
+   }
+   return t;
+}
+
+/**
+ * Process the events of one radio that are due.
+ */
+static void
+sim_radio_event(sim_radio_t *r, uint64_t t)
+{
+   int i;
+
+   if(r->tx_end && (r->tx_end <= t)) {
+      r->tx_end = 0;
+      sim_set_flags(r, IRQ_TX_DONE);
+      sim_set_mode(r, MODE_STDBY);
+   }
+
+   if(r->rx_timeout && (r->rx_timeout <= t)) {
+      r->rx_timeout = 0;
+
+      /*
+       * A packet already started keeps the receiver busy until its end.
+       */
+      for(i=0; i<__nair; i++)
+         if((__air[i].start <= t) && sim_hears(r, &__air[i])) return;
+
+      sim_set_flags(r, IRQ_RX_TIMEOUT);
+      sim_set_mode(r, MODE_STDBY);
+   }
+
+   if(r->cad_end && (r->cad_end <= t)) {
+      int detected = 0;
+      for(i=0; i<__nair; i++) {
+         sim_air_t *a = &__air[i];
+         if((a->from == r) || ((a->to != NULL) && (a->to != r))) continue;
+         if((a->start < r->cad_end) && (a->end > r->cad_start)
+               && (SIM_CAD_CHANNEL(a->channel) == SIM_CAD_CHANNEL(sim_channel(r))))
+            detected = 1;
+      }
+      r->cad_end = 0;
+      sim_set_flags(r, IRQ_CAD_DONE | (detected ? IRQ_CAD_DETECTED : 0));
+      sim_set_mode(r, MODE_STDBY);
+   }
+}
+
+/**
+ * Advance the simulation up to the current time.
+ * Must be called with the simulator lock held.
+ * @return Time of the next pending event (0 = nothing pending).
+ */
+static uint64_t
+sim_run(uint64_t now)
+{
+   sim_radio_t *r;
+   int i, a, changed = 0;
+   uint64_t t;
+
+   for(;;) {
+      t = sim_next_event(&r, &a);
+      if(!t || (t > now)) break;
+      changed = 1;
+
+      if(r != NULL) {
+         sim_radio_event(r, t);
+      } else {
+         for(i=0; i<__nradios; i++)
+            if(sim_hears(__radios[i], &__air[a])) sim_deliver(__radios[i], &__air[a]);
+         sim_air_remove(a);
+      }
+   }
+
+   if(changed) pthread_cond_broadcast(&__cond);
+   return t;
+}
+
+/**
+ * Level of the DIO0 line, according to REG_DIO_MAPPING_1.
+ */
+static int
+sim_dio0(sim_radio_t *r)
+{
+   static const uint8_t map[4] = { IRQ_RX_DONE, IRQ_TX_DONE, IRQ_CAD_DONE, 0 };
+   return (r->regs[REG_IRQ_FLAGS] & map[r->regs[REG_DIO_MAPPING_1] >> 6]) ? 1 : 0;
+}
+
+/**
+ * Send a packet to a radio, as if another transceiver was transmitting it
+ * with the same configuration. It arrives after its time on air.
+ * @param r Radio.
+ * @param data Packet data.
+ * @param size Packet size in bytes.
+ * @param crc_error Non-zero to report a CRC error for the packet.
+ * @return Time on air in microseconds, negative if error.
+ */
+long
+sim_inject(sim_radio_t *r, uint8_t *data, int size, int crc_error)
+{
+   long res = -1;
+   if(size > 255) size = 255;
+
+   pthread_mutex_lock(&__mutex);
+   uint64_t now = sim_now();
+   sim_run(now);
+   if(__nair < SIM_AIR_MAX) {
+      sim_air_t *a = &__air[__nair++];
+      res = sim_airtime(r, size);
+      a->from = NULL;
+      a->to = r;
+      a->channel = sim_channel(r);
+      a->start = now;
+      a->end = now + res;
+      a->size = size;
+      a->crc_error = crc_error;
+      memcpy(a->data, data, size);
+      pthread_cond_broadcast(&__cond);
+   }
+   pthread_mutex_unlock(&__mutex);
+   return res;
+}
+
+/**
+ * Inspect a register of a simulated radio (no side effects).
+ * @param r Radio.
+ * @param reg Register index.
+ * @return Register value.
+ */
+int
+sim_read_register(sim_radio_t *r, int reg)
+{
+   pthread_mutex_lock(&__mutex);
+   sim_run(sim_now());
+   int v = r->regs[reg & (SIM_REGS - 1)];
+   pthread_mutex_unlock(&__mutex);
+   return v;
+}
+
+/**
+ * Allocate a simulated handler.
+ * Must be called with the simulator lock held.
+ * @return Handler, or -1 if no more handlers.
+ */
+static int
+sim_fd_alloc(sim_radio_t *r, int use)
+{
+   int i;
+   for(i=0; i<SIM_MAX_FDS; i++) {
+      if(__fds[i].use != SIM_FD_FREE) continue;
+      __fds[i].use = use;
+      __fds[i].radio = r;
+      __fds[i].value = 1;
+      return SIM_FD_BASE + i;
+   }
+   return -1;
+}
+
+/**
+ * Find a simulated handler.
+ * @return Handler data, or NULL if invalid.
+ */
+static sim_fd_t *
+sim_fd(int fd)
+{
+   fd -= SIM_FD_BASE;
+   if((fd < 0) || (fd >= SIM_MAX_FDS) || (__fds[fd].use == SIM_FD_FREE)) return NULL;
+   return &__fds[fd];
+}
+
+/**
+ * Release a simulated handler.
+ */
+static void
+sim_fd_free(int fd)
+{
+   pthread_mutex_lock(&__mutex);
+   sim_fd_t *f = sim_fd(fd);
+   if(f != NULL) f->use = SIM_FD_FREE;
+   pthread_mutex_unlock(&__mutex);
+}
+
+/*
+ * SPI transport: the device name selects the radio.
+ */
+static int
+sim_spi_open(char *device, int hw_cs)
+{
+   int i, fd = -1;
+   (void)hw_cs;
+   pthread_mutex_lock(&__mutex);
+   for(i=0; i<__nradios; i++)
+      if(!strcmp(__radios[i]->spi_device, device)) fd = sim_fd_alloc(__radios[i], SIM_FD_SPI);
+   pthread_mutex_unlock(&__mutex);
+   return fd;
+}
+
+/*
+ * Each transfer is an address byte (bit 7 set for writes) and a burst of
+ * data. Addresses other than the FIFO are incremented along the burst.
+ */
+static int
+sim_spi_message(int fd, struct spi_ioc_transfer *xfer, int count)
+{
+   int i, j, res = 0;
+
+   pthread_mutex_lock(&__mutex);
+   sim_fd_t *f = sim_fd(fd);
+   if((f == NULL) || (f->use != SIM_FD_SPI)) {
+      pthread_mutex_unlock(&__mutex);
+      return -1;
+   }
+
+   sim_radio_t *r = f->radio;
+   uint64_t now = sim_now();
+   sim_run(now);
+
+   for(i=0; i<count; i++) {
+      uint8_t *tx = (uint8_t *)(uintptr_t)xfer[i].tx_buf;
+      uint8_t *rx = (uint8_t *)(uintptr_t)xfer[i].rx_buf;
+      int len = xfer[i].len;
+      res += len;
+      if((tx == NULL) || (len == 0)) continue;
+
+      int reg = tx[0] & 0x7f;
+      int write = tx[0] & 0x80;
+      if(rx != NULL) rx[0] = 0;
+      for(j=1; j<len; j++) {
+         int v = 0;
+         if(r->in_reset) v = 0;
+         else if(write) sim_write(r, reg, tx[j], now);
+         else v = sim_read(r, reg);
+         if(rx != NULL) rx[j] = v;
+         if(reg != REG_FIFO) reg = (reg + 1) & (SIM_REGS - 1);
+      }
+   }
+
+   /*
+    * Waiters must see the new state (mode changes, cleared flags...).
+    */
+   pthread_cond_broadcast(&__cond);
+   pthread_mutex_unlock(&__mutex);
+   return res;
+}
+
+static void
+sim_spi_close(int fd)
+{
+   sim_fd_free(fd);
+}
+
+/*
+ * GPIO transport: pins are identified by number only. The reset and DIO0
+ * pins of the radios are connected; any other pin is a plain latch.
+ */
+static int
+sim_gpio_open(char *device, int pin, int output)
+{
+   int i, fd;
+   sim_radio_t *r = NULL;
+   int use = SIM_FD_PIN;
+   (void)device;
+
+   pthread_mutex_lock(&__mutex);
+   for(i=0; i<__nradios; i++) {
+      if(output && (__radios[i]->rst_pin == pin)) {
+         r = __radios[i];
+         use = SIM_FD_RST;
+      } else if(!output && (__radios[i]->irq_pin == pin)) {
+         r = __radios[i];
+         use = SIM_FD_IRQ;
+      }
+   }
+   fd = sim_fd_alloc(r, use);
+   pthread_mutex_unlock(&__mutex);
+   return fd;
+}
+
+static int
+sim_gpio_close(int pin, int fd)
+{
+   (void)pin;
+   sim_fd_free(fd);
+   return 1;
+}
+
+static void
+sim_gpio_output(int fd, int val)
+{
+   pthread_mutex_lock(&__mutex);
+   sim_fd_t *f = sim_fd(fd);
+   if(f != NULL) {
+      f->value = val ? 1 : 0;
+      if(f->use == SIM_FD_RST) {
+         sim_radio_t *r = f->radio;
+         if(!val) {
+            r->in_reset = 1;
+         } else if(r->in_reset) {
+            /*
+             * Reset pulse finished.
+             */
+            sim_abort_tx(r, sim_now());
+            sim_reset_registers(r);
+            r->in_reset = 0;
+            pthread_cond_broadcast(&__cond);
+         }
+      }
+   }
+   pthread_mutex_unlock(&__mutex);
+}
+
+static int
+sim_gpio_input(int fd)
+{
+   int res = -1;
+   pthread_mutex_lock(&__mutex);
+   sim_fd_t *f = sim_fd(fd);
+   if(f != NULL) {
+      if(f->use == SIM_FD_IRQ) {
+         sim_run(sim_now());
+         res = sim_dio0(f->radio);
+      } else res = f->value;
+   }
+   pthread_mutex_unlock(&__mutex);
+   return res;
+}
+
+static void
+sim_unlock(void *arg)
+{
+   (void)arg;
+   pthread_mutex_unlock(&__mutex);
+}
+
+/*
+ * DIO0 is a level: the wait returns as soon as the line is at the level
+ * after the edge. The simulation advances while waiting.
+ */
+static int
+sim_gpio_wait(int pin, int fd, int rising, int timeout)
+{
+   struct timespec ts;
+   int res = -1;
+   (void)pin;
+
+   pthread_mutex_lock(&__mutex);
+   pthread_cleanup_push(sim_unlock, NULL);
+
+   sim_fd_t *f = sim_fd(fd);
+   uint64_t now = sim_now();
+   uint64_t deadline = (timeout >= 0) ? now + (uint64_t)timeout * 1000 : 0;
+
+   while((f != NULL) && (f->use == SIM_FD_IRQ)) {
+      uint64_t t = sim_run(now);
+      if(sim_dio0(f->radio) == (rising ? 1 : 0)) {
+         res = 1;
+         break;
+      }
+      if(deadline && (now >= deadline)) {
+         res = 0;
+         break;
+      }
+
+      if(deadline && (!t || (deadline < t))) t = deadline;
+      if(t) {
+         ts.tv_sec = t / 1000000;
+         ts.tv_nsec = (t % 1000000) * 1000;
+         pthread_cond_timedwait(&__cond, &__mutex, &ts);
+      } else pthread_cond_wait(&__cond, &__mutex);
+      now = sim_now();
+   }
+
+   pthread_cleanup_pop(1);
+   return res;
+}
@@ -1,13 +1,46 @@
 
+#include "gpio.h"
+#include "spi.h"
 #include <stdint.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <string.h>
 #include <sys/ioctl.h>
 #include <linux/types.h>
 #include <linux/spi/spidev.h>
 
 #define LORA_SPI_HZ        8000000              // up to 10 MHz, but got some bugs in 10 MHz 
 
+static int spidev_open(char *device, int hw_cs);
+static int spidev_message(int fd, struct spi_ioc_transfer *xfer, int count);
+static void spidev_close(int fd);
+
+/*
+ * Kernel spidev transport (default).
+ */
+static spi_transport_t __spidev = { spidev_open, spidev_message, spidev_close };
+static spi_transport_t *__transport = &__spidev;
+
+/**
+ * Select the transport used by all SPI functions.
+ * Must be called before opening any channel.
+ * @param t Transport, or NULL for the kernel spidev driver.
+ */
+void
+spi_set_transport(spi_transport_t *t)
+{
+   __transport = t ? t : &__spidev;
+}
+
+/**
+ * Transport currently used by the SPI functions.
+ */
+spi_transport_t *
+spi_get_transport(void)
+{
+   return __transport;
+}
+
 /*
  * Perform a full-duplex transfer on the SPI channel.
  * @param fd File handler of the SPI device.
@@ -27,22 +60,55 @@ spi_transfer(int fd, uint8_t *tx, uint8_t *rx, int size)
       .bits_per_word = 8
    };
 
-   ioctl(fd, SPI_IOC_MESSAGE(1), &tr);
+   __transport->message(fd, &tr, 1);
 }
 
 /**
  * Open and configure a SPI channel for use.
+ * Chip select is not driven by the kernel (see spi_open()).
  * @param device Device file name, like /dev/spidev0.0
  * @return Positive file handler if sucessful, negative if error.
  */
 int 
 spi_init(char *device)
+{
+   return spi_open(device, 0);
+}
+
+/**
+ * Open and configure a SPI channel for use.
+ * @param device Device file name, like /dev/spidev0.0
+ * @param hw_cs Non-zero to let spidev drive the chip select line of the channel,
+ * zero if chip select is controlled through a GPIO by the caller.
+ * @return Positive file handler if sucessful, negative if error.
+ */
+int 
+spi_open(char *device, int hw_cs)
+{
+   return __transport->open(device, hw_cs);
+}
+
+/**
+ * Close a SPI channel.
+ * @param fd File handler of the SPI device.
+ */
+void
+spi_close(int fd)
+{
+   if(fd >= 0) __transport->close(fd);
+}
+
+/*
+ * Open a spidev device file (see spi_open()).
+ */
+static int 
+spidev_open(char *device, int hw_cs)
 {
    int fd = open(device, O_RDWR);
    if(fd < 0) return fd;
 
    int res;
-   uint8_t val = SPI_NO_CS;
+   uint8_t val = hw_cs ? SPI_MODE_0 : SPI_NO_CS;
    res = ioctl(fd, SPI_IOC_WR_MODE, &val);
    if(res < 0) {
       close(fd);
@@ -66,3 +132,105 @@ spi_init(char *device)
    return fd;
 }
 
+/*
+ * Submit transfers to the spidev driver in a single ioctl.
+ */
+static int
+spidev_message(int fd, struct spi_ioc_transfer *xfer, int count)
+{
+   return ioctl(fd, SPI_IOC_MESSAGE(count), xfer);
+}
+
+static void
+spidev_close(int fd)
+{
+   close(fd);
+}
+
+/**
+ * Start a new (empty) SPI transaction.
+ * @param m Transaction to initialize.
+ * @param fd File handler of the SPI device.
+ * @param cs Control file handler of the chip select GPIO, or negative
+ * if the chip select is driven by spidev.
+ */
+void
+spi_msg_init(spi_msg_t *m, int fd, int cs)
+{
+   m->fd = fd;
+   m->cs = cs;
+   m->count = 0;
+   m->used = 0;
+   m->overflow = 0;
+}
+
+/**
+ * Queue a transfer into a transaction.
+ * A transfer is an address byte followed by a block of data.
+ * The data is copied, so it may be reused right after the call.
+ * @param m Transaction.
+ * @param addr Address byte (register index plus read/write flag).
+ * @param data Data to send after the address, or NULL to send 0xff bytes.
+ * @param size Size in bytes of the data block.
+ * @return Pointer to where the bytes received during the data block will be
+ * available after spi_msg_submit(), or NULL if the transaction is full
+ * (the overflow flag of the transaction is then set).
+ */
+uint8_t *
+spi_msg_add(spi_msg_t *m, uint8_t addr, uint8_t *data, int size)
+{
+   if((m->count >= SPI_MSG_MAX_XFERS) || (m->used + size + 1 > SPI_MSG_MAX_BYTES)) {
+      m->overflow = 1;
+      return NULL;
+   }
+
+   uint8_t *out = m->tx + m->used;
+   uint8_t *in = m->rx + m->used;
+   out[0] = addr;
+   if(data != NULL) memcpy(out + 1, data, size);
+   else memset(out + 1, 0xff, size);
+
+   struct spi_ioc_transfer *tr = &m->xfer[m->count++];
+   memset(tr, 0, sizeof(*tr));
+   tr->tx_buf = (unsigned long)out;
+   tr->rx_buf = (unsigned long)in;
+   tr->len = size + 1;
+   tr->speed_hz = LORA_SPI_HZ;
+   tr->bits_per_word = 8;
+
+   m->used += size + 1;
+   return in + 1;
+}
+
+/**
+ * Execute all queued transfers and empty the transaction.
+ * With kernel-managed chip select the whole sequence costs a single ioctl,
+ * with chip select toggled between transfers (cs_change).
+ * Otherwise each transfer is framed by the chip select GPIO.
+ * @param m Transaction.
+ * @return Non-negative if successful, negative if error.
+ */
+int
+spi_msg_submit(spi_msg_t *m)
+{
+   int i, res = 0;
+
+   if(m->count == 0) return 0;
+
+   if(m->cs < 0) {
+      for(i=0; i<m->count-1; i++)
+         m->xfer[i].cs_change = 1;
+      res = __transport->message(m->fd, m->xfer, m->count);
+   } else {
+      for(i=0; i<m->count; i++) {
+         gpio_output(m->cs, 0);
+         res = __transport->message(m->fd, &m->xfer[i], 1);
+         gpio_output(m->cs, 1);
+         if(res < 0) break;
+      }
+   }
+
+   m->count = 0;
+   m->used = 0;
+   return res;
+}